@@ -1,13 +1,637 @@
 #include "PicoPixelClient.h"
 #include "PicoPixelClientProtocol.h"
 #include <process.h>
+#include <mswsock.h>
+#include <mstcpip.h>
+#include <afunix.h>
 #include <iostream>
 #include <vector>
-#include <sstream>
+#include <map>
+#include <set>
+#include <cfloat>
+#include <cmath>
+#include <new>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+# include <intrin.h>
+# include <immintrin.h>
+# define PICO_PIXEL_CLIENT_X86
+#elif defined(_M_ARM64) || defined(__aarch64__)
+# include <arm_neon.h>
+# define PICO_PIXEL_CLIENT_NEON
+#endif
+
+#pragma comment(lib, "Mswsock.lib")
 
 static const char* PIXEL_PRINTF_CLIENT_FILE_NAME = "Pixel-PrintF-Image";
 static const int PIXEL_PRINTF_RECV_TIMEOUT  = 1000;
 static const int PIXEL_PRINTF_RECV_TRIALS   = 3;
+static const int PIXEL_PRINTF_MAX_NAME_SIZE = 4096;
+static const int PIXEL_PRINTF_MAX_WORKERS   = 8;
+static const int PIXEL_PRINTF_FILE_CHUNK    = 64 * 1024 * 1024;  // TransmitFile and file mapping window size
+static const int PIXEL_PRINTF_SEND_CHUNK    = 1024 * 1024 * 1024;
+static const int PIXEL_PRINTF_MAX_FREE_PACKETS = 16;
+static const int PIXEL_PRINTF_FLUSH_TIMEOUT = 5000;
+static const int PIXEL_PRINTF_MAX_QUEUED_BYTES = 512 * 1024 * 1024;  // Default bound of the images waiting to be sent
+static const int PIXEL_PRINTF_LATENCY_BUCKETS = 40;
+static const int PIXEL_PRINTF_MAX_PENDING_ACKS = 1024;
+static const int PIXEL_PRINTF_MIN_SEND_BUFFER = 64 * 1024;
+static const int PIXEL_PRINTF_MAX_SEND_BUFFER = 64 * 1024 * 1024;
+static const int PIXEL_PRINTF_TUNE_MIN_WRITE  = 256 * 1024;      // Smaller writes do not tell much about throughput
+static const int PIXEL_PRINTF_TUNE_INTERVAL   = 1000;            // Milliseconds between two send buffer adjustments
+static const int PIXEL_PRINTF_LAZY_RETRY_INTERVAL = 2000;        // Milliseconds between two failed lazy connections
+static const int PIXEL_PRINTF_MAX_IMAGE_NAMES = 4096;
+static const int PIXEL_PRINTF_MAX_MARKER_GROUPS = 1024;
+static const int PIXEL_PRINTF_PRIORITY_COUNT  = 3;
+static const int PIXEL_PRINTF_SCHEDULE_CHUNK  = 256 * 1024;      // Largest write a high priority image may wait for
+static const int PIXEL_PRINTF_MAX_FLIGHT_RECORDS = 4096;
+static const int PIXEL_PRINTF_ZERO_COPY_MIN_SIZE = 256 * 1024;   // Smaller packages are copied to the send buffer
+static const int PIXEL_PRINTF_MAX_OVERLAPPED_SENDS = 16;
+static const int PIXEL_PRINTF_DIFFERENCE_CHUNK = 256;           // Pixels compared at a time
+static const int PIXEL_PRINTF_POOL_MIN_SIZE   = 4096;            // Size of the smallest pooled buffer
+static const int PIXEL_PRINTF_POOL_CLASS_COUNT = sizeof(size_t) >= 8 ? 4 * 27 : 4 * 20; // Largest class 448GB, 3.5GB on 32-bit
+
+// Virtual time a byte costs to each PicoPixelClient::ImagePriority: the inverse of its share of the bandwidth.
+static const UINT64 pixel_printf_priority_costs[PIXEL_PRINTF_PRIORITY_COUNT] = { 64, 8, 1 };
+
+// Monotonic clock in microseconds.
+static UINT64 MonotonicMicroseconds()
+{
+  LARGE_INTEGER counter;
+  LARGE_INTEGER frequency;
+  QueryPerformanceCounter(&counter);
+  QueryPerformanceFrequency(&frequency);
+
+  UINT64 ticks = (UINT64)counter.QuadPart;
+  UINT64 ticks_per_second = (UINT64)frequency.QuadPart;
+  return (ticks / ticks_per_second) * 1000000 + ((ticks % ticks_per_second) * 1000000) / ticks_per_second;
+}
+
+// Distribution of latencies in microseconds. Bucket i counts the latencies in [2^i, 2^(i+1)), bucket 0 also
+// counts 0.
+struct LatencyHistogram
+{
+  unsigned int  count;
+  UINT64        sum_us;
+  UINT64        min_us;
+  UINT64        max_us;
+  unsigned int  buckets[PIXEL_PRINTF_LATENCY_BUCKETS];
+
+  LatencyHistogram()
+  {
+    Reset();
+  }
+
+  void Reset()
+  {
+    count = 0;
+    sum_us = 0;
+    min_us = 0;
+    max_us = 0;
+    for (int i = 0; i < PIXEL_PRINTF_LATENCY_BUCKETS; ++i)
+    {
+      buckets[i] = 0;
+    }
+  }
+
+  void Add(UINT64 latency_us)
+  {
+    int bucket = 0;
+    while ((bucket < PIXEL_PRINTF_LATENCY_BUCKETS - 1) && ((latency_us >> (bucket + 1)) != 0))
+    {
+      ++bucket;
+    }
+
+    min_us = (count == 0 || latency_us < min_us) ? latency_us : min_us;
+    max_us = (count == 0 || latency_us > max_us) ? latency_us : max_us;
+    sum_us += latency_us;
+    ++count;
+    ++buckets[bucket];
+  }
+
+  // Interpolates linearly inside the bucket holding the percentile.
+  double Percentile(double fraction) const
+  {
+    double target = fraction * count;
+    double seen = 0.0;
+    for (int i = 0; i < PIXEL_PRINTF_LATENCY_BUCKETS; ++i)
+    {
+      if ((buckets[i] > 0) && (seen + buckets[i] >= target))
+      {
+        double low = (i == 0) ? 0.0 : (double)((UINT64)1 << i);
+        double high = (double)((UINT64)2 << i);
+        double value = low + (high - low) * (target - seen) / buckets[i];
+        value = value < (double)min_us ? (double)min_us : value;
+        value = value > (double)max_us ? (double)max_us : value;
+        return value;
+      }
+      seen += buckets[i];
+    }
+    return (double)max_us;
+  }
+
+  void Statistics(PicoPixelClient::LatencyStatistics& statistics) const
+  {
+    statistics.count = count;
+    statistics.min_ms = min_us / 1000.0;
+    statistics.max_ms = max_us / 1000.0;
+    statistics.mean_ms = count > 0 ? (sum_us / 1000.0) / count : 0.0;
+    statistics.p50_ms = count > 0 ? Percentile(0.50) / 1000.0 : 0.0;
+    statistics.p90_ms = count > 0 ? Percentile(0.90) / 1000.0 : 0.0;
+    statistics.p99_ms = count > 0 ? Percentile(0.99) / 1000.0 : 0.0;
+  }
+};
+
+static void* DefaultAllocate(size_t size, void* allocator_data)
+{
+  return malloc(size);
+}
+
+static void DefaultDeallocate(void* ptr, size_t size, void* allocator_data)
+{
+  free(ptr);
+}
+
+// Size classed buffers shared by the SDK. Released buffers are kept for reuse so that capturing the same
+// images frame after frame does not allocate. Kept buffers count in the budget: they are freed when a
+// buffer of another class would not fit in it otherwise.
+struct BufferPool
+{
+  // Buffers of at least 'PIXEL_PRINTF_POOL_MIN_SIZE' bytes hold the link of the free list once released.
+  struct FreeBuffer
+  {
+    FreeBuffer* next;
+    size_t      size;
+  };
+
+  CRITICAL_SECTION          lock;
+  PicoPixelClient::Allocator allocator;
+  FreeBuffer*               free_lists[PIXEL_PRINTF_POOL_CLASS_COUNT];
+  UINT64                    budget;             //!< 0 for no budget.
+  UINT64                    allocated;          //!< Bytes obtained from the allocator, in use or kept.
+  UINT64                    in_use;
+  UINT64                    peak_allocated;
+  UINT64                    allocation_count;
+  unsigned int              failed_allocations;
+
+  BufferPool()
+    : budget(0)
+    , allocated(0)
+    , in_use(0)
+    , peak_allocated(0)
+    , allocation_count(0)
+    , failed_allocations(0)
+  {
+    InitializeCriticalSection(&lock);
+    allocator.allocate = DefaultAllocate;
+    allocator.deallocate = DefaultDeallocate;
+    allocator.allocator_data = NULL;
+    for (int i = 0; i < PIXEL_PRINTF_POOL_CLASS_COUNT; ++i)
+    {
+      free_lists[i] = NULL;
+    }
+  }
+
+  ~BufferPool()
+  {
+    FreeKept(allocated);
+    DeleteCriticalSection(&lock);
+  }
+
+  //! Four classes per power of two, so a buffer wastes less than a quarter of its size.
+  static size_t ClassSize(int size_class)
+  {
+    int octave = size_class / 4;
+    int step = size_class % 4;
+    return ((size_t)PIXEL_PRINTF_POOL_MIN_SIZE << octave) + (size_t)step * ((size_t)PIXEL_PRINTF_POOL_MIN_SIZE / 4 << octave);
+  }
+
+  //! Returns -1 if 'size' is larger than the largest class.
+  static int SizeClass(size_t size)
+  {
+    for (int size_class = 0; size_class < PIXEL_PRINTF_POOL_CLASS_COUNT; ++size_class)
+    {
+      if (ClassSize(size_class) >= size)
+        return size_class;
+    }
+    return -1;
+  }
+
+  //! Returns a buffer of at least 'size' bytes and its actual 'capacity'. Returns NULL over budget.
+  char* Acquire(size_t size, size_t& capacity)
+  {
+    int size_class = SizeClass(size);
+    if (size_class < 0)
+      return NULL;
+
+    size_t class_size = ClassSize(size_class);
+    EnterCriticalSection(&lock);
+    FreeBuffer* kept = free_lists[size_class];
+    if (kept != NULL)
+    {
+      free_lists[size_class] = kept->next;
+      in_use += class_size;
+      LeaveCriticalSection(&lock);
+      capacity = class_size;
+      return (char*)kept;
+    }
+    LeaveCriticalSection(&lock);
+
+    char* buffer = Allocate(class_size);
+    if (buffer != NULL)
+    {
+      capacity = class_size;
+    }
+    return buffer;
+  }
+
+  void Release(char* buffer, size_t capacity)
+  {
+    int size_class = SizeClass(capacity);
+    EnterCriticalSection(&lock);
+    bool over_budget = (budget > 0) && (allocated > budget);
+    if (!over_budget)
+    {
+      FreeBuffer* kept = (FreeBuffer*)buffer;
+      kept->next = free_lists[size_class];
+      kept->size = capacity;
+      free_lists[size_class] = kept;
+      in_use -= capacity;
+    }
+    LeaveCriticalSection(&lock);
+
+    // The budget was lowered: give the memory back.
+    if (over_budget)
+    {
+      Free(buffer, capacity);
+    }
+  }
+
+  //! Allocates a buffer that is not kept for reuse once freed, within the budget.
+  char* Allocate(size_t size)
+  {
+    EnterCriticalSection(&lock);
+    if ((budget > 0) && (allocated + size > budget))
+    {
+      FreeKept(allocated + size - budget);
+    }
+
+    bool fits = (budget == 0) || (allocated + size <= budget);
+    if (fits)
+    {
+      // Reserve the bytes so that other threads see them while the allocator runs.
+      allocated += size;
+      in_use += size;
+    }
+    else
+    {
+      ++failed_allocations;
+    }
+    LeaveCriticalSection(&lock);
+
+    if (!fits)
+      return NULL;
+
+    char* buffer = (char*)allocator.allocate(size, allocator.allocator_data);
+    EnterCriticalSection(&lock);
+    if (buffer != NULL)
+    {
+      ++allocation_count;
+      peak_allocated = allocated > peak_allocated ? allocated : peak_allocated;
+    }
+    else
+    {
+      allocated -= size;
+      in_use -= size;
+      ++failed_allocations;
+    }
+    LeaveCriticalSection(&lock);
+    return buffer;
+  }
+
+  void Free(char* buffer, size_t size)
+  {
+    allocator.deallocate(buffer, size, allocator.allocator_data);
+    EnterCriticalSection(&lock);
+    allocated -= size;
+    in_use -= size;
+    LeaveCriticalSection(&lock);
+  }
+
+  //! Frees kept buffers, largest first, until 'size' bytes are freed or none is left.
+  void FreeKept(UINT64 size)
+  {
+    EnterCriticalSection(&lock);
+    UINT64 freed = 0;
+    for (int size_class = PIXEL_PRINTF_POOL_CLASS_COUNT - 1; (size_class >= 0) && (freed < size); --size_class)
+    {
+      while ((free_lists[size_class] != NULL) && (freed < size))
+      {
+        FreeBuffer* kept = free_lists[size_class];
+        free_lists[size_class] = kept->next;
+        size_t kept_size = kept->size;
+        allocator.deallocate(kept, kept_size, allocator.allocator_data);
+        allocated -= kept_size;
+        freed += kept_size;
+      }
+    }
+    LeaveCriticalSection(&lock);
+  }
+};
+
+// A package ready to go on the wire. A producer thread fills a packet on its own, then pushes it to the send
+// queue. The sender thread writes each packet to the socket in one piece, or in PackageChunkHeader chunks when
+// image priorities are in use, so packages from different threads never mix. Packets are recycled through a
+// free list and their buffer goes back to the pool.
+struct SendPacket
+{
+  SLIST_ENTRY   entry;        //!< Must be first. Link in the send queue and in the free list.
+  SendPacket*   next;         //!< Link in the sender thread's FIFO list.
+  BufferPool*   pool;
+  char*         data;
+  size_t        size;
+  size_t        capacity;
+  HANDLE        file;         //!< Optional file data sent after 'data'. The sender thread closes the handle.
+  UINT64        file_offset;
+  UINT64        file_size;
+  bool          needs_credit;         //!< Image packages are subject to flow control.
+  unsigned int  name_id;              //!< Registered image name the package refers to, 0 otherwise.
+  int           priority;             //!< PicoPixelClient::ImagePriority.
+  int           protocol_version;     //!< Dropped on connections to viewers reading older versions only.
+  UINT64        write_offset;         //!< Bytes of the package already written. Sender thread only.
+  unsigned int  chunk_stream;         //!< PackageChunkHeader::stream_id while the package is written in chunks.
+  LONG          chunk_generation;     //!< Connection the first chunk went to.
+  UINT64        send_begin;
+  bool          in_flight;            //!< Written by an overlapped send that has not completed. Sender thread only.
+  UINT64        trace_sequence;       //!< PixelTimingExtension::sequence of a traced image, 0 otherwise.
+  UINT64        trace_capture_time;
+  std::string   image_name;           //!< Name of an image package. Held images are replaced by newer ones of the same name.
+
+  SendPacket(BufferPool* buffer_pool)
+    : next(NULL)
+    , pool(buffer_pool)
+    , data(NULL)
+    , size(0)
+    , capacity(0)
+    , file(NULL)
+    , file_offset(0)
+    , file_size(0)
+    , needs_credit(false)
+    , name_id(0)
+    , priority(PicoPixelClient::IMAGE_PRIORITY_NORMAL)
+    , protocol_version(1)
+    , write_offset(0)
+    , chunk_stream(0)
+    , chunk_generation(0)
+    , send_begin(0)
+    , in_flight(false)
+    , trace_sequence(0)
+    , trace_capture_time(0)
+  {}
+
+  ~SendPacket()
+  {
+    ReleaseData();
+  }
+
+  void ReleaseData()
+  {
+    if (data != NULL)
+    {
+      pool->Release(data, capacity);
+      data = NULL;
+      capacity = 0;
+    }
+  }
+
+  void Clear()
+  {
+    next = NULL;
+    size = 0;
+    file = NULL;
+    file_offset = 0;
+    file_size = 0;
+    needs_credit = false;
+    name_id = 0;
+    priority = PicoPixelClient::IMAGE_PRIORITY_NORMAL;
+    protocol_version = 1;
+    write_offset = 0;
+    chunk_stream = 0;
+    chunk_generation = 0;
+    send_begin = 0;
+    in_flight = false;
+    trace_sequence = 0;
+    trace_capture_time = 0;
+    image_name.clear();
+  }
+
+  //! Grows the packet by 'byte_count' bytes and returns a pointer to them. Returns NULL when out of memory.
+  char* Append(size_t byte_count)
+  {
+    if (size + byte_count > capacity)
+    {
+      size_t new_capacity = capacity * 2 > size + byte_count ? capacity * 2 : size + byte_count;
+      size_t pool_capacity = 0;
+      char* new_data = pool->Acquire(new_capacity, pool_capacity);
+      if (new_data == NULL)
+        return NULL;
+      if (size > 0)
+      {
+        std::memcpy(new_data, data, size);
+      }
+      ReleaseData();
+      data = new_data;
+      capacity = pool_capacity;
+    }
+
+    char* ptr = data + size;
+    size += byte_count;
+    return ptr;
+  }
+
+  bool Append(const void* src, size_t byte_count)
+  {
+    char* dst = Append(byte_count);
+    if (dst == NULL)
+      return false;
+    std::memcpy(dst, src, byte_count);
+    return true;
+  }
+
+  bool AppendString(const std::string& str)
+  {
+    int str_size = (int)str.size() + 1;           // +1 for null terminated string
+    return Append(&str_size, sizeof(int)) && Append(str.c_str(), str_size);
+  }
+};
+
+// An overlapped send of a whole package. The package stays out of the free list until the send completes.
+struct OverlappedSend
+{
+  WSAOVERLAPPED overlapped;           //!< Its event is created with the sender thread.
+  SendPacket*   packet;
+  SOCKET        socket;
+  UINT64        size;
+};
+
+// Packets of one priority waiting for the sender thread, in submission order.
+struct SendStream
+{
+  SendPacket*   head;
+  SendPacket*   tail;
+  UINT64        virtual_time;         //!< Advanced by the cost of the bytes written. The stream that is behind goes next.
+  bool          held;                 //!< Waiting for flow control credits.
+
+  SendStream()
+    : head(NULL)
+    , tail(NULL)
+    , virtual_time(0)
+    , held(false)
+  {}
+};
+
+// Keeps the last frames of selected images in memory allocated once. Images are stored one after the other in
+// a ring buffer and a new image evicts the oldest ones it overlaps. An image never wraps around the end of the
+// ring: when it does not fit at the end it goes to the beginning.
+struct FlightRecorder
+{
+  struct Record
+  {
+    size_t          offset;
+    PixelInfoHeader header;         //!< 'pitch' is the size of the stored rows.
+    int             frame;
+    int             name_index;
+  };
+
+  BufferPool*         pool;
+  char*               ring;
+  size_t              ring_size;
+  size_t              write_offset;
+  std::vector<Record> records;      //!< Ring of records, oldest at 'first_record'.
+  int                 first_record;
+  int                 record_count;
+  int                 frame_count;
+  std::map<std::string, int> name_indices;
+  std::vector<std::string> names;
+
+  FlightRecorder()
+    : pool(NULL)
+    , ring(NULL)
+    , ring_size(0)
+    , write_offset(0)
+    , first_record(0)
+    , record_count(0)
+    , frame_count(0)
+  {}
+
+  ~FlightRecorder()
+  {
+    Stop();
+  }
+
+  bool Start(int frames, size_t size, BufferPool* buffer_pool)
+  {
+    Stop();
+    pool = buffer_pool;
+    ring = pool->Allocate(size);
+    if (ring == NULL)
+      return false;
+
+    ring_size = size;
+    frame_count = frames;
+    records.resize(PIXEL_PRINTF_MAX_FLIGHT_RECORDS);
+    return true;
+  }
+
+  void Stop()
+  {
+    if (ring != NULL)
+    {
+      pool->Free(ring, ring_size);
+    }
+    ring = NULL;
+    ring_size = 0;
+    write_offset = 0;
+    first_record = 0;
+    record_count = 0;
+  }
+
+  const Record& RecordAt(int index) const
+  {
+    return records[(first_record + index) % records.size()];
+  }
+
+  static size_t RecordSize(const Record& record)
+  {
+    return (size_t)record.header.pitch * PixelInfoRowCount(record.header.pixel_format, record.header.height);
+  }
+
+  void EvictOldest()
+  {
+    first_record = (first_record + 1) % (int)records.size();
+    --record_count;
+  }
+
+  //! Evicts the frames older than the last 'frame_count' frames before 'frame'.
+  void EvictFrames(int frame)
+  {
+    while ((record_count > 0) && (RecordAt(0).frame <= frame - frame_count))
+    {
+      EvictOldest();
+    }
+  }
+
+  //! Makes room for a new record and returns where to copy its rows. Returns NULL if the image is too large.
+  char* Allocate(const PixelInfoHeader& header, int frame, int name_index)
+  {
+    size_t size = (size_t)header.pitch * PixelInfoRowCount(header.pixel_format, header.height);
+    if ((ring == NULL) || (size > ring_size))
+      return NULL;
+
+    EvictFrames(frame);
+    if (record_count == (int)records.size())
+    {
+      EvictOldest();
+    }
+
+    size_t begin = write_offset;
+    if (begin + size > ring_size)
+    {
+      // The end of the ring is skipped. The records left there are older than the ones at the beginning.
+      while ((record_count > 0) && (RecordAt(0).offset >= begin))
+      {
+        EvictOldest();
+      }
+      begin = 0;
+    }
+
+    while ((record_count > 0) && (RecordAt(0).offset < begin + size) && (RecordAt(0).offset + RecordSize(RecordAt(0)) > begin))
+    {
+      EvictOldest();
+    }
+
+    Record& record = records[(first_record + record_count) % records.size()];
+    record.offset = begin;
+    record.header = header;
+    record.frame = frame;
+    record.name_index = name_index;
+    ++record_count;
+
+    write_offset = begin + size;
+    return ring + begin;
+  }
+};
+
+// Markers named like paths, "frame/shadow/cascade2", belong to the groups of their path: "frame/shadow" and
+// "frame". Arming or resetting a group only stamps it with a new generation. Markers apply the newest stamp of
+// their groups when they are next used, so bulk operations take the same time whatever the number of markers.
+struct MarkerGroup
+{
+  std::string       name;
+  int               parent;           //!< -1 for a top level group.
+  volatile LONG     generation;       //!< Generation of the last arm or reset. 0 if never armed.
+  volatile LONGLONG arm;              //!< Generation in the high 32 bits and use count in the low 32 bits, read together.
+};
 
 struct PicoPixelClient::Impl
 {
@@ -21,37 +645,415 @@ struct PicoPixelClient::Impl
     , client_side_connection_termination_(false)
     , auto_reconnect_on_picopixel_shutdown_(false)
     , trying_to_reconnect_to_pico_pixel_(false)
-  {}
+    , half_float_packing_(false)
+    , block_compression_(PicoPixelClient::PIXEL_FORMAT_UNKNOWN)
+    , latency_tracing_(false)
+    , image_sequence_(0)
+    , flow_control_(PicoPixelClient::FLOW_CONTROL_OFF)
+    , flow_control_max_images_(0)
+    , flow_control_max_bytes_(0)
+    , image_credits_limited_(false)
+    , byte_credits_limited_(false)
+    , credit_generation_(0)
+    , image_credits_(0)
+    , byte_credits_(0)
+    , dropped_images_(0)
+    , viewer_protocol_version_(1)
+    , no_delay_(false)
+    , send_buffer_size_(0)
+    , throughput_(0.0)
+    , rtt_us_(0)
+    , ideal_backlog_(0)
+    , last_tune_time_(0)
+    , acked_bytes_(0)
+    , acked_time_us_(0)
+    , zero_copy_max_bytes_(0)
+    , first_overlapped_send_(0)
+    , overlapped_send_count_(0)
+    , overlapped_bytes_(0)
+    , lazy_connection_(false)
+    , lazy_port_(0)
+    , connector_thread_(NULL)
+    , connect_request_event_(NULL)
+    , lazy_connecting_(0)
+    , connector_exit_(false)
+    , last_connect_failure_(0)
+    , sender_thread_(NULL)
+    , send_event_(NULL)
+    , credit_event_(NULL)
+    , queued_packets_(0)
+    , queued_bytes_(0)
+    , max_queued_bytes_(PIXEL_PRINTF_MAX_QUEUED_BYTES)
+    , free_packet_count_(0)
+    , sender_exit_(false)
+    , prioritized_images_(0)
+    , virtual_time_(0)
+    , next_chunk_stream_(0)
+    , flight_recording_(false)
+    , image_name_index_(0)
+    , image_name_count_(0)
+    , connection_generation_(0)
+    , sender_connection_generation_(0)
+    , frame_(0)
+    , marker_generation_(0)
+    , summary_histogram_min_(0.0f)
+    , summary_histogram_max_(1.0f)
+    , golden_tolerance_(0.0f)
+    , golden_max_different_pixels_(0)
+    , worker_wakeup_(NULL)
+    , worker_done_(NULL)
+    , worker_task_(NULL)
+    , worker_context_(NULL)
+    , worker_slice_count_(0)
+    , worker_item_count_(0)
+    , worker_next_slice_(0)
+    , worker_pending_slices_(0)
+    , workers_exit_(false)
+  {
+    InitializeCriticalSection(&markers_lock_);
+    InitializeConditionVariable(&markers_changed_);
+    InitializeCriticalSection(&marker_callbacks_lock_);
+    InitializeCriticalSection(&regions_of_interest_lock_);
+    InitializeCriticalSection(&worker_lock_);
+    InitializeCriticalSection(&latency_lock_);
+    InitializeCriticalSection(&transport_lock_);
+    InitializeCriticalSection(&address_lock_);
+    InitializeCriticalSection(&image_names_lock_);
+    InitializeCriticalSection(&priorities_lock_);
+    InitializeCriticalSection(&flight_recorder_lock_);
+    InitializeCriticalSection(&sent_lock_);
+    InitializeCriticalSection(&credit_lock_);
+    InitializeConditionVariable(&queue_drained_);
+    image_names_.reserve(PIXEL_PRINTF_MAX_IMAGE_NAMES);
+    marker_groups_.reserve(PIXEL_PRINTF_MAX_MARKER_GROUPS);
+    InitializeSListHead(&send_queue_);
+    InitializeSListHead(&free_packets_);
+  }
+
+  ~Impl()
+  {
+    StopConnector();
+    StopSender();
+    DestroyFreePackets();
+    StopWorkers();
+    DeleteCriticalSection(&credit_lock_);
+    DeleteCriticalSection(&sent_lock_);
+    DeleteCriticalSection(&flight_recorder_lock_);
+    DeleteCriticalSection(&priorities_lock_);
+    DeleteCriticalSection(&image_names_lock_);
+    DeleteCriticalSection(&address_lock_);
+    DeleteCriticalSection(&transport_lock_);
+    DeleteCriticalSection(&latency_lock_);
+    DeleteCriticalSection(&worker_lock_);
+    DeleteCriticalSection(&regions_of_interest_lock_);
+    DeleteCriticalSection(&marker_callbacks_lock_);
+    DeleteCriticalSection(&markers_lock_);
+  }
+
+  struct RegionOfInterest
+  {
+    int x;
+    int y;
+    int width;
+    int height;
+  };
+
+  struct ImageLatencyHistograms
+  {
+    LatencyHistogram queueing;
+    LatencyHistogram transfer;
+    LatencyHistogram round_trip;
+  };
+
+  struct PendingAck
+  {
+    std::string image_name;
+    UINT64 capture_time;
+  };
 
   bool Connected() const;
 
+  //! Checks and consumes the marker's trigger. Returns true when the data using the marker should be sent.
+  bool TriggerMarker(int marker_index);
+  //! Receiver thread. Stores a use count set by Pico Pixel, wakes the waiters and calls the callbacks.
+  void SetMarkerFromPicoPixel(int marker_index, int use_count);
+  //! Sets the use count of a marker. It takes precedence over the arms of its groups made before.
+  void SetMarkerUseCount(Marker& marker, int use_count);
+  //! Applies the newest arm or reset of the groups of a marker, if it is newer than the marker's use count.
+  void SyncMarkerGroups(Marker& marker);
+  //! Returns the group with the given path, created with its parents if needed. -1 for an empty name.
+  int AddMarkerGroup(const std::string& name);
+  void ArmMarkerGroup(int group_index, int use_count);
+
   bool SendRaw(const char* ptr, int size);
-  bool SendString(const std::string& str);
-  bool SendInteger(int);
+  bool SendRaw(SOCKET socket, const char* ptr, int size);
+  //! Sends two buffers with a single call so that a small header does not leave in a segment of its own.
+  bool SendRaw(const char* head, int head_size, const char* ptr, int size);
+  bool SendFile(HANDLE file, UINT64 offset, UINT64 size, const char* head, int head_size);
+  //! Starts sending a package from its own buffer. It is released by CompleteOverlappedSend.
+  bool SendOverlapped(SendPacket* packet);
+  //! Finishes the oldest overlapped send. Returns false if there is none or, unless 'wait', it is still running.
+  bool CompleteOverlappedSend(bool wait);
+  void CloseOverlappedEvents();
+  bool SendMappedFile(HANDLE file, UINT64 offset, UINT64 size, const char* head, int head_size);
 
   void FlushRecvBuffer();
   int RecvInteger(int* val, int expected_size);
   int RecvString(char* str, int expected_size, char str_terminal_char = 0);
   int RecvRaw(char* dst_buffer, unsigned int buffer_size, unsigned int timeout, bool& connection_close, bool peek = false);
 
-  void HandShake(std::string client_id);
+  void HandShake(SOCKET socket, std::string client_id);
+
+  //! Resolves a host name and port to all of its addresses, once per host and port.
+  bool Resolve(const std::string& host_ip, int port, std::vector<struct sockaddr_in>& addresses);
+  //! Connects to the first address that accepts, shakes hands and starts the client threads.
+  bool Connect(const std::vector<struct sockaddr_in>& addresses, int port);
+  bool ConnectToRelay(const std::string& path);
+  //! Shakes hands on a connected socket and starts the client threads.
+  bool Attach(SOCKET sock);
+
+  bool StartConnector();
+  void StopConnector();
+  //! True when connected. With a lazy connection, asks for the connection when none is under way.
+  bool ReadyToSend();
+  static DWORD WINAPI ConnectorThread(void* ptr);
+
+  SendPacket* AcquirePacket();
+  void ReleasePacket(SendPacket* packet);
+  void DestroyFreePackets();
+  //! Queues a packet for the sender thread. Releases it and returns false when it cannot be queued.
+  bool SubmitPacket(SendPacket* packet);
+  //! Called by the sender thread once a queued packet is written or dropped.
+  void RetirePacket(SendPacket* packet);
+  //! Waits until the queued packets are sent. Returns false on timeout.
+  bool Flush(unsigned int timeout_ms);
+  void StartSender();
+  void StopSender();
+  //! Waits for the receiver thread to end. The connection has to be closed first.
+  void StopReceiver();
+  bool WritePacket(SendPacket* packet);
+  //! Writes 'size' bytes of a package, starting at 'offset', after 'head'. The bytes may come from the file.
+  bool WriteRange(SendPacket* packet, UINT64 offset, UINT64 size, const char* head, int head_size);
+  bool WriteChunk(SendPacket* packet, UINT64& written);
+  //! Writes a packet, or its next chunk. Returns true when the sender thread is done with the packet.
+  bool WriteNext(SendPacket* packet, SendStream& stream);
+  //! Moves the packets of the send queue to the streams.
+  void QueuePackets();
+  //! The stream to write next from, or NULL when nothing can be written.
+  SendStream* NextStream();
+  //! Sends the registration of a name before the first package of a connection that uses it.
+  bool WriteImageName(unsigned int name_id);
+  //! Consumes the credits needed by a packet. Returns false if Pico Pixel has not granted enough credits.
+  bool TakeCredits(const SendPacket* packet);
+  //! Drops the credits of a previous connection. Called with credit_lock_ held.
+  void SyncCredits();
+  //! Drops the held images that a newer image of the same name, queued behind them, makes useless.
+  void ReplaceHeldImages(SendStream& stream);
+  void ReceiveFlowCredit(bool& connection_closed);
+  void ReceiveViewerHandShake(bool& connection_closed);
+
+  //! Applies the initial settings to a new socket.
+  void TuneSocket(SOCKET socket);
+  //! Called by the sender thread after each successful write. Retunes the send buffer now and then.
+  void MeasureWrite(UINT64 byte_count);
+  void AdjustSendBuffer();
+  static DWORD WINAPI SenderThread(void* ptr);
+
+  bool SendImage(const std::string& image_name,
+    unsigned int name_id,
+    PicoPixelClient::PixelFormat pixel_format,
+    int width,
+    int height,
+    int pitch,
+    BOOL srgb,
+    BOOL upside_down,
+    char* data,
+    int pixel_stride = 0,
+    int channel = -1);
+  //! Name of an image sent without one.
+  std::string UnnamedImageName();
+
+  void SetImagePriority(const std::string& image_name, PicoPixelClient::ImagePriority priority);
+  int FindImagePriority(const std::string& image_name);
+
+  //! Copies an image to the flight recorder if its name was selected.
+  void RecordFlight(const std::string& image_name,
+    PicoPixelClient::PixelFormat pixel_format,
+    int width,
+    int height,
+    int pitch,
+    BOOL srgb,
+    BOOL upside_down,
+    const char* data,
+    int pixel_stride = 0,
+    int channel = -1);
+  //! Appends the image package of a record. The name tells the frame.
+  bool AppendFlightRecord(SendPacket* packet, const FlightRecorder::Record& record);
+  //! Sends or writes the records of the last 'frame_count' frames. 0 for every record.
+  bool DumpFlightRecorder(int frame_count, HANDLE file);
+  void ReceiveFlightRecorderDump(bool& connection_closed);
+
+  void SetRegionOfInterest(const std::string& image_name, int x, int y, int width, int height);
+  bool FindRegionOfInterest(const std::string& image_name, RegionOfInterest& region);
+  void ReceiveRegionOfInterest(bool& connection_closed);
+
+  //! Adds a PixelTimingExtension to a packet whose PixelInfoHeader, already in the packet, has the timing flag.
+  bool AppendTiming(SendPacket* packet, UINT64 capture_time);
+  //! Called by the sender thread before a traced packet is written, so that its acknowledgement cannot be missed.
+  void ExpectImageAck(const SendPacket* packet);
+  void RecordSendLatency(const SendPacket* packet, UINT64 send_begin, UINT64 send_end);
+  void ReceiveImageAck(bool& connection_closed);
   
   static DWORD WINAPI ReceiverThread(void* ptr);
 
+  // Work is split in slices. Slice 'slice' processes the items [begin, end).
+  typedef void (*ParallelTask)(void* context, int slice, int begin, int end);
+
+  //! Number of slices ParallelFor splits work into. Use it to size per slice results.
+  int ParallelSliceCount();
+  //! Runs 'task' over [0, item_count) on the worker threads and the calling thread. Returns when all slices are done.
+  void ParallelFor(int item_count, ParallelTask task, void* context);
+  //! Called with worker_lock_ held.
+  void StartWorkers();
+  void StopWorkers();
+  static DWORD WINAPI WorkerThread(void* ptr);
+  void RunWorkerSlices();
+
   SOCKET sock_;
   int port_;
   std::string host_ip_;
   std::string picopixel_server_ip_;
   std::string client_id_;
+  std::string relay_path_;                //!< Set when connected through a PicoPixelRelay.
   PicoPixelClient* parent_;
   HANDLE receiver_thread_;
   DWORD thread_id_;
 
+  struct MarkerCallback
+  {
+    PicoPixelClient::MarkerChangedCallback callback;  //!< NULL once removed.
+    void* callback_data;
+  };
+
   std::vector<Marker> markers_;
+  std::map<std::string, int> marker_names_;
+  std::vector<MarkerGroup> marker_groups_;  //!< Never reallocates, so a group stays in place while read without the lock.
+  std::map<std::string, int> marker_group_names_;
+  volatile LONG marker_generation_;       //!< Stamps every use count set, on a marker or on a group.
+  volatile LONG frame_;
   bool markers_auto_sync_;
+  CRITICAL_SECTION markers_lock_;         //!< Guards the use counts set by Pico Pixel and serializes the creation of markers and groups.
+  CONDITION_VARIABLE markers_changed_;    //!< Woken when a use count is set by Pico Pixel.
+  CRITICAL_SECTION marker_callbacks_lock_;  //!< Held while the callbacks run.
+  std::vector<MarkerCallback> marker_callbacks_;  //!< Indexed by callback ID. Entries are never erased.
   bool client_side_connection_termination_;
   bool auto_reconnect_on_picopixel_shutdown_;
   bool trying_to_reconnect_to_pico_pixel_;
+  bool half_float_packing_;
+  PicoPixelClient::PixelFormat block_compression_;  //!< Block format RGBA8 and BGRA8 images are encoded to, or PIXEL_FORMAT_UNKNOWN.
+  bool latency_tracing_;
+
+  BufferPool buffer_pool_;                //!< Declared before the members holding its buffers.
+
+  SLIST_HEADER send_queue_;               //!< Lock-free multiple producers, single consumer (the sender thread).
+  SLIST_HEADER free_packets_;
+  HANDLE sender_thread_;
+  HANDLE send_event_;                     //!< Set when packets are queued.
+  HANDLE credit_event_;                   //!< Set when Pico Pixel grants credits.
+  volatile LONG queued_packets_;
+  volatile LONGLONG queued_bytes_;        //!< Bytes of the queued image packets.
+  volatile LONGLONG max_queued_bytes_;    //!< Image packets beyond it are dropped. 0 for no limit.
+  CRITICAL_SECTION sent_lock_;
+  CONDITION_VARIABLE queue_drained_;      //!< Woken, under sent_lock_, when queued_packets_ drops to 0.
+  volatile LONG free_packet_count_;
+  bool sender_exit_;
+  volatile LONG image_name_index_;
+
+  CRITICAL_SECTION image_names_lock_;
+  std::map<std::string, unsigned int> image_name_ids_;
+  std::vector<std::string> image_names_;  //!< Indexed by name ID - 1. Reserved up front, never reallocated.
+  volatile LONG image_name_count_;        //!< Names readable without image_names_lock_. Published once a name is stored.
+  volatile LONG connection_generation_;   //!< Incremented by each hand shake.
+  LONG sender_connection_generation_;     //!< Sender thread only, like sent_image_names_.
+  std::vector<bool> sent_image_names_;    //!< Names registered on the current connection.
+
+  CRITICAL_SECTION priorities_lock_;
+  std::map<std::string, PicoPixelClient::ImagePriority> image_priorities_;
+  volatile LONG prioritized_images_;      //!< Packages are chunked while it is not 0.
+  SendStream send_streams_[PIXEL_PRINTF_PRIORITY_COUNT];  //!< Sender thread only, by priority.
+  UINT64 virtual_time_;                   //!< Virtual time of the last stream written from.
+  unsigned int next_chunk_stream_;
+
+  CRITICAL_SECTION flight_recorder_lock_;
+  FlightRecorder flight_recorder_;
+  bool flight_recording_;                 //!< Set while the recorder runs and has images selected.
+
+  CRITICAL_SECTION regions_of_interest_lock_;
+  std::map<std::string, RegionOfInterest> regions_of_interest_;
+
+  volatile LONGLONG image_sequence_;
+  CRITICAL_SECTION latency_lock_;
+  std::map<std::string, ImageLatencyHistograms> image_latencies_;
+  std::map<UINT64, PendingAck> pending_acks_;   //!< Traced images waiting for their acknowledgement, by sequence.
+
+  PicoPixelClient::FlowControl flow_control_;
+  int flow_control_max_images_;
+  INT64 flow_control_max_bytes_;
+  CRITICAL_SECTION credit_lock_;          //!< Guards the credits, granted by the receiver thread and taken by the sender thread.
+  bool image_credits_limited_;            //!< Set by the first grant of image credits of a connection.
+  bool byte_credits_limited_;
+  LONG credit_generation_;                //!< Connection the credits were granted on.
+  LONG image_credits_;
+  LONGLONG byte_credits_;
+  volatile LONG dropped_images_;
+  volatile LONG viewer_protocol_version_; //!< Set by the receiver thread from the ViewerHandShakeHeader.
+
+  CRITICAL_SECTION transport_lock_;
+  bool no_delay_;
+  int send_buffer_size_;
+  double throughput_;                     //!< Bytes per second.
+  UINT64 rtt_us_;
+  ULONG ideal_backlog_;
+  ULONGLONG last_tune_time_;
+  UINT64 acked_bytes_;                    //!< Bytes TCP had delivered at the last measurement.
+  UINT64 acked_time_us_;                  //!< Time of the last measurement. 0 before the first one.
+
+  volatile LONGLONG zero_copy_max_bytes_;  //!< 0 when packages are copied to the socket send buffer.
+  OverlappedSend overlapped_sends_[PIXEL_PRINTF_MAX_OVERLAPPED_SENDS]; //!< Ring of sends in flight. Sender thread only.
+  int first_overlapped_send_;
+  int overlapped_send_count_;
+  UINT64 overlapped_bytes_;
+
+  CRITICAL_SECTION address_lock_;
+  std::map<std::string, std::vector<struct sockaddr_in> > resolved_addresses_;
+
+  bool lazy_connection_;
+  std::string lazy_host_ip_;
+  int lazy_port_;
+  HANDLE connector_thread_;
+  HANDLE connect_request_event_;
+  volatile LONG lazy_connecting_;
+  bool connector_exit_;
+  ULONGLONG last_connect_failure_;
+
+  float summary_histogram_min_;
+  float summary_histogram_max_;
+
+  float golden_tolerance_;
+  unsigned int golden_max_different_pixels_;
+
+  CRITICAL_SECTION worker_lock_;          //!< One ParallelFor at a time. Also held while the workers start.
+  std::vector<HANDLE> worker_threads_;
+  HANDLE worker_wakeup_;                  //!< Semaphore released once per worker for each ParallelFor.
+  HANDLE worker_done_;                    //!< Set when the last slice is done.
+  ParallelTask worker_task_;
+  void* worker_context_;
+  int worker_slice_count_;
+  int worker_item_count_;
+  volatile LONG worker_next_slice_;
+  volatile LONG worker_pending_slices_;
+  volatile bool workers_exit_;
+
   static int default_timeout_millisec_;
   static int trials_read_on_socket;
 };
@@ -64,767 +1066,4707 @@ bool PicoPixelClient::Impl::Connected() const
   return sock_ != INVALID_SOCKET;
 }
 
-int PicoPixelClient::Impl::RecvRaw(char* dst_buffer,
-                                   unsigned int buffer_size,
-                                   unsigned int timeout,
-                                   bool& connection_closed,
-                                   bool peek)
+bool PicoPixelClient::Impl::TriggerMarker(int marker_index)
 {
-  if (!Connected())
+  if (marker_index < 0 || marker_index >= (int)markers_.size())
+    return false;
+
+  Marker& marker = markers_[marker_index];
+  if (marker.index_ == -1)
+    return false;
+
+  SyncMarkerGroups(marker);
+  return marker.Trigger((int)frame_);
+}
+
+void PicoPixelClient::Impl::SetMarkerFromPicoPixel(int marker_index, int use_count)
+{
+  // The markers may be changed by the program's thread meanwhile.
+  EnterCriticalSection(&markers_lock_);
+  if (marker_index < 0 || marker_index >= (int)markers_.size())
   {
-    connection_closed = true;
-    return 0;
+    LeaveCriticalSection(&markers_lock_);
+    return;
   }
 
-  if (dst_buffer == NULL || buffer_size < 1L)
+  Marker& marker = markers_[marker_index];
+  if (markers_auto_sync_)
   {
-    return 0;
+    SetMarkerUseCount(marker, use_count);
+    marker.use_count_pico_pixel_update_ = -1;
   }
-
-  TIMEVAL  stTime;
-  SOCKET socket = sock_;
-
-  fd_set  fd_read;
-  FD_ZERO(&fd_read);
-  FD_SET(socket, &fd_read);
-  stTime.tv_sec = timeout / 1000;
-  stTime.tv_usec = timeout % 1000;
-
-  // Select function set read timeout
-  unsigned int bytes_read = 0;
-
-  int res = select((int)(socket + 1), &fd_read, NULL, NULL, &stTime);
-  if (res == SOCKET_ERROR)
+  else
   {
-    printf("[PicoPixelClient::Impl::ReadSocket] 'select' has failed.\n");
-    return 0xFFFFFFFF;
+    marker.use_count_pico_pixel_update_ = use_count;
   }
+  WakeAllConditionVariable(&markers_changed_);
+  LeaveCriticalSection(&markers_lock_);
 
-  int error_code = 0;
-  if (FD_ISSET(socket, &fd_read))
+  // Walk by index: a callback may add callbacks. A removed callback is only cleared.
+  EnterCriticalSection(&marker_callbacks_lock_);
+  for (size_t i = 0; i < marker_callbacks_.size(); ++i)
   {
-    res = recv(socket, (char*)dst_buffer, buffer_size, peek ? MSG_PEEK : 0);
-
-    if (res == SOCKET_ERROR)
+    MarkerCallback marker_callback = marker_callbacks_[i];
+    if (marker_callback.callback != NULL)
     {
-      printf("[PicoPixelClient::Impl::ReadSocket] 'recv' has failed.\n");
-      error_code = WSAGetLastError();
-      return -1;
+      marker_callback.callback(marker_index, use_count, marker_callback.callback_data);
     }
+  }
+  LeaveCriticalSection(&marker_callbacks_lock_);
+}
 
-    if (res == 0)
-    {
-      printf("[PicoPixelClient::Impl::ReadSocket] Connection closed.\n");
-      connection_closed = true;
-      sock_ = INVALID_SOCKET;
-      return 0;
-    }
+void PicoPixelClient::Impl::SetMarkerUseCount(Marker& marker, int use_count)
+{
+  InterlockedExchange(&marker.group_generation_, InterlockedIncrement(&marker_generation_));
+  InterlockedExchange(&marker.use_count_, use_count);
+}
 
-    bytes_read = (unsigned int)((res >= 0) ? (res) : (-1L));
+void PicoPixelClient::Impl::SyncMarkerGroups(Marker& marker)
+{
+  // Only plain reads unless a group was armed since the marker was last set.
+  LONG seen = marker.group_generation_;
+  LONG newest_generation = seen;
+  int newest = -1;
+  for (int group_index = marker.group_; group_index >= 0; group_index = marker_groups_[group_index].parent)
+  {
+    LONG generation = marker_groups_[group_index].generation;
+    if (generation > newest_generation)
+    {
+      newest_generation = generation;
+      newest = group_index;
+    }
   }
 
-  return bytes_read;
+  if (newest < 0)
+    return;
+
+  LONGLONG arm = InterlockedCompareExchange64(&marker_groups_[newest].arm, 0, 0);
+  LONG generation = (LONG)(arm >> 32);
+  if (generation <= seen)
+    return;
+
+  // One of the threads using the marker applies the arm.
+  if (InterlockedCompareExchange(&marker.group_generation_, generation, seen) == seen)
+  {
+    InterlockedExchange(&marker.use_count_, (LONG)(arm & 0xffffffff));
+  }
 }
 
-DWORD PicoPixelClient::Impl::ReceiverThread(void* ptr)
+int PicoPixelClient::Impl::AddMarkerGroup(const std::string& name)
 {
-  PicoPixelClient* pixel_printf = static_cast<PicoPixelClient*>(ptr);
+  if (name.empty())
+    return -1;
 
-  unsigned int  bytes_read = 0;
-  unsigned int  timeout = 1000;
-  bool connection_closed = false;
-  bool connection_dropped = false;
-  const int receive_buffer_size = 1024;
-  char receive_buffer[receive_buffer_size];
+  std::map<std::string, int>::iterator it = marker_group_names_.find(name);
+  if (it != marker_group_names_.end())
+    return it->second;
 
-  while (pixel_printf->impl_->client_side_connection_termination_ == false)
-  {
-    while (pixel_printf->Connected() && (connection_closed == false) && (connection_dropped == false))
-    {
-      // Blocking mode: Wait for event
-      bytes_read = 0;
-      int res = pixel_printf->impl_->RecvRaw(receive_buffer, receive_buffer_size, timeout, connection_closed, true);
+  size_t separator = name.rfind('/');
+  int parent = (separator == std::string::npos) ? -1 : AddMarkerGroup(name.substr(0, separator));
 
-      if (res == SOCKET_ERROR)
-      {
-        connection_dropped = true;
-      }
+  MarkerGroup group;
+  group.name = name;
+  group.parent = parent;
+  group.generation = 0;
+  group.arm = 0;
 
-      if (connection_closed || connection_dropped)
-      {
-        // This thread is bout to be terminated.
-        if (connection_closed)
-        {
-          printf("[PicoPixelClient::Impl::ReceiverThread] Connection closed.\n");
-        }
-        else
-        {
-          printf("[PicoPixelClient::Impl::ReceiverThread] Connection droped.\n");
-        }
-      }
+  int group_index = (int)marker_groups_.size();
+  if (group_index >= PIXEL_PRINTF_MAX_MARKER_GROUPS)
+  {
+    printf("[PicoPixelClient::CreateMarker] Too many marker groups, %s is not a group.\n", name.c_str());
+    return -1;
+  }
 
-      if (res > 0)
-      {
-        PixelPrintfProtocol* pixel_printf_header = (PixelPrintfProtocol*)receive_buffer;
+  marker_groups_.push_back(group);
+  marker_group_names_[name] = group_index;
+  return group_index;
+}
 
-        if ((pixel_printf_header->picomagic == PICO_PIXEL_NET_SIGNATURE) && (pixel_printf_header->payload_type == PackageType::PACKAGE_TYPE_MARKER))
-        {
-          MarkerDataHeader payload_markers;
-          pixel_printf->impl_->RecvRaw((char*)&payload_markers, sizeof(payload_markers), PIXEL_PRINTF_RECV_TIMEOUT, connection_closed);
+void PicoPixelClient::Impl::ArmMarkerGroup(int group_index, int use_count)
+{
+  // The arm is written before the generation, so readers seeing the generation find an arm at least as new.
+  EnterCriticalSection(&markers_lock_);
+  if (group_index < 0 || group_index >= (int)marker_groups_.size())
+  {
+    LeaveCriticalSection(&markers_lock_);
+    return;
+  }
 
-          for (int i = 0; i < payload_markers.marker_count; ++i)
-          {
-            int index = 0;
-            int use_count = 0;
-            int name_size = 0;
-            std::string name;
-          
-            if (pixel_printf->impl_->RecvInteger(&index, 1) <= 0)
-            {
-              pixel_printf->impl_->FlushRecvBuffer();
-              break;
-            }
+  MarkerGroup& group = marker_groups_[group_index];
+  LONG generation = InterlockedIncrement(&marker_generation_);
+  InterlockedExchange64(&group.arm, ((LONGLONG)generation << 32) | (ULONG)use_count);
+  InterlockedExchange(&group.generation, generation);
+  WakeAllConditionVariable(&markers_changed_);
+  LeaveCriticalSection(&markers_lock_);
+}
 
-            if (pixel_printf->impl_->RecvInteger(&use_count, 1) <= 0)
-            {
-              pixel_printf->impl_->FlushRecvBuffer();
-              break;
-            }
+void PicoPixelClient::Impl::StartWorkers()
+{
+  if (worker_wakeup_ != NULL)
+    return;
 
-            if (pixel_printf->impl_->RecvInteger(&name_size, 1) <= 0)
-            {
-              pixel_printf->impl_->FlushRecvBuffer();
-              break;
-            }
+  SYSTEM_INFO system_info;
+  GetSystemInfo(&system_info);
+  int worker_count = (int)system_info.dwNumberOfProcessors - 1;
+  worker_count = worker_count > PIXEL_PRINTF_MAX_WORKERS ? PIXEL_PRINTF_MAX_WORKERS : worker_count;
 
-            char* str = new char[name_size];
-            if (pixel_printf->impl_->RecvString(str, name_size) <= 0)
-            {
-              delete [] str;
-              pixel_printf->impl_->FlushRecvBuffer();
-              break;
-            }
-            delete [] str;
+  worker_wakeup_ = ::CreateSemaphore(NULL, 0, PIXEL_PRINTF_MAX_WORKERS, NULL);
+  worker_done_ = ::CreateEvent(NULL, FALSE, FALSE, NULL);
+  workers_exit_ = false;
 
-            if (index < (int)pixel_printf->impl_->markers_.size())
-            {
-              if (pixel_printf->impl_->markers_auto_sync_)
-              {
-                pixel_printf->impl_->markers_[index].use_count_ = use_count;
-                pixel_printf->impl_->markers_[index].use_count_pico_pixel_update_ = -1;
-              }
-              else
-              {
-                pixel_printf->impl_->markers_[index].use_count_pico_pixel_update_ = use_count;
-              }
-            }
-          }
-        }
-        else
-        {
-          pixel_printf->impl_->FlushRecvBuffer();
-        }
-        bytes_read = res;
-      }
+  for (int i = 0; i < worker_count; ++i)
+  {
+    HANDLE thread = ::CreateThread(NULL, 0, PicoPixelClient::Impl::WorkerThread, this, 0, NULL);
+    if (thread == NULL)
+    {
+      printf("[PicoPixelClient::Impl::StartWorkers] Failed to create worker thread.\n");
+      break;
     }
+    worker_threads_.push_back(thread);
+  }
+}
 
-    connection_closed = true;
-    connection_dropped = true;
+void PicoPixelClient::Impl::StopWorkers()
+{
+  if (worker_wakeup_ == NULL)
+    return;
 
-    if (pixel_printf->impl_->auto_reconnect_on_picopixel_shutdown_ && (pixel_printf->impl_->client_side_connection_termination_ == false))
-    {
-      pixel_printf->impl_->trying_to_reconnect_to_pico_pixel_ = true;
+  workers_exit_ = true;
+  if (!worker_threads_.empty())
+  {
+    ReleaseSemaphore(worker_wakeup_, (LONG)worker_threads_.size(), NULL);
+    WaitForMultipleObjects((DWORD)worker_threads_.size(), &worker_threads_[0], TRUE, INFINITE);
+  }
 
-      if (pixel_printf->impl_->host_ip_.empty())
-      {
-        pixel_printf->impl_->port_ = PICO_PIXEL_SERVER_PORT;
-      }
+  std::vector<HANDLE>::iterator it;
+  for (it = worker_threads_.begin(); it != worker_threads_.end(); ++it)
+  {
+    ::CloseHandle(*it);
+  }
+  worker_threads_.clear();
 
-      if (pixel_printf->StartConnectionToHost(pixel_printf->impl_->host_ip_, pixel_printf->impl_->port_))
-      {
-        pixel_printf->SendMarkersToPicoPixel();
-        connection_closed = false;
-        connection_dropped = false;
-        pixel_printf->impl_->trying_to_reconnect_to_pico_pixel_ = false;
-      }
+  ::CloseHandle(worker_wakeup_);
+  ::CloseHandle(worker_done_);
+  worker_wakeup_ = NULL;
+  worker_done_ = NULL;
+}
+
+int PicoPixelClient::Impl::ParallelSliceCount()
+{
+  // Threads sending summaries or golden comparisons at once would otherwise start two sets of workers. Once
+  // started, the workers stay until the client is destroyed, so the count holds for the caller's ParallelFor.
+  EnterCriticalSection(&worker_lock_);
+  StartWorkers();
+  // A few slices per thread so that a slow thread does not hold everybody else.
+  int slice_count = ((int)worker_threads_.size() + 1) * 4;
+  LeaveCriticalSection(&worker_lock_);
+  return slice_count;
+}
+
+void PicoPixelClient::Impl::RunWorkerSlices()
+{
+  while (true)
+  {
+    int slice = (int)InterlockedIncrement(&worker_next_slice_) - 1;
+    if (slice >= worker_slice_count_)
+      break;
+
+    int begin = (int)(((INT64)worker_item_count_ * slice) / worker_slice_count_);
+    int end = (int)(((INT64)worker_item_count_ * (slice + 1)) / worker_slice_count_);
+    if (begin < end)
+    {
+      worker_task_(worker_context_, slice, begin, end);
     }
-    else
+
+    if (InterlockedDecrement(&worker_pending_slices_) == 0)
     {
-      break;
+      SetEvent(worker_done_);
     }
   }
-  pixel_printf->impl_->trying_to_reconnect_to_pico_pixel_ = false;
+}
+
+DWORD PicoPixelClient::Impl::WorkerThread(void* ptr)
+{
+  PicoPixelClient::Impl* impl = static_cast<PicoPixelClient::Impl*>(ptr);
+  while (true)
+  {
+    WaitForSingleObject(impl->worker_wakeup_, INFINITE);
+    if (impl->workers_exit_)
+      break;
+
+    impl->RunWorkerSlices();
+  }
   return 0;
 }
 
-bool PicoPixelClient::Impl::SendRaw(const char* ptr, int size)
+void PicoPixelClient::Impl::ParallelFor(int item_count, ParallelTask task, void* context)
 {
-  if (ptr == NULL)
-    return false;
-  
-  if (size <= 0)
-    return false;
+  if (item_count <= 0)
+    return;
 
-  if (size > INT_MAX)
+  EnterCriticalSection(&worker_lock_);
+  int slice_count = ParallelSliceCount();
+
+  // Workers woken up by a previous call may still be looking for a slice. Keep them from claiming
+  // one until the new task is fully set up.
+  InterlockedExchange(&worker_next_slice_, LONG_MAX / 2);
+  worker_task_ = task;
+  worker_context_ = context;
+  worker_item_count_ = item_count;
+  worker_slice_count_ = slice_count;
+  InterlockedExchange(&worker_pending_slices_, slice_count);
+  InterlockedExchange(&worker_next_slice_, 0);
+
+  if (!worker_threads_.empty())
+  {
+    ReleaseSemaphore(worker_wakeup_, (LONG)worker_threads_.size(), NULL);
+  }
+
+  RunWorkerSlices();
+  WaitForSingleObject(worker_done_, INFINITE);
+  LeaveCriticalSection(&worker_lock_);
+}
+
+// Returns the 16-bit float format matching a 32-bit float format, or PIXEL_FORMAT_UNKNOWN.
+static PicoPixelClient::PixelFormat HalfFloatPixelFormat(PicoPixelClient::PixelFormat pixel_format)
+{
+  switch (pixel_format)
+  {
+  case PicoPixelClient::PIXEL_FORMAT_R32F:     return PicoPixelClient::PIXEL_FORMAT_R16F;
+  case PicoPixelClient::PIXEL_FORMAT_RG32F:    return PicoPixelClient::PIXEL_FORMAT_RG16F;
+  case PicoPixelClient::PIXEL_FORMAT_RGB32F:   return PicoPixelClient::PIXEL_FORMAT_RGB16F;
+  case PicoPixelClient::PIXEL_FORMAT_RGBA32F:  return PicoPixelClient::PIXEL_FORMAT_RGBA16F;
+  default:                                     return PicoPixelClient::PIXEL_FORMAT_UNKNOWN;
+  }
+}
+
+// Round to nearest even. Infinity is preserved and NaN becomes a quiet NaN.
+static unsigned short FloatToHalf(float value)
+{
+  const unsigned int f32_infinity = 255 << 23;
+  const unsigned int f16_max = (127 + 16) << 23;
+  const unsigned int denorm_magic_bits = ((127 - 15) + (23 - 10) + 1) << 23;
+
+  unsigned int f;
+  std::memcpy(&f, &value, sizeof(f));
+  unsigned int sign = f & 0x80000000u;
+  f ^= sign;
+
+  unsigned short h = 0;
+  if (f >= f16_max)
+  {
+    h = (f > f32_infinity) ? 0x7e00 : 0x7c00;
+  }
+  else if (f < (113 << 23))
+  {
+    // The result is a subnormal or zero. Let the FPU do the rounding.
+    float denorm_magic;
+    std::memcpy(&denorm_magic, &denorm_magic_bits, sizeof(denorm_magic));
+    float v;
+    std::memcpy(&v, &f, sizeof(v));
+    v += denorm_magic;
+    std::memcpy(&f, &v, sizeof(f));
+    h = (unsigned short)(f - denorm_magic_bits);
+  }
+  else
+  {
+    unsigned int mantissa_odd = (f >> 13) & 1;
+    f += ((unsigned int)(15 - 127) << 23) + 0xfff;
+    f += mantissa_odd;
+    h = (unsigned short)(f >> 13);
+  }
+
+  return (unsigned short)(h | (sign >> 16));
+}
+
+#ifdef PICO_PIXEL_CLIENT_X86
+static bool CpuSupportsF16C()
+{
+  int cpu_info[4] = {0};
+  __cpuid(cpu_info, 1);
+  bool f16c = (cpu_info[2] & (1 << 29)) != 0;
+  bool avx = (cpu_info[2] & (1 << 28)) != 0;
+  bool osxsave = (cpu_info[2] & (1 << 27)) != 0;
+  if (!f16c || !avx || !osxsave)
     return false;
 
-  int error_code = 0;
-  int total_sent = 0;
-  int ret = 0;
+  // The OS has to save the YMM registers on context switches.
+  return (_xgetbv(0) & 0x6) == 0x6;
+}
+#endif
 
-  while(total_sent < size)
+static void ConvertFloatToHalf(const float* src, unsigned short* dst, int count)
+{
+  int i = 0;
+
+#if defined(PICO_PIXEL_CLIENT_X86)
+  static const bool f16c = CpuSupportsF16C();
+  if (f16c)
   {
-    ret = send(sock_, (const char*)ptr + total_sent, size - total_sent, 0);
-    if (ret == -1)
+    for (; i + 8 <= count; i += 8)
     {
-      break;
+      __m256 v = _mm256_loadu_ps(src + i);
+      _mm_storeu_si128((__m128i*)(dst + i), _mm256_cvtps_ph(v, _MM_FROUND_TO_NEAREST_INT));
     }
-    total_sent += ret;
   }
-  
-  if( ret == -1 )
+#elif defined(PICO_PIXEL_CLIENT_NEON)
+  for (; i + 4 <= count; i += 4)
+  {
+    float16x4_t h = vcvt_f16_f32(vld1q_f32(src + i));
+    vst1_u16(dst + i, vreinterpret_u16_f16(h));
+  }
+#endif
+
+  for (; i < count; ++i)
+  {
+    dst[i] = FloatToHalf(src[i]);
+  }
+}
+
+static float HalfToFloat(unsigned short h)
+{
+  unsigned int sign = (unsigned int)(h & 0x8000) << 16;
+  unsigned int exponent = (h >> 10) & 0x1f;
+  unsigned int mantissa = h & 0x3ff;
+  unsigned int f;
+
+  if (exponent == 0)
+  {
+    float v = (float)mantissa * (1.0f / 16777216.0f);
+    std::memcpy(&f, &v, sizeof(f));
+    f |= sign;
+  }
+  else if (exponent == 31)
+  {
+    f = sign | 0x7f800000 | (mantissa << 13);
+  }
+  else
+  {
+    f = sign | ((exponent + 112) << 23) | (mantissa << 13);
+  }
+
+  float value;
+  std::memcpy(&value, &f, sizeof(value));
+  return value;
+}
+
+// Unsigned 10 and 11 bits floats of PIXEL_FORMAT_R11G11B10F. 5 bits of exponent, no sign.
+static float SmallFloatToFloat(unsigned int bits, int mantissa_bits)
+{
+  unsigned int exponent = bits >> mantissa_bits;
+  unsigned int mantissa = bits & ((1u << mantissa_bits) - 1);
+
+  if (exponent == 0)
+    return ldexpf((float)mantissa, -14 - mantissa_bits);
+
+  unsigned int f;
+  if (exponent == 31)
+    f = 0x7f800000 | (mantissa << (23 - mantissa_bits));
+  else
+    f = ((exponent + 112) << 23) | (mantissa << (23 - mantissa_bits));
+
+  float value;
+  std::memcpy(&value, &f, sizeof(value));
+  return value;
+}
+
+static inline float DecodeChannel(unsigned char value)
+{
+  return value * (1.0f / 255.0f);
+}
+
+// 16-bit channels of formats that are not packed are half floats.
+static inline float DecodeChannel(unsigned short value)
+{
+  return HalfToFloat(value);
+}
+
+static inline float DecodeChannel(float value)
+{
+  return value;
+}
+
+// Decodes 'count' pixels to 4 floats per pixel, channels in memory order. Unused channels are set to 0.
+template <PicoPixelClient::PixelFormat Format>
+static void DecodePixels(const char* src, int count, float* dst)
+{
+  typedef PicoPixelClient::PixelFormatTraits<Format> Traits;
+  const typename Traits::ChannelType* channels = (const typename Traits::ChannelType*)src;
+
+  for (int i = 0; i < count; ++i)
+  {
+    float* pixel = dst + 4 * i;
+    for (int c = 0; c < 4; ++c)
+    {
+      pixel[c] = (c < Traits::channel_count) ? DecodeChannel(channels[i * Traits::channel_count + c]) : 0.0f;
+    }
+  }
+}
+
+template <>
+void DecodePixels<PicoPixelClient::PIXEL_FORMAT_R5G6B5>(const char* src, int count, float* dst)
+{
+  const unsigned short* u16 = (const unsigned short*)src;
+  for (int i = 0; i < count; ++i)
+  {
+    float* pixel = dst + 4 * i;
+    pixel[0] = ((u16[i] >> 11) & 0x1f) * (1.0f / 31.0f);
+    pixel[1] = ((u16[i] >> 5) & 0x3f) * (1.0f / 63.0f);
+    pixel[2] = (u16[i] & 0x1f) * (1.0f / 31.0f);
+    pixel[3] = 0.0f;
+  }
+}
+
+template <>
+void DecodePixels<PicoPixelClient::PIXEL_FORMAT_R11G11B10F>(const char* src, int count, float* dst)
+{
+  const unsigned int* u32 = (const unsigned int*)src;
+  for (int i = 0; i < count; ++i)
+  {
+    float* pixel = dst + 4 * i;
+    pixel[0] = SmallFloatToFloat(u32[i] & 0x7ff, 6);
+    pixel[1] = SmallFloatToFloat((u32[i] >> 11) & 0x7ff, 6);
+    pixel[2] = SmallFloatToFloat((u32[i] >> 22) & 0x3ff, 5);
+    pixel[3] = 0.0f;
+  }
+}
+
+typedef void (*DecodePixelsFunction)(const char* src, int count, float* dst);
+
+// Run-time copy of PicoPixelClient::PixelFormatTraits, with the kernels specialized for each format.
+struct PixelFormatDescription
+{
+  int                   bytes_per_pixel;
+  int                   channel_count;
+  int                   alpha_channel;
+  bool                  is_float;
+  bool                  srgb_capable;
+  DecodePixelsFunction  decode;
+};
+
+#define PIXEL_FORMAT_DESCRIPTION(format) \
+  { \
+    PicoPixelClient::PixelFormatTraits<PicoPixelClient::format>::bytes_per_pixel, \
+    PicoPixelClient::PixelFormatTraits<PicoPixelClient::format>::channel_count, \
+    PicoPixelClient::PixelFormatTraits<PicoPixelClient::format>::alpha_channel, \
+    PicoPixelClient::PixelFormatTraits<PicoPixelClient::format>::is_float, \
+    PicoPixelClient::PixelFormatTraits<PicoPixelClient::format>::srgb_capable, \
+    DecodePixels<PicoPixelClient::format> \
+  }
+
+// In PicoPixelClient::PixelFormat order.
+static const PixelFormatDescription pixel_format_descriptions[] =
+{
+  { 0, 0, -1, false, false, NULL },   // PIXEL_FORMAT_UNKNOWN
+  PIXEL_FORMAT_DESCRIPTION(PIXEL_FORMAT_RGBA8),
+  PIXEL_FORMAT_DESCRIPTION(PIXEL_FORMAT_BGRA8),
+  PIXEL_FORMAT_DESCRIPTION(PIXEL_FORMAT_ARGB8),
+  PIXEL_FORMAT_DESCRIPTION(PIXEL_FORMAT_ABGR8),
+  PIXEL_FORMAT_DESCRIPTION(PIXEL_FORMAT_RGB8),
+  PIXEL_FORMAT_DESCRIPTION(PIXEL_FORMAT_BGR8),
+  PIXEL_FORMAT_DESCRIPTION(PIXEL_FORMAT_R5G6B5),
+  PIXEL_FORMAT_DESCRIPTION(PIXEL_FORMAT_DEPTH),
+  PIXEL_FORMAT_DESCRIPTION(PIXEL_FORMAT_R16F),
+  PIXEL_FORMAT_DESCRIPTION(PIXEL_FORMAT_RG16F),
+  PIXEL_FORMAT_DESCRIPTION(PIXEL_FORMAT_RGB16F),
+  PIXEL_FORMAT_DESCRIPTION(PIXEL_FORMAT_RGBA16F),
+  PIXEL_FORMAT_DESCRIPTION(PIXEL_FORMAT_R32F),
+  PIXEL_FORMAT_DESCRIPTION(PIXEL_FORMAT_RG32F),
+  PIXEL_FORMAT_DESCRIPTION(PIXEL_FORMAT_RGB32F),
+  PIXEL_FORMAT_DESCRIPTION(PIXEL_FORMAT_RGBA32F),
+  PIXEL_FORMAT_DESCRIPTION(PIXEL_FORMAT_R11G11B10F),
+  { 0, 0, -1, false, true, NULL },    // PIXEL_FORMAT_BC1, see BlockSize
+  { 0, 0, -1, false, true, NULL },    // PIXEL_FORMAT_BC3
+  { 0, 0, -1, false, true, NULL },    // PIXEL_FORMAT_BC7
+  PIXEL_FORMAT_DESCRIPTION(PIXEL_FORMAT_R8),
+};
+
+#undef PIXEL_FORMAT_DESCRIPTION
+
+static const PixelFormatDescription& DescribePixelFormat(PicoPixelClient::PixelFormat pixel_format)
+{
+  int count = (int)(sizeof(pixel_format_descriptions) / sizeof(pixel_format_descriptions[0]));
+  if ((pixel_format <= PicoPixelClient::PIXEL_FORMAT_UNKNOWN) || (pixel_format >= count))
+    return pixel_format_descriptions[0];
+
+  return pixel_format_descriptions[pixel_format];
+}
+
+// Returns the format of one channel of a format, or PIXEL_FORMAT_UNKNOWN for packed and block formats.
+static PicoPixelClient::PixelFormat SingleChannelPixelFormat(PicoPixelClient::PixelFormat pixel_format)
+{
+  switch (pixel_format)
+  {
+  case PicoPixelClient::PIXEL_FORMAT_RGBA8:
+  case PicoPixelClient::PIXEL_FORMAT_BGRA8:
+  case PicoPixelClient::PIXEL_FORMAT_ARGB8:
+  case PicoPixelClient::PIXEL_FORMAT_ABGR8:
+  case PicoPixelClient::PIXEL_FORMAT_RGB8:
+  case PicoPixelClient::PIXEL_FORMAT_BGR8:
+  case PicoPixelClient::PIXEL_FORMAT_R8:       return PicoPixelClient::PIXEL_FORMAT_R8;
+  case PicoPixelClient::PIXEL_FORMAT_R16F:
+  case PicoPixelClient::PIXEL_FORMAT_RG16F:
+  case PicoPixelClient::PIXEL_FORMAT_RGB16F:
+  case PicoPixelClient::PIXEL_FORMAT_RGBA16F:  return PicoPixelClient::PIXEL_FORMAT_R16F;
+  case PicoPixelClient::PIXEL_FORMAT_R32F:
+  case PicoPixelClient::PIXEL_FORMAT_RG32F:
+  case PicoPixelClient::PIXEL_FORMAT_RGB32F:
+  case PicoPixelClient::PIXEL_FORMAT_RGBA32F:  return PicoPixelClient::PIXEL_FORMAT_R32F;
+  case PicoPixelClient::PIXEL_FORMAT_DEPTH:    return PicoPixelClient::PIXEL_FORMAT_DEPTH;
+  default:                                     return PicoPixelClient::PIXEL_FORMAT_UNKNOWN;
+  }
+}
+
+// How the pixels of an image are read. Packed pixels are copied a row at a time. Pixels spaced out by a
+// pixel stride, or a single channel of them, are gathered one by one.
+struct PixelLayout
+{
+  PicoPixelClient::PixelFormat  sent_format;
+  int                           bytes_per_pixel;    //!< Size of a pixel in memory. 0 for block formats.
+  int                           pixel_stride;
+  int                           element_offset;     //!< Offset of the bytes sent in a pixel.
+  int                           element_size;       //!< Bytes sent for each pixel.
+  bool                          gather;
+};
+
+// 'pixel_stride' 0 means packed pixels and 'channel' -1 all the channels. Returns false for a channel that
+// cannot be sent alone.
+static bool DescribePixelLayout(PicoPixelClient::PixelFormat pixel_format, int pixel_stride, int channel, PixelLayout& layout)
+{
+  const PixelFormatDescription& format = DescribePixelFormat(pixel_format);
+  layout.sent_format = pixel_format;
+  layout.bytes_per_pixel = format.bytes_per_pixel;
+  layout.pixel_stride = pixel_stride > 0 ? pixel_stride : format.bytes_per_pixel;
+  layout.element_offset = 0;
+  layout.element_size = format.bytes_per_pixel;
+
+  if (channel >= 0)
+  {
+    layout.sent_format = SingleChannelPixelFormat(pixel_format);
+    if ((layout.sent_format == PicoPixelClient::PIXEL_FORMAT_UNKNOWN) || (channel >= format.channel_count))
+      return false;
+
+    layout.element_size = format.bytes_per_pixel / format.channel_count;
+    layout.element_offset = channel * layout.element_size;
+  }
+
+  layout.gather = (layout.element_size != layout.bytes_per_pixel) || (layout.pixel_stride != layout.bytes_per_pixel);
+  return (layout.bytes_per_pixel > 0) || !layout.gather;
+}
+
+template <int Size>
+static void GatherElements(char* dst, const char* src, int count, int stride)
+{
+  for (int i = 0; i < count; ++i, dst += Size, src += stride)
+  {
+    std::memcpy(dst, src, Size);
+  }
+}
+
+// Packs 'width' pixels of a row as described by 'layout'.
+static void GatherRow(char* dst, const char* row, int width, const PixelLayout& layout)
+{
+  const char* src = row + layout.element_offset;
+  switch (layout.element_size)
+  {
+  case 1:   GatherElements<1>(dst, src, width, layout.pixel_stride); break;
+  case 2:   GatherElements<2>(dst, src, width, layout.pixel_stride); break;
+  case 3:   GatherElements<3>(dst, src, width, layout.pixel_stride); break;
+  case 4:   GatherElements<4>(dst, src, width, layout.pixel_stride); break;
+  case 6:   GatherElements<6>(dst, src, width, layout.pixel_stride); break;
+  case 8:   GatherElements<8>(dst, src, width, layout.pixel_stride); break;
+  case 12:  GatherElements<12>(dst, src, width, layout.pixel_stride); break;
+  case 16:  GatherElements<16>(dst, src, width, layout.pixel_stride); break;
+  default:
+    for (int x = 0; x < width; ++x)
+    {
+      std::memcpy(dst + (size_t)x * layout.element_size, src + (size_t)x * layout.pixel_stride, layout.element_size);
+    }
+    break;
+  }
+}
+
+struct SummaryAccumulator
+{
+  float         min[4];
+  float         max[4];
+  double        sum[4];
+  double        valid_count[4];
+  unsigned int  nan_count;
+  unsigned int  inf_count;
+  unsigned int  histogram[PICO_PIXEL_SUMMARY_HISTOGRAM_SIZE];
+
+  void Reset()
+  {
+    for (int c = 0; c < 4; ++c)
+    {
+      min[c] = FLT_MAX;
+      max[c] = -FLT_MAX;
+      sum[c] = 0.0;
+      valid_count[c] = 0.0;
+    }
+    nan_count = 0;
+    inf_count = 0;
+    std::memset(histogram, 0, sizeof(histogram));
+  }
+
+  void Merge(const SummaryAccumulator& other)
+  {
+    for (int c = 0; c < 4; ++c)
+    {
+      min[c] = other.min[c] < min[c] ? other.min[c] : min[c];
+      max[c] = other.max[c] > max[c] ? other.max[c] : max[c];
+      sum[c] += other.sum[c];
+      valid_count[c] += other.valid_count[c];
+    }
+    nan_count += other.nan_count;
+    inf_count += other.inf_count;
+    for (int i = 0; i < PICO_PIXEL_SUMMARY_HISTOGRAM_SIZE; ++i)
+    {
+      histogram[i] += other.histogram[i];
+    }
+  }
+};
+
+struct SummaryTask
+{
+  PicoPixelClient::PixelFormat pixel_format;
+  const char* data;
+  int width;
+  int pitch;
+  int bytes_per_pixel;
+  int channel_count;
+  DecodePixelsFunction decode;
+  float color_weights[4];   //!< 1/color channel count on color channels, 0 elsewhere.
+  float histogram_min;
+  float histogram_scale;    //!< Histogram bins per unit.
+  std::vector<SummaryAccumulator> slices;
+};
+
+static int HistogramBin(float value, const SummaryTask& task)
+{
+  float bin = (value - task.histogram_min) * task.histogram_scale;
+  if (bin < 0.0f)
+    return 0;
+  if (bin >= (float)(PICO_PIXEL_SUMMARY_HISTOGRAM_SIZE - 1))
+    return PICO_PIXEL_SUMMARY_HISTOGRAM_SIZE - 1;
+  return (int)bin;
+}
+
+// Accumulates 'count' decoded pixels (4 floats each).
+static void AccumulateSummary(const float* pixels, int count, const SummaryTask& task, SummaryAccumulator& acc)
+{
+  int channel_mask = (1 << task.channel_count) - 1;
+
+#ifdef PICO_PIXEL_CLIENT_X86
+  // One pixel per register: every lane accumulates one channel.
+  static const int bit_count[16] = { 0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4 };
+  const __m128 abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+  const __m128 infinity = _mm_castsi128_ps(_mm_set1_epi32(0x7f800000));
+  const __m128 one = _mm_set1_ps(1.0f);
+  const __m128 color_weights = _mm_loadu_ps(task.color_weights);
+  int color_mask = _mm_movemask_ps(_mm_cmpneq_ps(color_weights, _mm_setzero_ps()));
+  __m128 vmin = _mm_loadu_ps(acc.min);
+  __m128 vmax = _mm_loadu_ps(acc.max);
+  __m128 vsum = _mm_setzero_ps();
+  __m128 vcount = _mm_setzero_ps();
+
+  for (int i = 0; i < count; ++i)
+  {
+    __m128 v = _mm_loadu_ps(pixels + 4 * i);
+    __m128 nan = _mm_cmpunord_ps(v, v);
+    __m128 inf = _mm_cmpeq_ps(_mm_and_ps(v, abs_mask), infinity);
+    __m128 invalid = _mm_or_ps(nan, inf);
+    int invalid_bits = _mm_movemask_ps(invalid) & channel_mask;
+
+    if (invalid_bits)
+    {
+      acc.nan_count += bit_count[_mm_movemask_ps(nan) & channel_mask];
+      acc.inf_count += bit_count[_mm_movemask_ps(inf) & channel_mask];
+    }
+
+    vmin = _mm_min_ps(vmin, _mm_or_ps(_mm_andnot_ps(invalid, v), _mm_and_ps(invalid, vmin)));
+    vmax = _mm_max_ps(vmax, _mm_or_ps(_mm_andnot_ps(invalid, v), _mm_and_ps(invalid, vmax)));
+    vsum = _mm_add_ps(vsum, _mm_andnot_ps(invalid, v));
+    vcount = _mm_add_ps(vcount, _mm_andnot_ps(invalid, one));
+
+    if ((invalid_bits & color_mask) == 0)
+    {
+      __m128 w = _mm_mul_ps(v, color_weights);
+      w = _mm_add_ps(w, _mm_movehl_ps(w, w));
+      w = _mm_add_ss(w, _mm_shuffle_ps(w, w, 1));
+      ++acc.histogram[HistogramBin(_mm_cvtss_f32(w), task)];
+    }
+  }
+
+  float sum[4];
+  float valid_count[4];
+  _mm_storeu_ps(acc.min, vmin);
+  _mm_storeu_ps(acc.max, vmax);
+  _mm_storeu_ps(sum, vsum);
+  _mm_storeu_ps(valid_count, vcount);
+  for (int c = 0; c < 4; ++c)
+  {
+    acc.sum[c] += sum[c];
+    acc.valid_count[c] += valid_count[c];
+  }
+#else
+  for (int i = 0; i < count; ++i)
+  {
+    const float* pixel = pixels + 4 * i;
+    bool color_valid = true;
+    float value = 0.0f;
+
+    for (int c = 0; c < task.channel_count; ++c)
+    {
+      float v = pixel[c];
+      if (v != v)
+      {
+        ++acc.nan_count;
+      }
+      else if (std::fabs(v) == HUGE_VALF)
+      {
+        ++acc.inf_count;
+      }
+      else
+      {
+        acc.min[c] = v < acc.min[c] ? v : acc.min[c];
+        acc.max[c] = v > acc.max[c] ? v : acc.max[c];
+        acc.sum[c] += v;
+        acc.valid_count[c] += 1.0;
+        value += v * task.color_weights[c];
+        continue;
+      }
+
+      if (task.color_weights[c] != 0.0f)
+        color_valid = false;
+    }
+
+    if (color_valid)
+    {
+      ++acc.histogram[HistogramBin(value, task)];
+    }
+  }
+#endif
+  (void)channel_mask;
+}
+
+static void SummarizeRows(void* context, int slice, int begin, int end)
+{
+  SummaryTask& task = *static_cast<SummaryTask*>(context);
+  SummaryAccumulator& acc = task.slices[slice];
+  const int chunk_size = 256;
+  float decoded[chunk_size * 4];
+
+  for (int y = begin; y < end; ++y)
+  {
+    const char* row = task.data + (size_t)y * task.pitch;
+    for (int x = 0; x < task.width; x += chunk_size)
+    {
+      int count = (task.width - x) < chunk_size ? (task.width - x) : chunk_size;
+      const char* src = row + (size_t)x * task.bytes_per_pixel;
+
+      if (task.pixel_format == PicoPixelClient::PIXEL_FORMAT_RGBA32F)
+      {
+        AccumulateSummary((const float*)src, count, task, acc);
+      }
+      else
+      {
+        task.decode(src, count, decoded);
+        AccumulateSummary(decoded, count, task, acc);
+      }
+    }
+  }
+}
+
+static_assert(PicoPixelClient::PIXEL_FORMAT_BC1 == PICO_PIXEL_FORMAT_BC1 &&
+              PicoPixelClient::PIXEL_FORMAT_BC3 == PICO_PIXEL_FORMAT_BC3 &&
+              PicoPixelClient::PIXEL_FORMAT_BC7 == PICO_PIXEL_FORMAT_BC7, "Block formats do not match the protocol");
+
+// Size of a 4x4 block, or 0 for formats that are not block compressed.
+static int BlockSize(PicoPixelClient::PixelFormat pixel_format)
+{
+  switch (pixel_format)
+  {
+  case PicoPixelClient::PIXEL_FORMAT_BC1:  return 8;
+  case PicoPixelClient::PIXEL_FORMAT_BC3:  return 16;
+  case PicoPixelClient::PIXEL_FORMAT_BC7:  return 16;
+  default:                                 return 0;
+  }
+}
+
+// Block compression. The endpoints of a block are the corners of the bounding box of its colors, moved
+// inwards so that the interpolated colors cover the box better, and each pixel takes the palette entry
+// nearest to its projection on the line between the endpoints. Blocks over the right and bottom edges of
+// the image repeat the last column and row.
+struct BlockCompressionTask
+{
+  const char* data;
+  int width;
+  int height;
+  int pitch;
+  bool bgra;
+  PicoPixelClient::PixelFormat block_format;
+  char* blocks;
+  int block_row_size;
+};
+
+// Reads a block as 16 RGBA pixels.
+static void LoadBlock(const BlockCompressionTask& task, int block_x, int block_y, unsigned char block[64])
+{
+  int red = task.bgra ? 2 : 0;
+  int blue = task.bgra ? 0 : 2;
+  for (int y = 0; y < 4; ++y)
+  {
+    int src_y = block_y * 4 + y < task.height ? block_y * 4 + y : task.height - 1;
+    const unsigned char* row = (const unsigned char*)task.data + (size_t)src_y * task.pitch;
+    for (int x = 0; x < 4; ++x)
+    {
+      int src_x = block_x * 4 + x < task.width ? block_x * 4 + x : task.width - 1;
+      const unsigned char* src = row + 4 * src_x;
+      unsigned char* dst = block + 4 * (4 * y + x);
+      dst[0] = src[red];
+      dst[1] = src[1];
+      dst[2] = src[blue];
+      dst[3] = src[3];
+    }
+  }
+}
+
+static void BlockBounds(const unsigned char block[64], unsigned char min[4], unsigned char max[4])
+{
+#if defined(PICO_PIXEL_CLIENT_X86)
+  __m128i row0 = _mm_loadu_si128((const __m128i*)block);
+  __m128i row1 = _mm_loadu_si128((const __m128i*)(block + 16));
+  __m128i row2 = _mm_loadu_si128((const __m128i*)(block + 32));
+  __m128i row3 = _mm_loadu_si128((const __m128i*)(block + 48));
+  __m128i vmin = _mm_min_epu8(_mm_min_epu8(row0, row1), _mm_min_epu8(row2, row3));
+  __m128i vmax = _mm_max_epu8(_mm_max_epu8(row0, row1), _mm_max_epu8(row2, row3));
+  // Fold the 4 pixels of the row into the first one.
+  vmin = _mm_min_epu8(vmin, _mm_srli_si128(vmin, 8));
+  vmin = _mm_min_epu8(vmin, _mm_srli_si128(vmin, 4));
+  vmax = _mm_max_epu8(vmax, _mm_srli_si128(vmax, 8));
+  vmax = _mm_max_epu8(vmax, _mm_srli_si128(vmax, 4));
+  int min_pixel = _mm_cvtsi128_si32(vmin);
+  int max_pixel = _mm_cvtsi128_si32(vmax);
+  std::memcpy(min, &min_pixel, 4);
+  std::memcpy(max, &max_pixel, 4);
+#elif defined(PICO_PIXEL_CLIENT_NEON)
+  uint8x16_t row0 = vld1q_u8(block);
+  uint8x16_t row1 = vld1q_u8(block + 16);
+  uint8x16_t row2 = vld1q_u8(block + 32);
+  uint8x16_t row3 = vld1q_u8(block + 48);
+  uint8x16_t vmin = vminq_u8(vminq_u8(row0, row1), vminq_u8(row2, row3));
+  uint8x16_t vmax = vmaxq_u8(vmaxq_u8(row0, row1), vmaxq_u8(row2, row3));
+  uint8x8_t min_half = vmin_u8(vget_low_u8(vmin), vget_high_u8(vmin));
+  uint8x8_t max_half = vmax_u8(vget_low_u8(vmax), vget_high_u8(vmax));
+  unsigned char lanes[8];
+  vst1_u8(lanes, vmin_u8(min_half, vext_u8(min_half, min_half, 4)));
+  std::memcpy(min, lanes, 4);
+  vst1_u8(lanes, vmax_u8(max_half, vext_u8(max_half, max_half, 4)));
+  std::memcpy(max, lanes, 4);
+#else
+  for (int c = 0; c < 4; ++c)
+  {
+    min[c] = 255;
+    max[c] = 0;
+  }
+  for (int i = 0; i < 64; ++i)
+  {
+    min[i & 3] = block[i] < min[i & 3] ? block[i] : min[i & 3];
+    max[i & 3] = block[i] > max[i & 3] ? block[i] : max[i & 3];
+  }
+#endif
+}
+
+static void InsetBounds(unsigned char min[4], unsigned char max[4], int channel_count, int shift)
+{
+  for (int c = 0; c < channel_count; ++c)
+  {
+    int inset = (max[c] - min[c]) >> shift;
+    min[c] = (unsigned char)(min[c] + inset);
+    max[c] = (unsigned char)(max[c] - inset);
+  }
+}
+
+// The bounding box diagonal from min to max only fits channels that grow together. Channels going the other
+// way than the channel with the widest range get their bounds swapped.
+static void OrientBounds(const unsigned char block[64], unsigned char min[4], unsigned char max[4], int channel_count)
+{
+  int widest = 0;
+  for (int c = 1; c < channel_count; ++c)
+  {
+    widest = (max[c] - min[c]) > (max[widest] - min[widest]) ? c : widest;
+  }
+
+  int mean[4] = {0, 0, 0, 0};
+  for (int i = 0; i < 16; ++i)
+  {
+    for (int c = 0; c < channel_count; ++c)
+    {
+      mean[c] += block[4 * i + c];
+    }
+  }
+
+  int covariance[4] = {0, 0, 0, 0};
+  for (int i = 0; i < 16; ++i)
+  {
+    int d = 16 * block[4 * i + widest] - mean[widest];
+    for (int c = 0; c < channel_count; ++c)
+    {
+      covariance[c] += d * (16 * block[4 * i + c] - mean[c]) / 16;
+    }
+  }
+
+  for (int c = 0; c < channel_count; ++c)
+  {
+    if (covariance[c] < 0)
+    {
+      unsigned char swap = min[c];
+      min[c] = max[c];
+      max[c] = swap;
+    }
+  }
+}
+
+// Picks for each pixel the nearest of 'level_count' evenly spaced points from 'e0' (level 0) to 'e1'.
+static void ProjectBlock(const unsigned char block[64], const int e0[4], const int e1[4], int channel_count, int level_count, int levels[16])
+{
+  int axis[4];
+  int length = 0;
+  for (int c = 0; c < channel_count; ++c)
+  {
+    axis[c] = e1[c] - e0[c];
+    length += axis[c] * axis[c];
+  }
+
+  for (int i = 0; i < 16; ++i)
+  {
+    int dot = 0;
+    for (int c = 0; c < channel_count; ++c)
+    {
+      dot += (block[4 * i + c] - e0[c]) * axis[c];
+    }
+
+    int level = 0;
+    if ((length > 0) && (dot > 0))
+    {
+      level = (2 * dot * (level_count - 1) + length) / (2 * length);
+      level = level < level_count - 1 ? level : level_count - 1;
+    }
+    levels[i] = level;
+  }
+}
+
+static unsigned short PackColor565(const unsigned char color[4])
+{
+  int r = (color[0] * 31 + 127) / 255;
+  int g = (color[1] * 63 + 127) / 255;
+  int b = (color[2] * 31 + 127) / 255;
+  return (unsigned short)((r << 11) | (g << 5) | b);
+}
+
+static void UnpackColor565(unsigned short packed, int color[4])
+{
+  int r = (packed >> 11) & 31;
+  int g = (packed >> 5) & 63;
+  int b = packed & 31;
+  color[0] = (r << 3) | (r >> 2);
+  color[1] = (g << 2) | (g >> 4);
+  color[2] = (b << 3) | (b >> 2);
+  color[3] = 255;
+}
+
+// BC1 color block in 4 color mode. The bounds are those of the block.
+static void EncodeColorBlock(const unsigned char block[64], const unsigned char block_min[4], const unsigned char block_max[4], unsigned char* dst)
+{
+  unsigned char min[4] = {block_min[0], block_min[1], block_min[2], block_min[3]};
+  unsigned char max[4] = {block_max[0], block_max[1], block_max[2], block_max[3]};
+  InsetBounds(min, max, 3, 4);
+  OrientBounds(block, min, max, 3);
+
+  // 4 color mode needs color0 > color1. When they are equal the block is in 3 color mode, where index 0 is
+  // still color0.
+  unsigned short color0 = PackColor565(max);
+  unsigned short color1 = PackColor565(min);
+  if (color0 < color1)
+  {
+    unsigned short swap = color0;
+    color0 = color1;
+    color1 = swap;
+  }
+  unsigned int indices = 0;
+  if (color0 != color1)
+  {
+    int e0[4];
+    int e1[4];
+    int levels[16];
+    UnpackColor565(color0, e0);
+    UnpackColor565(color1, e1);
+    ProjectBlock(block, e0, e1, 3, 4, levels);
+
+    // Palette order: color0, color1, 2/3 color0 + 1/3 color1, 1/3 color0 + 2/3 color1.
+    static const unsigned int level_indices[4] = {0, 2, 3, 1};
+    for (int i = 0; i < 16; ++i)
+    {
+      indices |= level_indices[levels[i]] << (2 * i);
+    }
+  }
+
+  dst[0] = (unsigned char)color0;
+  dst[1] = (unsigned char)(color0 >> 8);
+  dst[2] = (unsigned char)color1;
+  dst[3] = (unsigned char)(color1 >> 8);
+  for (int b = 0; b < 4; ++b)
+  {
+    dst[4 + b] = (unsigned char)(indices >> (8 * b));
+  }
+}
+
+// BC3 alpha block in 8 alpha mode. The alpha bounds are kept exact so that opaque pixels stay opaque.
+static void EncodeAlphaBlock(const unsigned char block[64], int alpha_min, int alpha_max, unsigned char* dst)
+{
+  UINT64 indices = 0;
+  if (alpha_max != alpha_min)
+  {
+    // Palette order: alpha0, alpha1, then 6 steps from alpha0 to alpha1.
+    static const UINT64 level_indices[8] = {0, 2, 3, 4, 5, 6, 7, 1};
+    int range = alpha_max - alpha_min;
+    for (int i = 0; i < 16; ++i)
+    {
+      int level = (2 * (alpha_max - block[4 * i + 3]) * 7 + range) / (2 * range);
+      indices |= level_indices[level] << (3 * i);
+    }
+  }
+
+  dst[0] = (unsigned char)alpha_max;
+  dst[1] = (unsigned char)alpha_min;
+  for (int b = 0; b < 6; ++b)
+  {
+    dst[2 + b] = (unsigned char)(indices >> (8 * b));
+  }
+}
+
+// Writes bit fields from the least significant bit of a zeroed block up.
+struct BlockBitWriter
+{
+  BlockBitWriter(unsigned char* block)
+    : dst(block)
+    , position(0)
+  {}
+
+  void Write(unsigned int value, int bit_count)
+  {
+    for (int i = 0; i < bit_count; ++i, ++position)
+    {
+      dst[position >> 3] |= (unsigned char)(((value >> i) & 1) << (position & 7));
+    }
+  }
+
+  unsigned char* dst;
+  int position;
+};
+
+// Mode 6 endpoints have 7 bits per channel and one low bit shared by the channels of the endpoint.
+static void QuantizeMode6Endpoint(const unsigned char color[4], int quantized[4], int& p_bit, int endpoint[4])
+{
+  int odd_channels = (color[0] & 1) + (color[1] & 1) + (color[2] & 1) + (color[3] & 1);
+  p_bit = odd_channels >= 2 ? 1 : 0;
+  for (int c = 0; c < 4; ++c)
+  {
+    int q = (color[c] - p_bit + 1) >> 1;
+    quantized[c] = q < 0 ? 0 : (q > 127 ? 127 : q);
+    endpoint[c] = (quantized[c] << 1) | p_bit;
+  }
+}
+
+// BC7 block in mode 6: a single RGBA subset with 16 interpolation steps.
+static void EncodeBC7Block(const unsigned char block[64], const unsigned char block_min[4], const unsigned char block_max[4], unsigned char* dst)
+{
+  unsigned char min[4] = {block_min[0], block_min[1], block_min[2], block_min[3]};
+  unsigned char max[4] = {block_max[0], block_max[1], block_max[2], block_max[3]};
+  InsetBounds(min, max, 4, 6);
+  OrientBounds(block, min, max, 4);
+
+  int quantized[2][4];
+  int p_bits[2];
+  int endpoints[2][4];
+  int levels[16];
+  QuantizeMode6Endpoint(min, quantized[0], p_bits[0], endpoints[0]);
+  QuantizeMode6Endpoint(max, quantized[1], p_bits[1], endpoints[1]);
+  // Mode 6 weights are round(64 * i / 15), close enough to even steps.
+  ProjectBlock(block, endpoints[0], endpoints[1], 4, 16, levels);
+
+  // The top bit of the first index is implied 0. Swap the endpoints otherwise.
+  int first = 0;
+  if (levels[0] >= 8)
+  {
+    first = 1;
+    for (int i = 0; i < 16; ++i)
+    {
+      levels[i] = 15 - levels[i];
+    }
+  }
+  int second = 1 - first;
+
+  std::memset(dst, 0, 16);
+  BlockBitWriter bits(dst);
+  bits.Write(1 << 6, 7);
+  for (int c = 0; c < 4; ++c)
+  {
+    bits.Write(quantized[first][c], 7);
+    bits.Write(quantized[second][c], 7);
+  }
+  bits.Write(p_bits[first], 1);
+  bits.Write(p_bits[second], 1);
+  bits.Write(levels[0], 3);
+  for (int i = 1; i < 16; ++i)
+  {
+    bits.Write(levels[i], 4);
+  }
+}
+
+static void CompressBlockRows(void* context, int slice, int begin, int end)
+{
+  const BlockCompressionTask& task = *static_cast<const BlockCompressionTask*>(context);
+  int block_size = BlockSize(task.block_format);
+  int block_count = (task.width + 3) / 4;
+  unsigned char block[64];
+  unsigned char min[4];
+  unsigned char max[4];
+
+  for (int block_y = begin; block_y < end; ++block_y)
+  {
+    unsigned char* dst = (unsigned char*)task.blocks + (size_t)block_y * task.block_row_size;
+    for (int block_x = 0; block_x < block_count; ++block_x, dst += block_size)
+    {
+      LoadBlock(task, block_x, block_y, block);
+      BlockBounds(block, min, max);
+
+      if (task.block_format == PicoPixelClient::PIXEL_FORMAT_BC1)
+      {
+        EncodeColorBlock(block, min, max, dst);
+      }
+      else if (task.block_format == PicoPixelClient::PIXEL_FORMAT_BC3)
+      {
+        EncodeAlphaBlock(block, min[3], max[3], dst);
+        EncodeColorBlock(block, min, max, dst + 8);
+      }
+      else
+      {
+        EncodeBC7Block(block, min, max, dst);
+      }
+    }
+  }
+}
+
+// Golden image comparison. The error of a pixel is the largest difference of its channels, decoded as for
+// summaries: 8-bit channels are in [0, 1]. NaN and infinite differences count as FLT_MAX.
+struct DifferenceAccumulator
+{
+  unsigned int  different_pixels;
+  float         max_error;
+  double        error_sum;
+};
+
+struct DifferenceTask
+{
+  PicoPixelClient::PixelFormat pixel_format;
+  const char* data;
+  const char* golden;
+  int width;
+  int pitch;
+  int bytes_per_pixel;
+  DecodePixelsFunction decode;
+  float tolerance;
+  std::vector<DifferenceAccumulator> slices;
+  float heat_scale;           //!< Maps the errors above the tolerance to [0, 1].
+  unsigned char* heat_map;    //!< RGBA8 rows of 'width' pixels.
+};
+
+static bool IsByteQuadFormat(PicoPixelClient::PixelFormat pixel_format)
+{
+  return (pixel_format == PicoPixelClient::PIXEL_FORMAT_RGBA8) || (pixel_format == PicoPixelClient::PIXEL_FORMAT_BGRA8) ||
+    (pixel_format == PicoPixelClient::PIXEL_FORMAT_ARGB8) || (pixel_format == PicoPixelClient::PIXEL_FORMAT_ABGR8);
+}
+
+// Errors of 'count' pixels, at most 'PIXEL_PRINTF_DIFFERENCE_CHUNK'.
+static void PixelErrors(const DifferenceTask& task, const char* src, const char* golden, int count, float* errors)
+{
+  int i = 0;
+  if (IsByteQuadFormat(task.pixel_format))
+  {
+#if defined(PICO_PIXEL_CLIENT_X86)
+    const __m128i low_byte = _mm_set1_epi32(0xff);
+    const __m128 scale = _mm_set1_ps(1.0f / 255.0f);
+    for (; i + 4 <= count; i += 4)
+    {
+      __m128i a = _mm_loadu_si128((const __m128i*)(src + 4 * i));
+      __m128i b = _mm_loadu_si128((const __m128i*)(golden + 4 * i));
+      __m128i d = _mm_or_si128(_mm_subs_epu8(a, b), _mm_subs_epu8(b, a));
+      // Largest of the 4 bytes of each pixel, in the low byte.
+      d = _mm_max_epu8(d, _mm_srli_epi32(d, 8));
+      d = _mm_max_epu8(d, _mm_srli_epi32(d, 16));
+      _mm_storeu_ps(errors + i, _mm_mul_ps(_mm_cvtepi32_ps(_mm_and_si128(d, low_byte)), scale));
+    }
+#elif defined(PICO_PIXEL_CLIENT_NEON)
+    for (; i + 4 <= count; i += 4)
+    {
+      uint8x16_t d = vabdq_u8(vld1q_u8((const uint8_t*)src + 4 * i), vld1q_u8((const uint8_t*)golden + 4 * i));
+      uint32x4_t m = vreinterpretq_u32_u8(d);
+      m = vmaxq_u32(vandq_u32(m, vdupq_n_u32(0xff)), vandq_u32(vshrq_n_u32(m, 8), vdupq_n_u32(0xff)));
+      m = vmaxq_u32(m, vandq_u32(vshrq_n_u32(vreinterpretq_u32_u8(d), 16), vdupq_n_u32(0xff)));
+      m = vmaxq_u32(m, vshrq_n_u32(vreinterpretq_u32_u8(d), 24));
+      vst1q_f32(errors + i, vmulq_n_f32(vcvtq_f32_u32(m), 1.0f / 255.0f));
+    }
+#endif
+    for (; i < count; ++i)
+    {
+      const unsigned char* a = (const unsigned char*)src + 4 * i;
+      const unsigned char* b = (const unsigned char*)golden + 4 * i;
+      int error = 0;
+      for (int c = 0; c < 4; ++c)
+      {
+        int d = a[c] > b[c] ? a[c] - b[c] : b[c] - a[c];
+        error = d > error ? d : error;
+      }
+      errors[i] = error * (1.0f / 255.0f);
+    }
+    return;
+  }
+
+  // Other formats are compared on 4 decoded floats per pixel.
+  float decoded[PIXEL_PRINTF_DIFFERENCE_CHUNK * 4];
+  float decoded_golden[PIXEL_PRINTF_DIFFERENCE_CHUNK * 4];
+  const float* a = (const float*)src;
+  const float* b = (const float*)golden;
+  if (task.pixel_format != PicoPixelClient::PIXEL_FORMAT_RGBA32F)
+  {
+    task.decode(src, count, decoded);
+    task.decode(golden, count, decoded_golden);
+    a = decoded;
+    b = decoded_golden;
+  }
+
+#if defined(PICO_PIXEL_CLIENT_X86)
+  const __m128 abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+  const __m128 largest = _mm_set1_ps(FLT_MAX);
+  for (; i < count; ++i)
+  {
+    __m128 d = _mm_and_ps(_mm_sub_ps(_mm_loadu_ps(a + 4 * i), _mm_loadu_ps(b + 4 * i)), abs_mask);
+    // min returns its second operand for NaN.
+    d = _mm_min_ps(d, largest);
+    d = _mm_max_ps(d, _mm_movehl_ps(d, d));
+    d = _mm_max_ss(d, _mm_shuffle_ps(d, d, 1));
+    errors[i] = _mm_cvtss_f32(d);
+  }
+#endif
+  for (; i < count; ++i)
+  {
+    float error = 0.0f;
+    for (int c = 0; c < 4; ++c)
+    {
+      float d = std::fabs(a[4 * i + c] - b[4 * i + c]);
+      d = d < FLT_MAX ? d : FLT_MAX;
+      error = d > error ? d : error;
+    }
+    errors[i] = error;
+  }
+}
+
+static void CompareRows(void* context, int slice, int begin, int end)
+{
+  DifferenceTask& task = *static_cast<DifferenceTask*>(context);
+  DifferenceAccumulator& acc = task.slices[slice];
+  float errors[PIXEL_PRINTF_DIFFERENCE_CHUNK];
+
+  for (int y = begin; y < end; ++y)
+  {
+    size_t row_offset = (size_t)y * task.pitch;
+    for (int x = 0; x < task.width; x += PIXEL_PRINTF_DIFFERENCE_CHUNK)
+    {
+      int count = (task.width - x) < PIXEL_PRINTF_DIFFERENCE_CHUNK ? (task.width - x) : PIXEL_PRINTF_DIFFERENCE_CHUNK;
+      size_t offset = row_offset + (size_t)x * task.bytes_per_pixel;
+      PixelErrors(task, task.data + offset, task.golden + offset, count, errors);
+
+      for (int i = 0; i < count; ++i)
+      {
+        acc.different_pixels += errors[i] > task.tolerance ? 1 : 0;
+        acc.max_error = errors[i] > acc.max_error ? errors[i] : acc.max_error;
+        acc.error_sum += errors[i];
+      }
+    }
+  }
+}
+
+// Black where the image matches, red to yellow as the error grows to the largest one.
+static void HeatMapRows(void* context, int slice, int begin, int end)
+{
+  DifferenceTask& task = *static_cast<DifferenceTask*>(context);
+  float errors[PIXEL_PRINTF_DIFFERENCE_CHUNK];
+
+  for (int y = begin; y < end; ++y)
+  {
+    size_t row_offset = (size_t)y * task.pitch;
+    unsigned char* heat_row = task.heat_map + (size_t)y * task.width * 4;
+    for (int x = 0; x < task.width; x += PIXEL_PRINTF_DIFFERENCE_CHUNK)
+    {
+      int count = (task.width - x) < PIXEL_PRINTF_DIFFERENCE_CHUNK ? (task.width - x) : PIXEL_PRINTF_DIFFERENCE_CHUNK;
+      size_t offset = row_offset + (size_t)x * task.bytes_per_pixel;
+      PixelErrors(task, task.data + offset, task.golden + offset, count, errors);
+
+      for (int i = 0; i < count; ++i)
+      {
+        unsigned char* pixel = heat_row + 4 * (x + i);
+        float heat = errors[i] > task.tolerance ? (errors[i] - task.tolerance) * task.heat_scale : -1.0f;
+        heat = heat < 1.0f ? heat : 1.0f;
+        pixel[0] = heat >= 0.0f ? 255 : 0;
+        pixel[1] = heat >= 0.0f ? (unsigned char)(heat * 255.0f) : 0;
+        pixel[2] = 0;
+        pixel[3] = 255;
+      }
+    }
+  }
+}
+
+int PicoPixelClient::Impl::RecvRaw(char* dst_buffer,
+                                   unsigned int buffer_size,
+                                   unsigned int timeout,
+                                   bool& connection_closed,
+                                   bool peek)
+{
+  if (!Connected())
+  {
+    connection_closed = true;
+    return 0;
+  }
+
+  if (dst_buffer == NULL || buffer_size < 1L)
+  {
+    return 0;
+  }
+
+  TIMEVAL  stTime;
+  SOCKET socket = sock_;
+
+  fd_set  fd_read;
+  FD_ZERO(&fd_read);
+  FD_SET(socket, &fd_read);
+  stTime.tv_sec = timeout / 1000;
+  stTime.tv_usec = timeout % 1000;
+
+  // Select function set read timeout
+  unsigned int bytes_read = 0;
+
+  int res = select((int)(socket + 1), &fd_read, NULL, NULL, &stTime);
+  if (res == SOCKET_ERROR)
+  {
+    printf("[PicoPixelClient::Impl::ReadSocket] 'select' has failed.\n");
+    return 0xFFFFFFFF;
+  }
+
+  int error_code = 0;
+  if (FD_ISSET(socket, &fd_read))
+  {
+    res = recv(socket, (char*)dst_buffer, buffer_size, peek ? MSG_PEEK : 0);
+
+    if (res == SOCKET_ERROR)
+    {
+      printf("[PicoPixelClient::Impl::ReadSocket] 'recv' has failed.\n");
+      error_code = WSAGetLastError();
+      return -1;
+    }
+
+    if (res == 0)
+    {
+      printf("[PicoPixelClient::Impl::ReadSocket] Connection closed.\n");
+      connection_closed = true;
+      sock_ = INVALID_SOCKET;
+      return 0;
+    }
+
+    bytes_read = (unsigned int)((res >= 0) ? (res) : (-1L));
+  }
+
+  return bytes_read;
+}
+
+DWORD PicoPixelClient::Impl::ReceiverThread(void* ptr)
+{
+  PicoPixelClient* pixel_printf = static_cast<PicoPixelClient*>(ptr);
+
+  unsigned int  bytes_read = 0;
+  unsigned int  timeout = 1000;
+  bool connection_closed = false;
+  bool connection_dropped = false;
+  const int receive_buffer_size = 1024;
+  char receive_buffer[receive_buffer_size];
+
+  while (pixel_printf->impl_->client_side_connection_termination_ == false)
+  {
+    while (pixel_printf->Connected() && (connection_closed == false) && (connection_dropped == false))
+    {
+      // Blocking mode: Wait for event
+      bytes_read = 0;
+      int res = pixel_printf->impl_->RecvRaw(receive_buffer, receive_buffer_size, timeout, connection_closed, true);
+
+      if (res == SOCKET_ERROR)
+      {
+        connection_dropped = true;
+      }
+
+      if (connection_closed || connection_dropped)
+      {
+        // This thread is bout to be terminated.
+        if (connection_closed)
+        {
+          printf("[PicoPixelClient::Impl::ReceiverThread] Connection closed.\n");
+        }
+        else
+        {
+          printf("[PicoPixelClient::Impl::ReceiverThread] Connection droped.\n");
+        }
+      }
+
+      if (res > 0)
+      {
+        PixelPrintfProtocol* pixel_printf_header = (PixelPrintfProtocol*)receive_buffer;
+
+        if ((pixel_printf_header->picomagic == PICO_PIXEL_NET_SIGNATURE) && (pixel_printf_header->payload_type == PackageType::PACKAGE_TYPE_MARKER))
+        {
+          MarkerDataHeader payload_markers;
+          pixel_printf->impl_->RecvRaw((char*)&payload_markers, sizeof(payload_markers), PIXEL_PRINTF_RECV_TIMEOUT, connection_closed);
+
+          for (int i = 0; i < payload_markers.marker_count; ++i)
+          {
+            int index = 0;
+            int use_count = 0;
+            int name_size = 0;
+          
+            if (pixel_printf->impl_->RecvInteger(&index, 1) <= 0)
+            {
+              pixel_printf->impl_->FlushRecvBuffer();
+              break;
+            }
+
+            if (pixel_printf->impl_->RecvInteger(&use_count, 1) <= 0)
+            {
+              pixel_printf->impl_->FlushRecvBuffer();
+              break;
+            }
+
+            if ((pixel_printf->impl_->RecvInteger(&name_size, 1) <= 0) || (name_size <= 0) || (name_size > PIXEL_PRINTF_MAX_NAME_SIZE))
+            {
+              pixel_printf->impl_->FlushRecvBuffer();
+              break;
+            }
+
+            char name[PIXEL_PRINTF_MAX_NAME_SIZE];
+            if (pixel_printf->impl_->RecvString(name, name_size) <= 0)
+            {
+              pixel_printf->impl_->FlushRecvBuffer();
+              break;
+            }
+
+            pixel_printf->impl_->SetMarkerFromPicoPixel(index, use_count);
+          }
+        }
+        else if ((pixel_printf_header->picomagic == PICO_PIXEL_NET_SIGNATURE) && (pixel_printf_header->payload_type == PackageType::PACKAGE_TYPE_REGION_OF_INTEREST))
+        {
+          pixel_printf->impl_->ReceiveRegionOfInterest(connection_closed);
+        }
+        else if ((pixel_printf_header->picomagic == PICO_PIXEL_NET_SIGNATURE) && (pixel_printf_header->payload_type == PackageType::PACKAGE_TYPE_IMAGE_ACK))
+        {
+          pixel_printf->impl_->ReceiveImageAck(connection_closed);
+        }
+        else if ((pixel_printf_header->picomagic == PICO_PIXEL_NET_SIGNATURE) && (pixel_printf_header->payload_type == PackageType::PACKAGE_TYPE_FLOW_CREDIT))
+        {
+          pixel_printf->impl_->ReceiveFlowCredit(connection_closed);
+        }
+        else if ((pixel_printf_header->picomagic == PICO_PIXEL_NET_SIGNATURE) && (pixel_printf_header->payload_type == PackageType::PACKAGE_TYPE_FLIGHT_RECORDER_DUMP))
+        {
+          pixel_printf->impl_->ReceiveFlightRecorderDump(connection_closed);
+        }
+        else if ((pixel_printf_header->picomagic == PICO_PIXEL_NET_SIGNATURE) && (pixel_printf_header->payload_type == PackageType::PACKAGE_TYPE_VIEWER_HANDSHAKE))
+        {
+          pixel_printf->impl_->ReceiveViewerHandShake(connection_closed);
+        }
+        else
+        {
+          pixel_printf->impl_->FlushRecvBuffer();
+        }
+        bytes_read = res;
+      }
+    }
+
+    connection_closed = true;
+    connection_dropped = true;
+
+    if (pixel_printf->impl_->auto_reconnect_on_picopixel_shutdown_ && (pixel_printf->impl_->client_side_connection_termination_ == false))
+    {
+      pixel_printf->impl_->trying_to_reconnect_to_pico_pixel_ = true;
+
+      if (pixel_printf->impl_->host_ip_.empty())
+      {
+        pixel_printf->impl_->port_ = PICO_PIXEL_SERVER_PORT;
+      }
+
+      bool reconnected = pixel_printf->impl_->relay_path_.empty() ?
+        pixel_printf->StartConnectionToHost(pixel_printf->impl_->host_ip_, pixel_printf->impl_->port_) :
+        pixel_printf->StartConnectionToRelay(pixel_printf->impl_->relay_path_);
+      if (reconnected)
+      {
+        pixel_printf->SendMarkersToPicoPixel();
+        connection_closed = false;
+        connection_dropped = false;
+        pixel_printf->impl_->trying_to_reconnect_to_pico_pixel_ = false;
+      }
+    }
+    else
+    {
+      break;
+    }
+  }
+  pixel_printf->impl_->trying_to_reconnect_to_pico_pixel_ = false;
+  return 0;
+}
+
+bool PicoPixelClient::Impl::SendRaw(const char* ptr, int size)
+{
+  return SendRaw(sock_, ptr, size);
+}
+
+bool PicoPixelClient::Impl::SendRaw(SOCKET socket, const char* ptr, int size)
+{
+  if (ptr == NULL)
+    return false;
+  
+  if (size <= 0)
+    return false;
+
+  if (size > INT_MAX)
+    return false;
+
+  int error_code = 0;
+  int total_sent = 0;
+  int ret = 0;
+
+  while(total_sent < size)
+  {
+    ret = send(socket, (const char*)ptr + total_sent, size - total_sent, 0);
+    if (ret == -1)
+    {
+      break;
+    }
+    total_sent += ret;
+  }
+  
+  if( ret == -1 )
+  {
+    error_code = WSAGetLastError();
+    printf("[PixelPrintF] Failed to send data to Pico Pixel server.\n");
+    return false;
+  }
+  return true;
+}
+
+bool PicoPixelClient::Impl::SendRaw(const char* head, int head_size, const char* ptr, int size)
+{
+  WSABUF buffers[2];
+  buffers[0].buf = (char*)head;
+  buffers[0].len = (ULONG)head_size;
+  buffers[1].buf = (char*)ptr;
+  buffers[1].len = (ULONG)size;
+
+  DWORD sent = 0;
+  if (WSASend(sock_, buffers, 2, &sent, 0, NULL, NULL) == SOCKET_ERROR)
+  {
+    printf("[PixelPrintF] Failed to send data to Pico Pixel server.\n");
+    return false;
+  }
+
+  // A blocking WSASend sends everything, but be safe.
+  if (sent < (DWORD)head_size)
+  {
+    return SendRaw(head + sent, head_size - (int)sent) && SendRaw(ptr, size);
+  }
+
+  int ptr_sent = (int)(sent - head_size);
+  return (ptr_sent == size) || SendRaw(ptr + ptr_sent, size - ptr_sent);
+}
+
+// With a send buffer of 0, Winsock sends straight from the package instead of copying it to the send buffer.
+// Several sends in flight keep the connection busy.
+bool PicoPixelClient::Impl::SendOverlapped(SendPacket* packet)
+{
+  while ((overlapped_send_count_ == PIXEL_PRINTF_MAX_OVERLAPPED_SENDS) ||
+    ((overlapped_send_count_ > 0) && (overlapped_bytes_ + packet->size > (UINT64)zero_copy_max_bytes_)))
+  {
+    CompleteOverlappedSend(true);
+  }
+
+  OverlappedSend& send = overlapped_sends_[(first_overlapped_send_ + overlapped_send_count_) % PIXEL_PRINTF_MAX_OVERLAPPED_SENDS];
+  HANDLE event = send.overlapped.hEvent;
+  std::memset(&send.overlapped, 0, sizeof(WSAOVERLAPPED));
+  send.overlapped.hEvent = event;
+  ResetEvent(event);
+
+  WSABUF buffer;
+  buffer.buf = packet->data;
+  buffer.len = (ULONG)packet->size;
+  DWORD sent = 0;
+  if ((WSASend(sock_, &buffer, 1, &sent, 0, &send.overlapped, NULL) == SOCKET_ERROR) && (WSAGetLastError() != WSA_IO_PENDING))
+  {
+    printf("[PixelPrintF] Failed to send data to Pico Pixel server.\n");
+    return false;
+  }
+
+  // The event is set even when the send completes at once.
+  send.packet = packet;
+  send.socket = sock_;
+  send.size = packet->size;
+  overlapped_bytes_ += send.size;
+  ++overlapped_send_count_;
+  packet->in_flight = true;
+  return true;
+}
+
+bool PicoPixelClient::Impl::CompleteOverlappedSend(bool wait)
+{
+  if (overlapped_send_count_ == 0)
+    return false;
+
+  // Closing the socket completes its sends too.
+  OverlappedSend& send = overlapped_sends_[first_overlapped_send_];
+  if (WaitForSingleObject(send.overlapped.hEvent, wait ? INFINITE : 0) != WAIT_OBJECT_0)
+    return false;
+
+  UINT64 send_end = MonotonicMicroseconds();
+  DWORD sent = 0;
+  DWORD flags = 0;
+  if (WSAGetOverlappedResult(send.socket, &send.overlapped, &sent, FALSE, &flags) && ((UINT64)sent == send.size))
+  {
+    MeasureWrite(send.size);
+    if (send.packet->trace_sequence != 0)
+    {
+      RecordSendLatency(send.packet, send.packet->send_begin, send_end);
+    }
+  }
+  else
+  {
+    // The package is cut short and Pico Pixel would misread every package after it. Close the connection so the
+    // receiver thread sees it lost; a socket EndConnection already closed is left alone.
+    printf("[PicoPixelClient::Impl::SenderThread] Failed to send data to Pico Pixel server.\n");
+    if (send.socket == sock_)
+    {
+      shutdown(send.socket, SD_BOTH);
+    }
+  }
+
+  first_overlapped_send_ = (first_overlapped_send_ + 1) % PIXEL_PRINTF_MAX_OVERLAPPED_SENDS;
+  --overlapped_send_count_;
+  overlapped_bytes_ -= send.size;
+
+  RetirePacket(send.packet);
+  return true;
+}
+
+// Sends 'head' followed by 'size' bytes of 'file' starting at 'offset'. The file data goes from the file system
+// cache to the socket without being copied to user space.
+bool PicoPixelClient::Impl::SendFile(HANDLE file, UINT64 offset, UINT64 size, const char* head, int head_size)
+{
+  TRANSMIT_FILE_BUFFERS head_buffer;
+  head_buffer.Head = (void*)head;
+  head_buffer.HeadLength = head_size;
+  head_buffer.Tail = NULL;
+  head_buffer.TailLength = 0;
+
+  bool head_sent = false;
+  bool transmit_failed = false;
+  int error_code = 0;
+  UINT64 total_sent = 0;
+  while (total_sent < size)
+  {
+    UINT64 remaining = size - total_sent;
+    DWORD chunk = (DWORD)(remaining < PIXEL_PRINTF_FILE_CHUNK ? remaining : PIXEL_PRINTF_FILE_CHUNK);
+
+    LARGE_INTEGER position;
+    position.QuadPart = (LONGLONG)(offset + total_sent);
+    if (!SetFilePointerEx(file, position, NULL, FILE_BEGIN))
+      break;
+
+    if (!TransmitFile(sock_, file, chunk, 0, NULL, head_sent ? NULL : &head_buffer, 0))
+    {
+      transmit_failed = true;
+      error_code = WSAGetLastError();
+      break;
+    }
+
+    head_sent = true;
+    total_sent += chunk;
+  }
+
+  if (total_sent == size)
+    return true;
+
+  // Nothing went out: the file could not be positioned, or TransmitFile is not available on this socket (layered
+  // service providers). In the latter case send from a mapping of the file instead.
+  if (!head_sent && !transmit_failed)
+    return false;
+
+  if (!head_sent && ((error_code == WSAEOPNOTSUPP) || (error_code == WSAEINVAL)))
+    return SendMappedFile(file, offset, size, head, head_size);
+
+  // Any other failure may have written part of the package, and Pico Pixel cannot find the next package in the
+  // stream. Close the connection; the receiver thread sees it and reconnects if asked to.
+  printf("[PicoPixelClient::Impl::SendFile] TransmitFile failed: %d.\n", error_code);
+  shutdown(sock_, SD_BOTH);
+  return false;
+}
+
+bool PicoPixelClient::Impl::SendMappedFile(HANDLE file, UINT64 offset, UINT64 size, const char* head, int head_size)
+{
+  HANDLE mapping = ::CreateFileMapping(file, NULL, PAGE_READONLY, 0, 0, NULL);
+  if (mapping == NULL)
+  {
+    printf("[PicoPixelClient::Impl::SendMappedFile] CreateFileMapping failed: %d\n", (int)GetLastError());
+    return false;
+  }
+
+  SYSTEM_INFO system_info;
+  GetSystemInfo(&system_info);
+  UINT64 granularity = system_info.dwAllocationGranularity;
+
+  bool success = true;
+  UINT64 total_sent = 0;
+  while (success && (total_sent < size))
+  {
+    // Views have to start on the allocation granularity.
+    UINT64 position = offset + total_sent;
+    UINT64 view_offset = position - (position % granularity);
+    UINT64 remaining = size - total_sent;
+    int chunk = (int)(remaining < PIXEL_PRINTF_FILE_CHUNK ? remaining : PIXEL_PRINTF_FILE_CHUNK);
+    SIZE_T view_size = (SIZE_T)(position - view_offset) + chunk;
+
+    const char* view = (const char*)MapViewOfFile(mapping, FILE_MAP_READ, (DWORD)(view_offset >> 32), (DWORD)view_offset, view_size);
+    if (view == NULL)
+    {
+      printf("[PicoPixelClient::Impl::SendMappedFile] MapViewOfFile failed: %d\n", (int)GetLastError());
+      success = false;
+      break;
+    }
+
+    // The head goes out with the first chunk.
+    if (total_sent == 0)
+      success = SendRaw(head, head_size, view + (position - view_offset), chunk);
+    else
+      success = SendRaw(view + (position - view_offset), chunk);
+    UnmapViewOfFile(view);
+    total_sent += chunk;
+  }
+
+  ::CloseHandle(mapping);
+
+  // Part of the package may be on the wire, like in SendFile. Close the connection rather than let Pico Pixel
+  // read the next package from the middle of this one.
+  if (!success && (total_sent > 0))
+  {
+    shutdown(sock_, SD_BOTH);
+  }
+  return success;
+}
+
+void PicoPixelClient::Impl::FlushRecvBuffer()
+{
+  char buffer_flush[256];
+  bool end = false;
+  bool connection_closed = false;
+  int count = 0;
+  while (!end)
+  {
+    count = RecvRaw((char*)buffer_flush, 256, default_timeout_millisec_, connection_closed);
+    if (count <= 0 || connection_closed)
+    {
+      end = true;
+    }
+  }
+}
+
+int PicoPixelClient::Impl::RecvInteger(int* val, int expected_size)
+{
+  int count = 0;
+  int total_bytes = 0;
+  bool end = false;
+  bool connection_closed = false;
+  int trial = 0;
+  while (!end)
+  {
+    count = RecvRaw((char*)val + count, expected_size * sizeof(int) - count, default_timeout_millisec_, connection_closed);
+    if ((count == 0) && (trial++ == Impl::trials_read_on_socket))
+    {
+      return total_bytes / sizeof(int);
+    }
+
+    total_bytes += count;
+    if (total_bytes == expected_size * sizeof(int))
+      end = true;
+  }
+
+  return total_bytes / sizeof(int);
+}
+
+int PicoPixelClient::Impl::RecvString(char* str, int expected_size, char str_terminal_char)
+{
+  int count = 0;
+  int total_bytes = 0;
+  bool end = false;
+  bool connection_closed = false;
+  int trial = 0;
+  while (!end)
+  {
+    count = RecvRaw(str + count, expected_size * sizeof(char) - count, default_timeout_millisec_, connection_closed);
+    if ((count == 0) && (trial++ == Impl::trials_read_on_socket))
+      return total_bytes / sizeof(char);
+
+    total_bytes += count;
+    if (total_bytes == expected_size)
+      end = true;
+  }
+
+  return total_bytes / sizeof(char);
+}
+
+void PicoPixelClient::Impl::HandShake(SOCKET socket, std::string client_id)
+{
+  HandShakeHeader hand_shake;
+  hand_shake.size = (unsigned int) client_id.size() + 1;
+
+  if (hand_shake.size > UINT_MAX)
+    return;
+
+  // Version 1 until the viewer tells otherwise.
+  InterlockedExchange(&viewer_protocol_version_, 1);
+  SendRaw(socket, reinterpret_cast<const char*>(&hand_shake), sizeof(HandShakeHeader));
+  SendRaw(socket, client_id.c_str(), (unsigned int)client_id.size() + 1);
+
+  // Credits and name registrations of a previous connection are meaningless to the new one. The threads using
+  // them drop them when they see the new generation.
+  InterlockedIncrement(&connection_generation_);
+  if (flow_control_ != PicoPixelClient::FLOW_CONTROL_OFF)
+  {
+    FlowControlRequestHeader request;
+    request.max_images = flow_control_max_images_;
+    request.max_bytes = flow_control_max_bytes_;
+    SendRaw(socket, reinterpret_cast<const char*>(&request), sizeof(FlowControlRequestHeader));
+  }
+}
+
+SendPacket* PicoPixelClient::Impl::AcquirePacket()
+{
+  SendPacket* packet = (SendPacket*)InterlockedPopEntrySList(&free_packets_);
+  if (packet != NULL)
+  {
+    InterlockedDecrement(&free_packet_count_);
+    packet->Clear();
+    return packet;
+  }
+
+  // SLIST entries have to be aligned on MEMORY_ALLOCATION_ALIGNMENT.
+  void* memory = _aligned_malloc(sizeof(SendPacket), MEMORY_ALLOCATION_ALIGNMENT);
+  if (memory == NULL)
+    return NULL;
+
+  return new (memory) SendPacket(&buffer_pool_);
+}
+
+void PicoPixelClient::Impl::ReleasePacket(SendPacket* packet)
+{
+  if (packet->file != NULL)
+  {
+    ::CloseHandle(packet->file);
+    packet->file = NULL;
+  }
+  packet->ReleaseData();
+
+  if (InterlockedIncrement(&free_packet_count_) > PIXEL_PRINTF_MAX_FREE_PACKETS)
+  {
+    InterlockedDecrement(&free_packet_count_);
+    packet->~SendPacket();
+    _aligned_free(packet);
+    return;
+  }
+
+  InterlockedPushEntrySList(&free_packets_, &packet->entry);
+}
+
+void PicoPixelClient::Impl::DestroyFreePackets()
+{
+  SendPacket* packet = NULL;
+  while ((packet = (SendPacket*)InterlockedPopEntrySList(&free_packets_)) != NULL)
+  {
+    InterlockedDecrement(&free_packet_count_);
+    packet->~SendPacket();
+    _aligned_free(packet);
+  }
+}
+
+bool PicoPixelClient::Impl::SubmitPacket(SendPacket* packet)
+{
+  if (sender_thread_ == NULL)
+  {
+    ReleasePacket(packet);
+    return false;
+  }
+
+  // Images sent faster than the link drains them would otherwise pile up in memory. The queue always takes one
+  // image, however large, and other packages (markers, summaries) are small and never dropped.
+  if (packet->needs_credit)
+  {
+    LONGLONG bytes = (LONGLONG)(packet->size + packet->file_size);
+    LONGLONG queued = InterlockedExchangeAdd64(&queued_bytes_, bytes);
+    LONGLONG max_bytes = max_queued_bytes_;
+    if ((max_bytes > 0) && (queued > 0) && (queued + bytes > max_bytes))
+    {
+      InterlockedExchangeAdd64(&queued_bytes_, -bytes);
+      InterlockedIncrement(&dropped_images_);
+      ReleasePacket(packet);
+      return false;
+    }
+  }
+
+  InterlockedIncrement(&queued_packets_);
+  InterlockedPushEntrySList(&send_queue_, &packet->entry);
+  SetEvent(send_event_);
+  return true;
+}
+
+void PicoPixelClient::Impl::RetirePacket(SendPacket* packet)
+{
+  if (packet->needs_credit)
+  {
+    InterlockedExchangeAdd64(&queued_bytes_, -(LONGLONG)(packet->size + packet->file_size));
+  }
+  ReleasePacket(packet);
+
+  // Taking the lock orders the wake up after the check of a Flush about to sleep.
+  if (InterlockedDecrement(&queued_packets_) == 0)
+  {
+    EnterCriticalSection(&sent_lock_);
+    WakeAllConditionVariable(&queue_drained_);
+    LeaveCriticalSection(&sent_lock_);
+  }
+}
+
+bool PicoPixelClient::Impl::Flush(unsigned int timeout_ms)
+{
+  ULONGLONG start = GetTickCount64();
+  bool flushed = true;
+  EnterCriticalSection(&sent_lock_);
+  while (queued_packets_ > 0)
+  {
+    ULONGLONG elapsed = GetTickCount64() - start;
+    if (elapsed >= timeout_ms)
+    {
+      flushed = false;
+      break;
+    }
+
+    SleepConditionVariableCS(&queue_drained_, &sent_lock_, (DWORD)(timeout_ms - elapsed));
+  }
+  LeaveCriticalSection(&sent_lock_);
+  return flushed;
+}
+
+void PicoPixelClient::Impl::StartSender()
+{
+  if (sender_thread_ != NULL)
+    return;
+
+  send_event_ = ::CreateEvent(NULL, FALSE, FALSE, NULL);
+  credit_event_ = ::CreateEvent(NULL, FALSE, FALSE, NULL);
+  for (int i = 0; i < PIXEL_PRINTF_MAX_OVERLAPPED_SENDS; ++i)
+  {
+    overlapped_sends_[i].overlapped.hEvent = ::CreateEvent(NULL, TRUE, FALSE, NULL);
+  }
+  sender_exit_ = false;
+  sender_thread_ = ::CreateThread(NULL, 0, PicoPixelClient::Impl::SenderThread, this, 0, NULL);
+  if (sender_thread_ == NULL)
+  {
+    printf("[PicoPixelClient::Impl::StartSender] Failed to create sender thread.\n");
+    ::CloseHandle(send_event_);
+    ::CloseHandle(credit_event_);
+    send_event_ = NULL;
+    credit_event_ = NULL;
+    CloseOverlappedEvents();
+  }
+}
+
+void PicoPixelClient::Impl::StopReceiver()
+{
+  // The receiver thread ends the connection itself when Pico Pixel closes it.
+  if ((receiver_thread_ == NULL) || (GetCurrentThreadId() == thread_id_))
+    return;
+
+  WaitForSingleObject(receiver_thread_, INFINITE);
+  ::CloseHandle(receiver_thread_);
+  receiver_thread_ = NULL;
+}
+
+// Safe to call again once stopped, as the client destructor and then the Impl destructor do.
+void PicoPixelClient::Impl::StopSender()
+{
+  if (sender_thread_ == NULL)
+    return;
+
+  sender_exit_ = true;
+  SetEvent(send_event_);
+  WaitForSingleObject(sender_thread_, INFINITE);
+
+  ::CloseHandle(sender_thread_);
+  ::CloseHandle(send_event_);
+  ::CloseHandle(credit_event_);
+  sender_thread_ = NULL;
+  send_event_ = NULL;
+  credit_event_ = NULL;
+  CloseOverlappedEvents();
+}
+
+void PicoPixelClient::Impl::CloseOverlappedEvents()
+{
+  for (int i = 0; i < PIXEL_PRINTF_MAX_OVERLAPPED_SENDS; ++i)
+  {
+    if (overlapped_sends_[i].overlapped.hEvent != NULL)
+    {
+      ::CloseHandle(overlapped_sends_[i].overlapped.hEvent);
+      overlapped_sends_[i].overlapped.hEvent = NULL;
+    }
+  }
+}
+
+bool PicoPixelClient::Impl::WritePacket(SendPacket* packet)
+{
+  if (!Connected())
+    return false;
+
+  if ((packet->name_id != 0) && !WriteImageName(packet->name_id))
+    return false;
+
+  if (packet->file != NULL)
+  {
+    return SendFile(packet->file, packet->file_offset, packet->file_size, packet->data, (int)packet->size);
+  }
+
+  if ((zero_copy_max_bytes_ > 0) && (packet->size >= PIXEL_PRINTF_ZERO_COPY_MIN_SIZE) &&
+      (packet->size <= PIXEL_PRINTF_SEND_CHUNK))
+  {
+    return SendOverlapped(packet);
+  }
+
+  size_t total_sent = 0;
+  while (total_sent < packet->size)
+  {
+    size_t remaining = packet->size - total_sent;
+    int chunk = (int)(remaining < PIXEL_PRINTF_SEND_CHUNK ? remaining : PIXEL_PRINTF_SEND_CHUNK);
+    if (!SendRaw(packet->data + total_sent, chunk))
+      return false;
+    total_sent += chunk;
+  }
+  return true;
+}
+
+bool PicoPixelClient::Impl::WriteRange(SendPacket* packet, UINT64 offset, UINT64 size, const char* head, int head_size)
+{
+  // Part in memory, then part in the file.
+  if (offset < packet->size)
+  {
+    int data_size = (int)(packet->size - offset < size ? packet->size - offset : size);
+    if (!SendRaw(head, head_size, packet->data + offset, data_size))
+      return false;
+
+    offset += data_size;
+    size -= data_size;
+    head = NULL;
+    head_size = 0;
+  }
+
+  if (size == 0)
+    return true;
+
+  return SendFile(packet->file, packet->file_offset + (offset - packet->size), size, head, head_size);
+}
+
+bool PicoPixelClient::Impl::WriteChunk(SendPacket* packet, UINT64& written)
+{
+  // The beginning of the package went to a previous connection.
+  if (!Connected() || (packet->chunk_generation != connection_generation_))
+    return false;
+
+  if ((packet->write_offset == 0) && (packet->name_id != 0) && !WriteImageName(packet->name_id))
+    return false;
+
+  UINT64 remaining = packet->size + packet->file_size - packet->write_offset;
+  PackageChunkHeader header;
+  header.stream_id = packet->chunk_stream;
+  header.size = (INT64)(remaining < PIXEL_PRINTF_SCHEDULE_CHUNK ? remaining : PIXEL_PRINTF_SCHEDULE_CHUNK);
+  header.last = ((UINT64)header.size == remaining) ? 1 : 0;
+  if (!WriteRange(packet, packet->write_offset, (UINT64)header.size, (const char*)&header, sizeof(header)))
+    return false;
+
+  written = (UINT64)header.size;
+  return true;
+}
+
+bool PicoPixelClient::Impl::WriteNext(SendPacket* packet, SendStream& stream)
+{
+  UINT64 total_size = packet->size + packet->file_size;
+  if (packet->write_offset == 0)
+  {
+    if (packet->trace_sequence != 0)
+    {
+      ExpectImageAck(packet);
+    }
+    packet->send_begin = MonotonicMicroseconds();
+
+    // Large packages are chunked while priorities are in use, so that other streams can go in between.
+    if ((prioritized_images_ > 0) && (total_size > PIXEL_PRINTF_SCHEDULE_CHUNK))
+    {
+      packet->chunk_stream = ++next_chunk_stream_;
+      packet->chunk_generation = connection_generation_;
+    }
+  }
+
+  UINT64 written = total_size;
+  bool success = (packet->chunk_stream != 0) ? WriteChunk(packet, written) : WritePacket(packet);
+  UINT64 write_end = MonotonicMicroseconds();
+  if (!success)
+  {
+    printf("[PicoPixelClient::Impl::SenderThread] Failed to send data to Pico Pixel server.\n");
+    return true;
+  }
+
+  // Overlapped sends are measured when they complete.
+  if (!packet->in_flight)
+  {
+    MeasureWrite(written);
+  }
+  stream.virtual_time += written * pixel_printf_priority_costs[packet->priority];
+  packet->write_offset += written;
+  if (packet->write_offset < total_size)
+    return false;
+
+  if ((packet->trace_sequence != 0) && !packet->in_flight)
+  {
+    RecordSendLatency(packet, packet->send_begin, write_end);
+  }
+  return true;
+}
+
+void PicoPixelClient::Impl::QueuePackets()
+{
+  // The queue is LIFO, reverse it to send in submission order.
+  PSLIST_ENTRY entry = InterlockedFlushSList(&send_queue_);
+  SendPacket* packets = NULL;
+  while (entry != NULL)
+  {
+    SendPacket* packet = (SendPacket*)entry;
+    entry = entry->Next;
+    packet->next = packets;
+    packets = packet;
+  }
+
+  while (packets != NULL)
+  {
+    SendPacket* packet = packets;
+    packets = packet->next;
+    packet->next = NULL;
+
+    SendStream& stream = send_streams_[packet->priority];
+    if (stream.tail != NULL)
+    {
+      stream.tail->next = packet;
+    }
+    else
+    {
+      // A stream that was idle does not get credit for the time it did not use.
+      stream.head = packet;
+      stream.virtual_time = stream.virtual_time > virtual_time_ ? stream.virtual_time : virtual_time_;
+    }
+    stream.tail = packet;
+  }
+}
+
+SendStream* PicoPixelClient::Impl::NextStream()
+{
+  // Ties go to the highest priority.
+  SendStream* next = NULL;
+  for (int priority = PIXEL_PRINTF_PRIORITY_COUNT - 1; priority >= 0; --priority)
+  {
+    SendStream& stream = send_streams_[priority];
+    if ((stream.head != NULL) && !stream.held && ((next == NULL) || (stream.virtual_time < next->virtual_time)))
+    {
+      next = &stream;
+    }
+  }
+
+  if (next != NULL)
+  {
+    virtual_time_ = next->virtual_time;
+  }
+  return next;
+}
+
+bool PicoPixelClient::Impl::WriteImageName(unsigned int name_id)
+{
+  if (sender_connection_generation_ != connection_generation_)
+  {
+    sender_connection_generation_ = connection_generation_;
+    sent_image_names_.clear();
+  }
+
+  if (name_id < sent_image_names_.size() && sent_image_names_[name_id])
+    return true;
+
+  ImageNameHeader header;
+  header.name_id = name_id;
+  const std::string& name = image_names_[name_id - 1];
+  int name_size = (int)name.size() + 1;
+
+  char buffer[sizeof(ImageNameHeader) + sizeof(int) + PIXEL_PRINTF_MAX_NAME_SIZE];
+  if (name_size > PIXEL_PRINTF_MAX_NAME_SIZE)
+    return false;
+
+  std::memcpy(buffer, &header, sizeof(ImageNameHeader));
+  std::memcpy(buffer + sizeof(ImageNameHeader), &name_size, sizeof(int));
+  std::memcpy(buffer + sizeof(ImageNameHeader) + sizeof(int), name.c_str(), name_size);
+  if (!SendRaw(buffer, (int)(sizeof(ImageNameHeader) + sizeof(int)) + name_size))
+    return false;
+
+  if (name_id >= sent_image_names_.size())
+  {
+    sent_image_names_.resize(name_id + 1, false);
+  }
+  sent_image_names_[name_id] = true;
+  return true;
+}
+
+bool PicoPixelClient::Impl::TakeCredits(const SendPacket* packet)
+{
+  if (!packet->needs_credit || (flow_control_ == PicoPixelClient::FLOW_CONTROL_OFF))
+    return true;
+
+  EnterCriticalSection(&credit_lock_);
+  SyncCredits();
+
+  // An image larger than the byte window goes out as soon as there are credits at all.
+  bool granted = !(image_credits_limited_ && (image_credits_ <= 0)) && !(byte_credits_limited_ && (byte_credits_ <= 0));
+  if (granted && image_credits_limited_)
+  {
+    --image_credits_;
+  }
+
+  if (granted && byte_credits_limited_)
+  {
+    byte_credits_ -= (LONGLONG)(packet->size + packet->file_size);
+  }
+  LeaveCriticalSection(&credit_lock_);
+  return granted;
+}
+
+void PicoPixelClient::Impl::SyncCredits()
+{
+  // Until the first grant of a new connection, images are not limited.
+  LONG generation = connection_generation_;
+  if (credit_generation_ == generation)
+    return;
+
+  credit_generation_ = generation;
+  image_credits_limited_ = false;
+  byte_credits_limited_ = false;
+  image_credits_ = 0;
+  byte_credits_ = 0;
+}
+
+void PicoPixelClient::Impl::ReplaceHeldImages(SendStream& stream)
+{
+  std::vector<SendPacket*> packets;
+  for (SendPacket* packet = stream.head; packet != NULL; packet = packet->next)
+  {
+    packets.push_back(packet);
+  }
+
+  // Walk from the newest packet so that the first image of each name seen is the one kept.
+  std::set<std::string> newer_names;
+  std::vector<bool> replaced(packets.size(), false);
+  for (size_t i = packets.size(); i-- > 0; )
+  {
+    const SendPacket* packet = packets[i];
+    if (packet->needs_credit && !packet->image_name.empty() && (packet->write_offset == 0) && !packet->in_flight)
+    {
+      replaced[i] = !newer_names.insert(packet->image_name).second;
+    }
+  }
+
+  stream.head = NULL;
+  stream.tail = NULL;
+  for (size_t i = 0; i < packets.size(); ++i)
+  {
+    SendPacket* packet = packets[i];
+    if (replaced[i])
+    {
+      InterlockedIncrement(&dropped_images_);
+      RetirePacket(packet);
+      continue;
+    }
+
+    packet->next = NULL;
+    if (stream.tail != NULL)
+    {
+      stream.tail->next = packet;
+    }
+    else
+    {
+      stream.head = packet;
+    }
+    stream.tail = packet;
+  }
+}
+
+void PicoPixelClient::Impl::ReceiveFlowCredit(bool& connection_closed)
+{
+  FlowCreditHeader payload_credit;
+  RecvRaw((char*)&payload_credit, sizeof(payload_credit), PIXEL_PRINTF_RECV_TIMEOUT, connection_closed);
+
+  EnterCriticalSection(&credit_lock_);
+  SyncCredits();
+  if (payload_credit.images > 0)
+  {
+    image_credits_ += payload_credit.images;
+    image_credits_limited_ = true;
+  }
+
+  if (payload_credit.bytes > 0)
+  {
+    byte_credits_ += payload_credit.bytes;
+    byte_credits_limited_ = true;
+  }
+  LeaveCriticalSection(&credit_lock_);
+
+  if (credit_event_ != NULL)
+  {
+    SetEvent(credit_event_);
+  }
+}
+
+void PicoPixelClient::Impl::ReceiveViewerHandShake(bool& connection_closed)
+{
+  ViewerHandShakeHeader hand_shake;
+  if (RecvRaw((char*)&hand_shake, sizeof(hand_shake), PIXEL_PRINTF_RECV_TIMEOUT, connection_closed) != (int)sizeof(hand_shake))
+    return;
+
+  int version = hand_shake.protocol_version < PICO_PIXEL_PROTOCOL_VERSION ? hand_shake.protocol_version : PICO_PIXEL_PROTOCOL_VERSION;
+  InterlockedExchange(&viewer_protocol_version_, version > 1 ? version : 1);
+}
+
+DWORD PicoPixelClient::Impl::SenderThread(void* ptr)
+{
+  PicoPixelClient::Impl* impl = static_cast<PicoPixelClient::Impl*>(ptr);
+  HANDLE events[3] = { impl->send_event_, impl->credit_event_, NULL };
+
+  // Packets taken from the send queue wait in the streams until they are written. With FLOW_CONTROL_HOLD they
+  // wait there for credits. Packets of overlapped sends are counted as queued until their send completes.
+  while (true)
+  {
+    int event_count = 2;
+    if (impl->overlapped_send_count_ > 0)
+    {
+      events[event_count++] = impl->overlapped_sends_[impl->first_overlapped_send_].overlapped.hEvent;
+    }
+    WaitForMultipleObjects(event_count, events, FALSE, INFINITE);
+
+    while (impl->CompleteOverlappedSend(false))
+    {
+    }
+
+    impl->QueuePackets();
+
+    for (int priority = 0; priority < PIXEL_PRINTF_PRIORITY_COUNT; ++priority)
+    {
+      impl->send_streams_[priority].held = false;
+    }
+
+    SendStream* stream = NULL;
+    while ((stream = impl->NextStream()) != NULL)
+    {
+      SendPacket* packet = stream->head;
+
+      bool send = true;
+      // Built for a viewer of a previous connection.
+      if ((packet->write_offset == 0) && (packet->protocol_version > impl->viewer_protocol_version_))
+      {
+        InterlockedIncrement(&impl->dropped_images_);
+        send = false;
+      }
+      else if ((packet->write_offset == 0) && impl->Connected() && !impl->TakeCredits(packet))
+      {
+        // Held packets are dropped when the client shuts down. Only the newest held image of a name is kept, so
+        // the held packets stay bounded by the names in use. If the head was replaced, what follows may go now.
+        if ((impl->flow_control_ == PicoPixelClient::FLOW_CONTROL_HOLD) && !impl->sender_exit_)
+        {
+          impl->ReplaceHeldImages(*stream);
+          stream->held = (stream->head == packet);
+          continue;
+        }
+
+        InterlockedIncrement(&impl->dropped_images_);
+        send = false;
+      }
+
+      if (!send || impl->WriteNext(packet, *stream))
+      {
+        stream->head = packet->next;
+        if (stream->head == NULL)
+          stream->tail = NULL;
+
+        if (!packet->in_flight)
+        {
+          impl->RetirePacket(packet);
+        }
+      }
+
+      // Packets queued in the meantime may go before the rest of a chunked package.
+      impl->QueuePackets();
+    }
+    if (impl->sender_exit_ && (impl->queued_packets_ == 0))
+      break;
+  }
+  return 0;
+}
+
+void PicoPixelClient::Impl::SetImagePriority(const std::string& image_name, PicoPixelClient::ImagePriority priority)
+{
+  EnterCriticalSection(&priorities_lock_);
+  if (priority == PicoPixelClient::IMAGE_PRIORITY_NORMAL)
+  {
+    image_priorities_.erase(image_name);
+  }
+  else
+  {
+    image_priorities_[image_name] = priority;
+  }
+  InterlockedExchange(&prioritized_images_, (LONG)image_priorities_.size());
+  LeaveCriticalSection(&priorities_lock_);
+}
+
+int PicoPixelClient::Impl::FindImagePriority(const std::string& image_name)
+{
+  if (prioritized_images_ == 0)
+    return PicoPixelClient::IMAGE_PRIORITY_NORMAL;
+
+  int priority = PicoPixelClient::IMAGE_PRIORITY_NORMAL;
+  EnterCriticalSection(&priorities_lock_);
+  std::map<std::string, PicoPixelClient::ImagePriority>::const_iterator it = image_priorities_.find(image_name);
+  if (it != image_priorities_.end())
+  {
+    priority = it->second;
+  }
+  LeaveCriticalSection(&priorities_lock_);
+  return priority;
+}
+
+void PicoPixelClient::Impl::RecordFlight(const std::string& image_name,
+                                        PicoPixelClient::PixelFormat pixel_format,
+                                        int width,
+                                        int height,
+                                        int pitch,
+                                        BOOL srgb,
+                                        BOOL upside_down,
+                                        const char* data,
+                                        int pixel_stride,
+                                        int channel)
+{
+  if (!flight_recording_ || (width <= 0) || (height <= 0) || (pitch <= 0) || (data == NULL))
+    return;
+
+  PixelLayout layout;
+  if (!DescribePixelLayout(pixel_format, pixel_stride, channel, layout))
+    return;
+
+  // Rows are stored tightly packed.
+  int bytes_per_pixel = layout.bytes_per_pixel;
+  int row_size = (bytes_per_pixel > 0) && (width * bytes_per_pixel <= pitch) ? width * bytes_per_pixel : pitch;
+  if (layout.gather)
+  {
+    row_size = width * layout.element_size;
+  }
+
+  PixelInfoHeader header;
+  header.width = width;
+  header.height = height;
+  header.pixel_format = layout.sent_format;
+  header.pitch = row_size;
+  header.srgb = srgb;
+  header.upside_down = upside_down;
+
+  EnterCriticalSection(&flight_recorder_lock_);
+  std::map<std::string, int>::const_iterator it = flight_recorder_.name_indices.find(image_name);
+  char* rows = NULL;
+  if (it != flight_recorder_.name_indices.end())
+  {
+    rows = flight_recorder_.Allocate(header, frame_, it->second);
+  }
+
+  if (rows != NULL)
+  {
+    int row_count = PixelInfoRowCount(pixel_format, height);
+    for (int y = 0; y < row_count; ++y)
+    {
+      if (layout.gather)
+      {
+        GatherRow(rows + (size_t)y * row_size, data + (size_t)y * pitch, width, layout);
+      }
+      else
+      {
+        std::memcpy(rows + (size_t)y * row_size, data + (size_t)y * pitch, row_size);
+      }
+    }
+  }
+  LeaveCriticalSection(&flight_recorder_lock_);
+}
+
+bool PicoPixelClient::Impl::AppendFlightRecord(SendPacket* packet, const FlightRecorder::Record& record)
+{
+  char frame[32];
+#if WIN32
+  sprintf_s(frame, sizeof(frame), " [frame %d]", record.frame);
+#else
+  snprintf(frame, sizeof(frame), " [frame %d]", record.frame);
+#endif
+
+  return packet->Append(&record.header, PixelInfoHeaderSize(record.header.picoversion)) &&
+         packet->AppendString(flight_recorder_.names[record.name_index] + frame) &&
+         packet->Append(flight_recorder_.ring + record.offset, FlightRecorder::RecordSize(record));
+}
+
+bool PicoPixelClient::Impl::DumpFlightRecorder(int frame_count, HANDLE file)
+{
+  if ((file == NULL) && !ReadyToSend())
+    return false;
+
+  bool success = true;
+  int dumped = 0;
+  EnterCriticalSection(&flight_recorder_lock_);
+  flight_recorder_.EvictFrames(frame_);
+  for (int i = 0; success && (i < flight_recorder_.record_count); ++i)
+  {
+    const FlightRecorder::Record& record = flight_recorder_.RecordAt(i);
+    if ((frame_count > 0) && (record.frame <= frame_ - frame_count))
+      continue;
+
+    SendPacket* packet = AcquirePacket();
+    success = (packet != NULL) && AppendFlightRecord(packet, record);
+    if (success && (file != NULL))
+    {
+      DWORD written = 0;
+      success = ::WriteFile(file, packet->data, (DWORD)packet->size, &written, NULL) && (written == (DWORD)packet->size);
+      ReleasePacket(packet);
+    }
+    else if (success)
+    {
+      packet->needs_credit = true;
+      success = SubmitPacket(packet);
+    }
+    else if (packet != NULL)
+    {
+      ReleasePacket(packet);
+    }
+    dumped += success ? 1 : 0;
+  }
+  LeaveCriticalSection(&flight_recorder_lock_);
+  return success && (dumped > 0);
+}
+
+void PicoPixelClient::Impl::ReceiveFlightRecorderDump(bool& connection_closed)
+{
+  FlightRecorderDumpHeader payload_dump;
+  RecvRaw((char*)&payload_dump, sizeof(payload_dump), PIXEL_PRINTF_RECV_TIMEOUT, connection_closed);
+  if (!connection_closed)
+  {
+    DumpFlightRecorder(payload_dump.frame_count, NULL);
+  }
+}
+
+void PicoPixelClient::Impl::SetRegionOfInterest(const std::string& image_name, int x, int y, int width, int height)
+{
+  EnterCriticalSection(&regions_of_interest_lock_);
+  if (width <= 0 || height <= 0)
+  {
+    regions_of_interest_.erase(image_name);
+  }
+  else
+  {
+    RegionOfInterest& region = regions_of_interest_[image_name];
+    region.x = x;
+    region.y = y;
+    region.width = width;
+    region.height = height;
+  }
+  LeaveCriticalSection(&regions_of_interest_lock_);
+}
+
+bool PicoPixelClient::Impl::FindRegionOfInterest(const std::string& image_name, RegionOfInterest& region)
+{
+  bool found = false;
+  EnterCriticalSection(&regions_of_interest_lock_);
+  if (!regions_of_interest_.empty())
+  {
+    std::map<std::string, RegionOfInterest>::const_iterator it = regions_of_interest_.find(image_name);
+    if (it != regions_of_interest_.end())
+    {
+      region = it->second;
+      found = true;
+    }
+  }
+  LeaveCriticalSection(&regions_of_interest_lock_);
+  return found;
+}
+
+void PicoPixelClient::Impl::ReceiveRegionOfInterest(bool& connection_closed)
+{
+  RegionOfInterestHeader payload_region;
+  RecvRaw((char*)&payload_region, sizeof(payload_region), PIXEL_PRINTF_RECV_TIMEOUT, connection_closed);
+
+  int name_size = 0;
+  if (RecvInteger(&name_size, 1) <= 0 || name_size <= 0 || name_size > PIXEL_PRINTF_MAX_NAME_SIZE)
+  {
+    FlushRecvBuffer();
+    return;
+  }
+
+  char name[PIXEL_PRINTF_MAX_NAME_SIZE];
+  if (RecvString(name, name_size) <= 0)
+  {
+    FlushRecvBuffer();
+    return;
+  }
+  name[name_size - 1] = 0;
+
+  SetRegionOfInterest(std::string(name), payload_region.x, payload_region.y, payload_region.width, payload_region.height);
+}
+
+std::string PicoPixelClient::Impl::UnnamedImageName()
+{
+  char name[64];
+  long index = (long)InterlockedIncrement(&image_name_index_) - 1;
+#if WIN32
+  sprintf_s(name, sizeof(name), "%s%ld", PIXEL_PRINTF_CLIENT_FILE_NAME, index);
+#else
+  snprintf(name, sizeof(name), "%s%ld", PIXEL_PRINTF_CLIENT_FILE_NAME, index);
+#endif
+  return std::string(name);
+}
+
+bool PicoPixelClient::Impl::AppendTiming(SendPacket* packet, UINT64 capture_time)
+{
+  // The header is the first thing in the packet. Its sender set the flag.
+  const PixelInfoHeader* header = (const PixelInfoHeader*)packet->data;
+  if ((header->picoversion < 2) || !(header->extensions & PIXEL_INFO_EXTENSION_TIMING))
+    return true;
+
+  PixelTimingExtension timing;
+  timing.sequence = (UINT64)InterlockedIncrement64(&image_sequence_);
+  timing.capture_time_us = capture_time;
+  timing.frame = (int)frame_;
+  if (!packet->Append(&timing, sizeof(PixelTimingExtension)))
+    return false;
+
+  packet->trace_sequence = timing.sequence;
+  packet->trace_capture_time = capture_time;
+  return true;
+}
+
+void PicoPixelClient::Impl::ExpectImageAck(const SendPacket* packet)
+{
+  EnterCriticalSection(&latency_lock_);
+  // Pico Pixel may not acknowledge images. Forget the oldest ones.
+  if (pending_acks_.size() >= (size_t)PIXEL_PRINTF_MAX_PENDING_ACKS)
+  {
+    pending_acks_.erase(pending_acks_.begin());
+  }
+
+  PendingAck& pending = pending_acks_[packet->trace_sequence];
+  pending.image_name = packet->image_name;
+  pending.capture_time = packet->trace_capture_time;
+  LeaveCriticalSection(&latency_lock_);
+}
+
+void PicoPixelClient::Impl::RecordSendLatency(const SendPacket* packet, UINT64 send_begin, UINT64 send_end)
+{
+  EnterCriticalSection(&latency_lock_);
+  ImageLatencyHistograms& latency = image_latencies_[packet->image_name];
+  latency.queueing.Add(send_begin - packet->trace_capture_time);
+  latency.transfer.Add(send_end - send_begin);
+  LeaveCriticalSection(&latency_lock_);
+}
+
+void PicoPixelClient::Impl::ReceiveImageAck(bool& connection_closed)
+{
+  ImageAckHeader payload_ack;
+  RecvRaw((char*)&payload_ack, sizeof(payload_ack), PIXEL_PRINTF_RECV_TIMEOUT, connection_closed);
+
+  UINT64 now = MonotonicMicroseconds();
+  EnterCriticalSection(&latency_lock_);
+  std::map<UINT64, PendingAck>::iterator it = pending_acks_.find(payload_ack.sequence);
+  if (it != pending_acks_.end())
+  {
+    image_latencies_[it->second.image_name].round_trip.Add(now - it->second.capture_time);
+    pending_acks_.erase(it);
+  }
+  LeaveCriticalSection(&latency_lock_);
+}
+
+static bool SetSendBufferSize(SOCKET socket, int send_buffer_size)
+{
+  return setsockopt(socket, SOL_SOCKET, SO_SNDBUF, (const char*)&send_buffer_size, sizeof(send_buffer_size)) == 0;
+}
+
+void PicoPixelClient::Impl::TuneSocket(SOCKET socket)
+{
+  // Packages are written in one piece, Nagle's algorithm would only hold back the tail of each of them.
+  BOOL no_delay = TRUE;
+  bool no_delay_set = setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, (const char*)&no_delay, sizeof(no_delay)) == 0;
+
+  int send_buffer_size = 0;
+  int option_size = sizeof(send_buffer_size);
+  getsockopt(socket, SOL_SOCKET, SO_SNDBUF, (char*)&send_buffer_size, &option_size);
+
+  if ((zero_copy_max_bytes_ > 0) && SetSendBufferSize(socket, 0))
+  {
+    send_buffer_size = 0;
+  }
+
+  EnterCriticalSection(&transport_lock_);
+  no_delay_ = no_delay_set;
+  send_buffer_size_ = send_buffer_size;
+  throughput_ = 0.0;
+  rtt_us_ = 0;
+  ideal_backlog_ = 0;
+  last_tune_time_ = GetTickCount64();
+  acked_bytes_ = 0;
+  acked_time_us_ = 0;
+  LeaveCriticalSection(&transport_lock_);
+}
+
+void PicoPixelClient::Impl::MeasureWrite(UINT64 byte_count)
+{
+  // A write returns once its bytes are copied to the socket buffer, which says nothing of the link's speed. The
+  // throughput is measured from what TCP has delivered, while images are being sent.
+  if (byte_count < (UINT64)PIXEL_PRINTF_TUNE_MIN_WRITE)
+    return;
+
+  EnterCriticalSection(&transport_lock_);
+  bool tune = GetTickCount64() - last_tune_time_ >= (ULONGLONG)PIXEL_PRINTF_TUNE_INTERVAL;
+  LeaveCriticalSection(&transport_lock_);
+
+  if (tune)
+  {
+    AdjustSendBuffer();
+  }
+}
+
+// Sizes the send buffer to hold what the connection can have in flight: the larger of the backlog TCP recommends
+// and the measured bandwidth-delay product.
+void PicoPixelClient::Impl::AdjustSendBuffer()
+{
+  SOCKET socket = sock_;
+  if ((socket == INVALID_SOCKET) || (zero_copy_max_bytes_ > 0))
+    return;
+
+  DWORD bytes_returned = 0;
+  UINT64 rtt_us = 0;
+  UINT64 acked_bytes = 0;
+  UINT64 now_us = MonotonicMicroseconds();
+  TCP_INFO_v0 tcp_info;
+  DWORD tcp_info_version = 0;
+  // SIO_TCP_INFO needs Windows 10 1703. Without it the RTT and the throughput stay unknown.
+  if (WSAIoctl(socket, SIO_TCP_INFO, &tcp_info_version, sizeof(tcp_info_version), &tcp_info, sizeof(tcp_info), &bytes_returned, NULL, NULL) == 0)
+  {
+    rtt_us = tcp_info.RttUs;
+    // Bytes acknowledged by the viewer: sent once, not retransmitted, no longer in flight.
+    UINT64 unacked = (UINT64)tcp_info.BytesRetrans + tcp_info.BytesInFlight;
+    acked_bytes = tcp_info.BytesOut > unacked ? tcp_info.BytesOut - unacked : 0;
+  }
+
+  ULONG ideal_backlog = 0;
+  if (WSAIoctl(socket, SIO_IDEAL_SEND_BACKLOG_QUERY, NULL, 0, &ideal_backlog, sizeof(ideal_backlog), &bytes_returned, NULL, NULL) != 0)
+  {
+    ideal_backlog = 0;
+  }
+
+  EnterCriticalSection(&transport_lock_);
+  last_tune_time_ = GetTickCount64();
+  rtt_us_ = rtt_us;
+  ideal_backlog_ = ideal_backlog;
+
+  // Averaged over the time since the last measurement, so pauses between images lower it.
+  if ((acked_bytes > 0) && (acked_time_us_ != 0) && (now_us > acked_time_us_) && (acked_bytes > acked_bytes_))
+  {
+    double throughput = (double)(acked_bytes - acked_bytes_) * 1000000.0 / (double)(now_us - acked_time_us_);
+    throughput_ = (throughput_ == 0.0) ? throughput : 0.75 * throughput_ + 0.25 * throughput;
+  }
+  if (acked_bytes > 0)
+  {
+    acked_bytes_ = acked_bytes;
+    acked_time_us_ = now_us;
+  }
+
+  double bandwidth_delay = throughput_ * (double)rtt_us / 1000000.0;
+  double target = bandwidth_delay * 2.0 > (double)ideal_backlog ? bandwidth_delay * 2.0 : (double)ideal_backlog;
+  target = target < PIXEL_PRINTF_MIN_SEND_BUFFER ? PIXEL_PRINTF_MIN_SEND_BUFFER : target;
+  target = target > PIXEL_PRINTF_MAX_SEND_BUFFER ? PIXEL_PRINTF_MAX_SEND_BUFFER : target;
+  int send_buffer_size = (int)target;
+
+  // Only follow significant changes.
+  int current = send_buffer_size_;
+  bool change = (send_buffer_size > current + current / 4) || (send_buffer_size < current - current / 4);
+  LeaveCriticalSection(&transport_lock_);
+
+  if (!change || (rtt_us == 0 && ideal_backlog == 0))
+    return;
+
+  if (SetSendBufferSize(socket, send_buffer_size))
+  {
+    EnterCriticalSection(&transport_lock_);
+    send_buffer_size_ = send_buffer_size;
+    LeaveCriticalSection(&transport_lock_);
+  }
+}
+
+bool PicoPixelClient::Impl::Resolve(const std::string& host_ip, int port, std::vector<struct sockaddr_in>& addresses)
+{
+  int const host_port_size = 32;
+  char host_port[host_port_size] = {0};
+
+#if WIN32
+  int err = sprintf_s(host_port, host_port_size-1, "%d", port);
+  if (err < 0)
+    return false;
+#else
+  int err = snprintf(host_port, host_port_size-1, "%d", port);
+  if (err < 0)
+    return false;
+#endif
+
+  // Reconnections and lazy connections resolve the same host again. Keep the answer.
+  std::string key = host_ip + ":" + host_port;
+  EnterCriticalSection(&address_lock_);
+  std::map<std::string, std::vector<struct sockaddr_in> >::const_iterator it = resolved_addresses_.find(key);
+  bool cached = it != resolved_addresses_.end();
+  if (cached)
+  {
+    addresses = it->second;
+  }
+  LeaveCriticalSection(&address_lock_);
+
+  if (cached)
+    return true;
+
+  struct addrinfo ai_hints;
+  struct addrinfo* ai_list = NULL;
+
+  ::memset(&ai_hints, 0, sizeof(ai_hints));
+  ai_hints.ai_family = PF_INET;
+  ai_hints.ai_socktype = SOCK_STREAM;
+  ai_hints.ai_protocol = IPPROTO_TCP;
+
+  int ret = getaddrinfo(host_ip.c_str(), host_port, &ai_hints, &ai_list);
+  if (ret)
+  {
+    printf("[LocalIPString] 'getaddrinfo' error: %d.\n", ret);
+    return false;
+  }
+
+  // A host may resolve to several addresses, not all of them reachable. Connect() tries them in order.
+  addresses.clear();
+  for (struct addrinfo* ai = ai_list; ai != NULL; ai = ai->ai_next)
+  {
+    addresses.push_back(*(struct sockaddr_in*)ai->ai_addr);
+  }
+  freeaddrinfo(ai_list);
+
+  EnterCriticalSection(&address_lock_);
+  resolved_addresses_[key] = addresses;
+  LeaveCriticalSection(&address_lock_);
+  return true;
+}
+
+bool PicoPixelClient::Impl::Connect(const std::vector<struct sockaddr_in>& addresses, int port)
+{
+  // The socket is published in sock_ after the hand shake so that the sender thread cannot write before it.
+  SOCKET sock = INVALID_SOCKET;
+  size_t address_index = 0;
+  for (; address_index < addresses.size(); ++address_index)
+  {
+    sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (sock == INVALID_SOCKET)
+    {
+      int error_code = WSAGetLastError();
+      printf("[PixelPrintF] Failed to create network socket. Error code: %d.\n", error_code);
+      return false;
+    }
+
+    const struct sockaddr_in& address = addresses[address_index];
+    if (connect(sock, (const struct sockaddr*)&address, sizeof(address)) != -1)
+      break;
+
+    closesocket(sock);
+    sock = INVALID_SOCKET;
+  }
+
+  if (sock == INVALID_SOCKET)
+  {
+    if (trying_to_reconnect_to_pico_pixel_ == false)
+    {
+      printf("[PicoPixelClient::PicoPixelClient] Connection failed.\n");
+      printf("[PicoPixelClient::PicoPixelClient] You need to launch Pico Pixel desktop application before running this program.\n");
+    }
+    else
+    {
+      printf("[PicoPixelClient::PicoPixelClient] Attempting reconnection to Pico Pixel.\n");
+    }
+    return false;
+  }
+
+  const struct sockaddr_in& address = addresses[address_index];
+  int const host_name_size = 512;
+  char host_name[host_name_size] = {0};
+  sprintf_s(host_name, host_name_size, "%u.%u.%u.%u",
+    (UINT)(address.sin_addr.S_un.S_un_b.s_b1),
+    (UINT)(address.sin_addr.S_un.S_un_b.s_b2),
+    (UINT)(address.sin_addr.S_un.S_un_b.s_b3),
+    (UINT)(address.sin_addr.S_un.S_un_b.s_b4));
+
+  picopixel_server_ip_ = host_name;
+  host_ip_ = host_name;
+  port_ = port;
+  relay_path_.clear();
+  return Attach(sock);
+}
+
+bool PicoPixelClient::Impl::ConnectToRelay(const std::string& path)
+{
+  struct sockaddr_un address;
+  std::memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(address.sun_path))
+    return false;
+  std::memcpy(address.sun_path, path.c_str(), path.size());
+
+  SOCKET sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sock == INVALID_SOCKET)
+  {
+    printf("[PixelPrintF] Failed to create Unix domain socket. Error code: %d.\n", WSAGetLastError());
+    return false;
+  }
+
+  if (connect(sock, (const struct sockaddr*)&address, sizeof(address)) == -1)
+  {
+    closesocket(sock);
+    if (trying_to_reconnect_to_pico_pixel_ == false)
+    {
+      printf("[PicoPixelClient::PicoPixelClient] Connection to the relay at %s failed.\n", path.c_str());
+    }
+    return false;
+  }
+
+  relay_path_ = path;
+  return Attach(sock);
+}
+
+bool PicoPixelClient::Impl::Attach(SOCKET sock)
+{
+  TuneSocket(sock);
+  HandShake(sock, client_id_);
+  sock_ = sock;
+
+  StartSender();
+
+  // A receiver thread that ended with a lost connection is replaced.
+  if ((trying_to_reconnect_to_pico_pixel_ == false) && (receiver_thread_ != NULL) &&
+      (WaitForSingleObject(receiver_thread_, 0) == WAIT_OBJECT_0))
+  {
+    ::CloseHandle(receiver_thread_);
+    receiver_thread_ = NULL;
+  }
+
+  if ((trying_to_reconnect_to_pico_pixel_ == false) && (receiver_thread_ == NULL))
+  {
+    receiver_thread_ = ::CreateThread(NULL,
+      0,
+      PicoPixelClient::Impl::ReceiverThread,
+      parent_,
+      CREATE_SUSPENDED,
+      &thread_id_);
+
+    if (receiver_thread_ != NULL)
+    {
+      ResumeThread(receiver_thread_);
+    }
+  }
+
+  return true;
+}
+
+bool PicoPixelClient::Impl::StartConnector()
+{
+  connect_request_event_ = ::CreateEvent(NULL, FALSE, FALSE, NULL);
+  connector_exit_ = false;
+  lazy_connecting_ = 0;
+  last_connect_failure_ = 0;
+
+  // Images are queued once the connection is made. Until then they are dropped before being copied.
+  StartSender();
+
+  connector_thread_ = ::CreateThread(NULL, 0, PicoPixelClient::Impl::ConnectorThread, this, 0, NULL);
+  if (connector_thread_ == NULL)
+  {
+    printf("[PicoPixelClient::Impl::StartConnector] Failed to create connector thread.\n");
+    ::CloseHandle(connect_request_event_);
+    connect_request_event_ = NULL;
+    return false;
+  }
+
+  lazy_connection_ = true;
+  return true;
+}
+
+// Safe to call again once stopped, as EndConnection and then the Impl destructor do.
+void PicoPixelClient::Impl::StopConnector()
+{
+  if (connector_thread_ == NULL)
+    return;
+
+  lazy_connection_ = false;
+  connector_exit_ = true;
+  SetEvent(connect_request_event_);
+  WaitForSingleObject(connector_thread_, INFINITE);
+
+  ::CloseHandle(connector_thread_);
+  ::CloseHandle(connect_request_event_);
+  connector_thread_ = NULL;
+  connect_request_event_ = NULL;
+}
+
+bool PicoPixelClient::Impl::ReadyToSend()
+{
+  if (Connected())
+    return true;
+
+  if (!lazy_connection_)
+    return false;
+
+  // The first caller asks for the connection. Images sent until it is made are dropped, not copied and queued.
+  if (InterlockedCompareExchange(&lazy_connecting_, 1, 0) == 0)
+  {
+    if (GetTickCount64() - last_connect_failure_ < (ULONGLONG)PIXEL_PRINTF_LAZY_RETRY_INTERVAL)
+    {
+      InterlockedExchange(&lazy_connecting_, 0);
+      return false;
+    }
+
+    SetEvent(connect_request_event_);
+  }
+  return false;
+}
+
+DWORD PicoPixelClient::Impl::ConnectorThread(void* ptr)
+{
+  PicoPixelClient::Impl* impl = static_cast<PicoPixelClient::Impl*>(ptr);
+
+#if WIN32
+  WSADATA wsaData;
+  int err = WSAStartup( MAKEWORD( 2, 2 ), &wsaData );
+  if (err != 0)
+  {
+    printf("[PicoPixelClient::Impl::ConnectorThread] WSAStartup has failed: %d\n", err);
+  }
+#endif
+
+  // Resolve now, off the program's startup path. Connect() only uses the cached addresses.
+  std::vector<struct sockaddr_in> addresses;
+  bool resolved = impl->Resolve(impl->lazy_host_ip_, impl->lazy_port_, addresses);
+
+  while (true)
+  {
+    WaitForSingleObject(impl->connect_request_event_, INFINITE);
+    if (impl->connector_exit_)
+      break;
+
+    if (!resolved)
+    {
+      resolved = impl->Resolve(impl->lazy_host_ip_, impl->lazy_port_, addresses);
+    }
+
+    bool connected = impl->Connected() || (resolved && impl->Connect(addresses, impl->lazy_port_));
+    if (connected)
+    {
+      impl->parent_->SendMarkersToPicoPixel();
+    }
+    else
+    {
+      impl->last_connect_failure_ = GetTickCount64();
+    }
+
+    InterlockedExchange(&impl->lazy_connecting_, 0);
+  }
+
+  InterlockedExchange(&impl->lazy_connecting_, 0);
+
+  // The connection was not used.
+  if (!impl->Connected())
+  {
+#if WIN32
+    WSACleanup();
+#endif
+  }
+  return 0;
+}
+
+PicoPixelClient::PicoPixelClient(std::string client_id)
+  : impl_(new Impl(this))
+{
+  impl_->client_id_ = client_id;
+}
+
+PicoPixelClient::~PicoPixelClient()
+{
+  // Also stops a receiver thread trying to reconnect. The Impl destructor stops the remaining threads.
+  EndConnection();
+  impl_->StopSender();
+  delete impl_;
+}
+
+bool PicoPixelClient::StartConnection()
+{
+  // Will attempt to connect to local port.
+  return StartConnectionToHost(std::string(""), PICO_PIXEL_SERVER_PORT);
+}
+
+bool PicoPixelClient::StartConnectionToHost(std::string host_ip, int port)
+{
+  // The receiver thread reconnecting must not undo an EndConnection.
+  if (!impl_->trying_to_reconnect_to_pico_pixel_)
+  {
+    impl_->client_side_connection_termination_ = false;
+  }
+
+  if (Connected())
+  {
+    return true;
+  }
+
+  if (port <= 1024)
+  {
+    // Reserved ports on Windows
+    return false;
+  }
+
+#if WIN32
+  WSADATA wsaData;
+  int err = WSAStartup( MAKEWORD( 2, 2 ), &wsaData );
+  if (err != 0)
+  {
+    printf("[PicoPixelClient::PicoPixelClient] WSAStartup has failed: %d\n", err);
+    return false;
+  }
+#endif
+
+  std::vector<struct sockaddr_in> addresses;
+  if (!impl_->Resolve(host_ip, port, addresses))
+    return false;
+
+  return impl_->Connect(addresses, port);
+}
+
+bool PicoPixelClient::StartConnectionToRelay(const std::string& path)
+{
+  // The receiver thread reconnecting must not undo an EndConnection.
+  if (!impl_->trying_to_reconnect_to_pico_pixel_)
+  {
+    impl_->client_side_connection_termination_ = false;
+  }
+
+  if (Connected())
+  {
+    return true;
+  }
+
+  WSADATA wsaData;
+  int err = WSAStartup( MAKEWORD( 2, 2 ), &wsaData );
+  if (err != 0)
+  {
+    printf("[PicoPixelClient::PicoPixelClient] WSAStartup has failed: %d\n", err);
+    return false;
+  }
+
+  return impl_->ConnectToRelay(path);
+}
+
+bool PicoPixelClient::StartLazyConnection()
+{
+  return StartLazyConnectionToHost(std::string(""), PICO_PIXEL_SERVER_PORT);
+}
+
+bool PicoPixelClient::StartLazyConnectionToHost(std::string host_ip, int port)
+{
+  impl_->client_side_connection_termination_ = false;
+
+  if (Connected() || impl_->lazy_connection_)
+    return true;
+
+  if (port <= 1024)
+    return false;
+
+  impl_->lazy_host_ip_ = host_ip;
+  impl_->lazy_port_ = port;
+  return impl_->StartConnector();
+}
+
+bool PicoPixelClient::Active()
+{
+  return Connected() || impl_->lazy_connection_;
+}
+
+void PicoPixelClient::EnableHalfFloatPacking()
+{
+  impl_->half_float_packing_ = true;
+}
+
+void PicoPixelClient::DisableHalfFloatPacking()
+{
+  impl_->half_float_packing_ = false;
+}
+
+void PicoPixelClient::EnableBlockCompression(PixelFormat block_format)
+{
+  if (BlockSize(block_format) == 0)
+  {
+    printf("[PicoPixelClient::EnableBlockCompression] Not a block compressed format.\n");
+    return;
+  }
+
+  impl_->block_compression_ = block_format;
+}
+
+void PicoPixelClient::DisableBlockCompression()
+{
+  impl_->block_compression_ = PIXEL_FORMAT_UNKNOWN;
+}
+
+void PicoPixelClient::EnableZeroCopySend(unsigned int max_bytes_in_flight)
+{
+  if (max_bytes_in_flight < (unsigned int)PIXEL_PRINTF_ZERO_COPY_MIN_SIZE)
+  {
+    max_bytes_in_flight = PIXEL_PRINTF_ZERO_COPY_MIN_SIZE;
+  }
+
+  InterlockedExchange64(&impl_->zero_copy_max_bytes_, max_bytes_in_flight);
+  if (Connected() && SetSendBufferSize(impl_->sock_, 0))
+  {
+    EnterCriticalSection(&impl_->transport_lock_);
+    impl_->send_buffer_size_ = 0;
+    LeaveCriticalSection(&impl_->transport_lock_);
+  }
+}
+
+void PicoPixelClient::DisableZeroCopySend()
+{
+  InterlockedExchange64(&impl_->zero_copy_max_bytes_, 0);
+
+  // The send buffer grows back as throughput is measured.
+  if (Connected() && SetSendBufferSize(impl_->sock_, PIXEL_PRINTF_MIN_SEND_BUFFER))
+  {
+    EnterCriticalSection(&impl_->transport_lock_);
+    impl_->send_buffer_size_ = PIXEL_PRINTF_MIN_SEND_BUFFER;
+    LeaveCriticalSection(&impl_->transport_lock_);
+  }
+}
+
+bool PicoPixelClient::SetAllocator(const Allocator& allocator)
+{
+  if ((allocator.allocate == NULL) || (allocator.deallocate == NULL))
+    return false;
+
+  BufferPool& pool = impl_->buffer_pool_;
+  EnterCriticalSection(&pool.lock);
+  bool unused = pool.allocated == 0;
+  if (unused)
+  {
+    pool.allocator = allocator;
+  }
+  LeaveCriticalSection(&pool.lock);
+
+  if (!unused)
+  {
+    printf("[PicoPixelClient::SetAllocator] Buffers are already allocated.\n");
+  }
+  return unused;
+}
+
+void PicoPixelClient::SetMemoryBudget(UINT64 max_bytes)
+{
+  BufferPool& pool = impl_->buffer_pool_;
+  EnterCriticalSection(&pool.lock);
+  pool.budget = max_bytes;
+  if ((max_bytes > 0) && (pool.allocated > max_bytes))
+  {
+    pool.FreeKept(pool.allocated - max_bytes);
+  }
+  LeaveCriticalSection(&pool.lock);
+}
+
+void PicoPixelClient::QueryMemoryStatistics(MemoryStatistics& statistics)
+{
+  BufferPool& pool = impl_->buffer_pool_;
+  EnterCriticalSection(&pool.lock);
+  statistics.budget = pool.budget;
+  statistics.allocated = pool.allocated;
+  statistics.in_use = pool.in_use;
+  statistics.peak_allocated = pool.peak_allocated;
+  statistics.allocation_count = pool.allocation_count;
+  statistics.failed_allocations = pool.failed_allocations;
+  LeaveCriticalSection(&pool.lock);
+}
+
+void PicoPixelClient::SetFlowControl(FlowControl flow_control, int max_images_in_flight, unsigned int max_bytes_in_flight)
+{
+  impl_->flow_control_ = flow_control;
+  impl_->flow_control_max_images_ = max_images_in_flight > 0 ? max_images_in_flight : 0;
+  impl_->flow_control_max_bytes_ = max_bytes_in_flight;
+}
+
+void PicoPixelClient::SetSendQueueLimit(UINT64 max_bytes)
+{
+  InterlockedExchange64(&impl_->max_queued_bytes_, (LONGLONG)max_bytes);
+}
+
+unsigned int PicoPixelClient::DroppedImageCount()
+{
+  return (unsigned int)impl_->dropped_images_;
+}
+
+bool PicoPixelClient::QueryTransportSettings(TransportSettings& settings)
+{
+  if (!Connected())
+    return false;
+
+  EnterCriticalSection(&impl_->transport_lock_);
+  settings.no_delay = impl_->no_delay_;
+  settings.zero_copy = impl_->zero_copy_max_bytes_ > 0;
+  settings.send_buffer_size = (unsigned int)impl_->send_buffer_size_;
+  settings.throughput_mbps = impl_->throughput_ * 8.0 / 1000000.0;
+  settings.rtt_ms = impl_->rtt_us_ / 1000.0;
+  settings.ideal_backlog = (unsigned int)impl_->ideal_backlog_;
+  LeaveCriticalSection(&impl_->transport_lock_);
+  return true;
+}
+
+void PicoPixelClient::EnableAutoReconnectOnPicoPixelShutdown()
+{
+  impl_->auto_reconnect_on_picopixel_shutdown_ = true;
+}
+
+void PicoPixelClient::DisableAutoReconnectOnPicoPixelShutdown()
+{
+  impl_->auto_reconnect_on_picopixel_shutdown_ = false;
+}
+
+void PicoPixelClient::EndConnection()
+{
+  // Let the sender thread deliver what has been queued so far.
+  impl_->Flush(PIXEL_PRINTF_FLUSH_TIMEOUT);
+  impl_->StopConnector();
+
+  impl_->client_side_connection_termination_ = true;
+  impl_->host_ip_.clear();
+  impl_->port_ = 0;
+
+  bool connected = impl_->sock_ != INVALID_SOCKET;
+  if (connected)
+  {
+    int res = shutdown(impl_->sock_, SD_BOTH);
+
+    if (res == SOCKET_ERROR)
+    {
+      printf("[PicoPixelClient::EndConnection] shutdown failed: %d\n", WSAGetLastError());
+    }
+
+    closesocket(impl_->sock_);
+    impl_->sock_ = INVALID_SOCKET;
+  }
+
+  // The receiver thread sees the closed socket within its receive timeout. It may have reconnected meanwhile.
+  impl_->StopReceiver();
+  if (impl_->sock_ != INVALID_SOCKET)
+  {
+    closesocket(impl_->sock_);
+    impl_->sock_ = INVALID_SOCKET;
+    connected = true;
+  }
+
+  // The next StartConnectionToHost must not reconnect to the relay when the connection is lost.
+  impl_->relay_path_.clear();
+
+#if WIN32
+  if (connected)
+  {
+    WSACleanup();
+  }
+#endif
+}
+
+bool PicoPixelClient::Connected()
+{
+  return impl_->sock_ != INVALID_SOCKET;
+}
+
+bool PicoPixelClient::Flush(unsigned int timeout_ms)
+{
+  return impl_->Flush(timeout_ms);
+}
+
+void PicoPixelClient::EnableLatencyTracing()
+{
+  impl_->latency_tracing_ = true;
+}
+
+void PicoPixelClient::DisableLatencyTracing()
+{
+  impl_->latency_tracing_ = false;
+}
+
+bool PicoPixelClient::ImageLatencyStatistics(const std::string& image_name, ImageLatency& latency)
+{
+  bool found = false;
+  EnterCriticalSection(&impl_->latency_lock_);
+  std::map<std::string, Impl::ImageLatencyHistograms>::const_iterator it = impl_->image_latencies_.find(image_name);
+  if (it != impl_->image_latencies_.end())
+  {
+    it->second.queueing.Statistics(latency.queueing);
+    it->second.transfer.Statistics(latency.transfer);
+    it->second.round_trip.Statistics(latency.round_trip);
+    found = true;
+  }
+  LeaveCriticalSection(&impl_->latency_lock_);
+  return found;
+}
+
+bool PicoPixelClient::StartFlightRecorder(int frame_count, unsigned int memory_size)
+{
+  if ((frame_count <= 0) || (memory_size == 0))
+    return false;
+
+  EnterCriticalSection(&impl_->flight_recorder_lock_);
+  bool started = impl_->flight_recorder_.Start(frame_count, memory_size, &impl_->buffer_pool_);
+  impl_->flight_recording_ = started && !impl_->flight_recorder_.names.empty();
+  LeaveCriticalSection(&impl_->flight_recorder_lock_);
+  return started;
+}
+
+void PicoPixelClient::StopFlightRecorder()
+{
+  EnterCriticalSection(&impl_->flight_recorder_lock_);
+  impl_->flight_recorder_.Stop();
+  impl_->flight_recording_ = false;
+  LeaveCriticalSection(&impl_->flight_recorder_lock_);
+}
+
+void PicoPixelClient::AddFlightRecorderImage(const std::string& image_name)
+{
+  EnterCriticalSection(&impl_->flight_recorder_lock_);
+  FlightRecorder& recorder = impl_->flight_recorder_;
+  if (recorder.name_indices.find(image_name) == recorder.name_indices.end())
+  {
+    recorder.name_indices[image_name] = (int)recorder.names.size();
+    recorder.names.push_back(image_name);
+  }
+  impl_->flight_recording_ = (recorder.ring != NULL);
+  LeaveCriticalSection(&impl_->flight_recorder_lock_);
+}
+
+void PicoPixelClient::RemoveFlightRecorderImage(const std::string& image_name)
+{
+  // The name stays in 'names' for the images already recorded.
+  EnterCriticalSection(&impl_->flight_recorder_lock_);
+  FlightRecorder& recorder = impl_->flight_recorder_;
+  recorder.name_indices.erase(image_name);
+  impl_->flight_recording_ = (recorder.ring != NULL) && !recorder.name_indices.empty();
+  LeaveCriticalSection(&impl_->flight_recorder_lock_);
+}
+
+bool PicoPixelClient::DumpFlightRecorder()
+{
+  return impl_->DumpFlightRecorder(0, NULL);
+}
+
+bool PicoPixelClient::DumpFlightRecorder(const std::string& path)
+{
+  HANDLE file = ::CreateFile(path.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+  if (file == INVALID_HANDLE_VALUE)
+  {
+    printf("[DumpFlightRecorder] Failed to create %s.\n", path.c_str());
+    return false;
+  }
+
+  bool success = impl_->DumpFlightRecorder(0, file);
+  ::CloseHandle(file);
+  return success;
+}
+
+void PicoPixelClient::ResetLatencyStatistics()
+{
+  EnterCriticalSection(&impl_->latency_lock_);
+  impl_->image_latencies_.clear();
+  impl_->pending_acks_.clear();
+  LeaveCriticalSection(&impl_->latency_lock_);
+}
+
+int PicoPixelClient::CreateMarker(std::string name, int use_count)
+{
+  return CreateMarker(name, use_count, PICO_PIXEL_MARKER_COLOR);
+}
+
+int PicoPixelClient::CreateMarker(std::string name, int use_count, unsigned int color)
+{
+  // markers_ may reallocate. The receiver thread and WaitForMarkerArmed use it under the lock.
+  EnterCriticalSection(&impl_->markers_lock_);
+  if (impl_->marker_names_.find(name) != impl_->marker_names_.end())
+  {
+    LeaveCriticalSection(&impl_->markers_lock_);
+    std::cout << "[PicoPixelClient::CreateMarker] There is already a marker with name " << name << std::endl;
+    return -1;
+  }
+
+  int index = (int)impl_->markers_.size();
+  Marker m(index, name, use_count, color);
+
+  // Arms of its groups made before do not apply to the marker.
+  size_t separator = name.rfind('/');
+  m.group_ = (separator == std::string::npos) ? -1 : impl_->AddMarkerGroup(name.substr(0, separator));
+  m.group_generation_ = impl_->marker_generation_;
+
+  impl_->markers_.push_back(m);
+  impl_->marker_names_[name] = index;
+  LeaveCriticalSection(&impl_->markers_lock_);
+  return index;
+}
+
+int PicoPixelClient::MarkerUseCount(int marker_index)
+{
+  int marker_count = (int) impl_->markers_.size();
+  if (marker_index < 0 || marker_index >= marker_count)
+  {
+    printf("[PicoPixelClient::MarkerUseCount] Invalid marker index.\n");
+    return -1;
+  }
+
+  impl_->SyncMarkerGroups(impl_->markers_[marker_index]);
+  return impl_->markers_[marker_index].use_count_;
+}
+
+
+void PicoPixelClient::ResetMarker(int index)
+{
+  if (index < 0)
+    return;
+
+  if (index >= (int)impl_->markers_.size())
+    return;
+
+  impl_->SetMarkerUseCount(impl_->markers_[index], 0);
+}
+
+void PicoPixelClient::ResetMarker(std::string name)
+{
+  if (name.empty())
+    return;
+
+  std::map<std::string, int>::iterator it = impl_->marker_names_.find(name);
+  if (it != impl_->marker_names_.end())
+  {
+    impl_->SetMarkerUseCount(impl_->markers_[it->second], 0);
+  }
+}
+
+int PicoPixelClient::FindMarkerGroup(const std::string& name)
+{
+  std::map<std::string, int>::iterator it = impl_->marker_group_names_.find(name);
+  return (it != impl_->marker_group_names_.end()) ? it->second : -1;
+}
+
+void PicoPixelClient::ArmMarkerGroup(int group_index, int use_count)
+{
+  impl_->ArmMarkerGroup(group_index, use_count);
+}
+
+void PicoPixelClient::ArmMarkerGroup(const std::string& name, int use_count)
+{
+  impl_->ArmMarkerGroup(FindMarkerGroup(name), use_count);
+}
+
+void PicoPixelClient::ResetMarkerGroup(int group_index)
+{
+  impl_->ArmMarkerGroup(group_index, 0);
+}
+
+void PicoPixelClient::ResetMarkerGroup(const std::string& name)
+{
+  impl_->ArmMarkerGroup(FindMarkerGroup(name), 0);
+}
+
+int PicoPixelClient::MarkerGroupUseCount(int group_index)
+{
+  if (group_index < 0 || group_index >= (int)impl_->marker_groups_.size())
+    return -1;
+
+  // The newest arm of the group and of its parents.
+  LONG newest_generation = 0;
+  int newest = -1;
+  for (int i = group_index; i >= 0; i = impl_->marker_groups_[i].parent)
+  {
+    LONG generation = impl_->marker_groups_[i].generation;
+    if (generation > newest_generation)
+    {
+      newest_generation = generation;
+      newest = i;
+    }
+  }
+
+  if (newest < 0)
+    return 0;
+
+  LONGLONG arm = InterlockedCompareExchange64(&impl_->marker_groups_[newest].arm, 0, 0);
+  return (int)(LONG)(arm & 0xffffffff);
+}
+
+void PicoPixelClient::SetRegionOfInterest(const std::string& image_name, int x, int y, int width, int height)
+{
+  impl_->SetRegionOfInterest(image_name, x, y, width, height);
+}
+
+void PicoPixelClient::ClearRegionOfInterest(const std::string& image_name)
+{
+  impl_->SetRegionOfInterest(image_name, 0, 0, 0, 0);
+}
+
+void PicoPixelClient::SetImagePriority(const std::string& image_name, ImagePriority priority)
+{
+  impl_->SetImagePriority(image_name, priority);
+}
+
+bool PicoPixelClient::TriggerMarker(int marker_index)
+{
+  return impl_->TriggerMarker(marker_index);
+}
+
+void PicoPixelClient::SetMarkerTrigger(int marker_index, const MarkerTrigger& trigger)
+{
+  if (marker_index < 0 || marker_index >= (int)impl_->markers_.size())
+    return;
+
+  Marker& marker = impl_->markers_[marker_index];
+  marker.ClearTrigger();
+  marker.trigger_every_nth_ = trigger.every_nth;
+  marker.trigger_min_interval_ms_ = trigger.min_interval_ms;
+  marker.trigger_first_frame_ = trigger.first_frame;
+  marker.trigger_last_frame_ = trigger.last_frame;
+  marker.trigger_one_shot_ = trigger.one_shot;
+  marker.trigger_ignore_use_count_ = trigger.ignore_use_count;
+  marker.trigger_condition_ = trigger.condition;
+  marker.trigger_condition_data_ = trigger.condition_data;
+  // The first use after the interval is set fires.
+  marker.trigger_last_time_ = (LONG)(GetTickCount() - trigger.min_interval_ms);
+}
+
+void PicoPixelClient::ClearMarkerTrigger(int marker_index)
+{
+  if (marker_index < 0 || marker_index >= (int)impl_->markers_.size())
+    return;
+
+  impl_->markers_[marker_index].ClearTrigger();
+}
+
+void PicoPixelClient::NextFrame()
+{
+  InterlockedIncrement(&impl_->frame_);
+}
+
+int PicoPixelClient::Frame()
+{
+  return (int)impl_->frame_;
+}
+
+bool PicoPixelClient::WaitForMarkerArmed(int marker_index, unsigned int timeout_ms)
+{
+  ULONGLONG start = GetTickCount64();
+  EnterCriticalSection(&impl_->markers_lock_);
+  if (marker_index < 0 || marker_index >= (int)impl_->markers_.size())
+  {
+    LeaveCriticalSection(&impl_->markers_lock_);
+    printf("[PicoPixelClient::WaitForMarkerArmed] Invalid marker index.\n");
+    return false;
+  }
+
+  impl_->SyncMarkerGroups(impl_->markers_[marker_index]);
+  bool armed = impl_->markers_[marker_index].use_count_ > 0;
+  while (!armed)
+  {
+    DWORD wait_ms = INFINITE;
+    if (timeout_ms != INFINITE)
+    {
+      ULONGLONG elapsed = GetTickCount64() - start;
+      if (elapsed >= timeout_ms)
+        break;
+      wait_ms = (DWORD)(timeout_ms - elapsed);
+    }
+
+    // Spurious wake ups and changes of other markers loop back here. Markers may have been created or deleted
+    // while the lock was released, so the marker is looked up again.
+    SleepConditionVariableCS(&impl_->markers_changed_, &impl_->markers_lock_, wait_ms);
+    if (marker_index >= (int)impl_->markers_.size())
+      break;
+
+    impl_->SyncMarkerGroups(impl_->markers_[marker_index]);
+    armed = impl_->markers_[marker_index].use_count_ > 0;
+  }
+  LeaveCriticalSection(&impl_->markers_lock_);
+  return armed;
+}
+
+int PicoPixelClient::AddMarkerChangedCallback(MarkerChangedCallback callback, void* callback_data)
+{
+  if (callback == NULL)
+    return -1;
+
+  Impl::MarkerCallback marker_callback;
+  marker_callback.callback = callback;
+  marker_callback.callback_data = callback_data;
+
+  EnterCriticalSection(&impl_->marker_callbacks_lock_);
+  int callback_id = (int)impl_->marker_callbacks_.size();
+  impl_->marker_callbacks_.push_back(marker_callback);
+  LeaveCriticalSection(&impl_->marker_callbacks_lock_);
+  return callback_id;
+}
+
+void PicoPixelClient::RemoveMarkerChangedCallback(int callback_id)
+{
+  EnterCriticalSection(&impl_->marker_callbacks_lock_);
+  if (callback_id >= 0 && callback_id < (int)impl_->marker_callbacks_.size())
   {
-    error_code = WSAGetLastError();
-    printf("[PixelPrintF] Failed to send data to Pico Pixel server.\n");
-    return false;
+    impl_->marker_callbacks_[callback_id].callback = NULL;
   }
-  return true;
+  LeaveCriticalSection(&impl_->marker_callbacks_lock_);
 }
 
-bool PicoPixelClient::Impl::SendString(const std::string& str)
+void PicoPixelClient::DeleteAllAddMarkers()
 {
-  int size = (int)str.size() + 1;           // +1 for null terminated string
-  bool ret = SendRaw((char*)&size, sizeof(int));   // send string size
-  if (ret == false) return false;
-  ret = SendRaw(str.c_str(), size);           // send null terminated string
-  if (ret == false) return false;
-  return true;
+  // Wakes a WaitForMarkerArmed on a marker that is gone.
+  EnterCriticalSection(&impl_->markers_lock_);
+  impl_->markers_.clear();
+  impl_->marker_names_.clear();
+  impl_->marker_groups_.clear();
+  impl_->marker_group_names_.clear();
+  WakeAllConditionVariable(&impl_->markers_changed_);
+  LeaveCriticalSection(&impl_->markers_lock_);
+  SendMarkersToPicoPixel();
 }
 
-bool PicoPixelClient::Impl::SendInteger(int integer)
+void PicoPixelClient::DeleteMarker(int index)
 {
-  return SendRaw((char*)&integer, sizeof(int));
+  if (index < 0)
+    return;
+
+  if (index >= (int)impl_->markers_.size())
+    return;
+
+  // A marker's index is its position.
+  impl_->markers_[index].index_ = -1;
 }
 
-void PicoPixelClient::Impl::FlushRecvBuffer()
+void PicoPixelClient::DeleteMarker(std::string name)
 {
-  char buffer_flush[256];
-  bool end = false;
-  bool connection_closed = false;
-  int count = 0;
-  while (!end)
+  std::map<std::string, int>::iterator it = impl_->marker_names_.find(name);
+  if (it != impl_->marker_names_.end())
   {
-    count = RecvRaw((char*)buffer_flush, 256, default_timeout_millisec_, connection_closed);
-    if (count <= 0 || connection_closed)
-    {
-      end = true;
-    }
+    impl_->markers_[it->second].index_ = -1;
   }
 }
 
-int PicoPixelClient::Impl::RecvInteger(int* val, int expected_size)
+void PicoPixelClient::SynchronizeMarkers()
 {
-  int count = 0;
-  int total_bytes = 0;
-  bool end = false;
-  bool connection_closed = false;
-  int trial = 0;
-  while (!end)
+  std::vector<Marker>::iterator it;
+  for (it = impl_->markers_.begin(); it != impl_->markers_.end(); ++it)
   {
-    count = RecvRaw((char*)val + count, expected_size * sizeof(int) - count, default_timeout_millisec_, connection_closed);
-    if ((count == 0) && (trial++ == Impl::trials_read_on_socket))
+    if ((*it).use_count_pico_pixel_update_ >= 0)
     {
-      return total_bytes / sizeof(int);
+      (*it).use_count_pico_pixel_update_ = (*it).use_count_;
     }
-
-    total_bytes += count;
-    if (total_bytes == expected_size * sizeof(int))
-      end = true;
   }
-
-  return total_bytes / sizeof(int);
 }
 
-int PicoPixelClient::Impl::RecvString(char* str, int expected_size, char str_terminal_char)
+void PicoPixelClient::UpdateMarkersFromPicoPixel()
 {
-  int count = 0;
-  int total_bytes = 0;
-  bool end = false;
-  bool connection_closed = false;
-  int trial = 0;
-  while (!end)
+  EnterCriticalSection(&impl_->markers_lock_);
+  std::vector<Marker>::iterator it;
+  for (it = impl_->markers_.begin(); it != impl_->markers_.end(); ++it)
   {
-    count = RecvRaw(str + count, expected_size * sizeof(char) - count, default_timeout_millisec_, connection_closed);
-    if ((count == 0) && (trial++ == Impl::trials_read_on_socket))
-      return total_bytes / sizeof(char);
-
-    total_bytes += count;
-    if (total_bytes == expected_size)
-      end = true;
+    if ((*it).use_count_pico_pixel_update_ >= 0)
+    {
+      impl_->SetMarkerUseCount(*it, (*it).use_count_pico_pixel_update_);
+      (*it).use_count_pico_pixel_update_ = -1;
+    }
   }
-
-  return total_bytes / sizeof(char);
+  WakeAllConditionVariable(&impl_->markers_changed_);
+  LeaveCriticalSection(&impl_->markers_lock_);
 }
 
-void PicoPixelClient::Impl::HandShake(std::string client_id)
+void PicoPixelClient::AutoSynchronizeMarkers()
 {
-  HandShakeHeader hand_shake;
-  hand_shake.size = (unsigned int) client_id.size() + 1;
-
-  if (hand_shake.size > UINT_MAX)
-    return;
-
-  SendRaw(reinterpret_cast<const char*>(&hand_shake), sizeof(HandShakeHeader));
-  SendRaw(client_id.c_str(), (unsigned int)client_id.size() + 1);
+  impl_->markers_auto_sync_ = true;
 }
 
-PicoPixelClient::PicoPixelClient(std::string client_id)
-  : impl_(new Impl(this))
+void PicoPixelClient::DisableAutoSynchronizeMarkers()
 {
-  impl_->client_id_ = client_id;
+  impl_->markers_auto_sync_ = false;
 }
 
-PicoPixelClient::~PicoPixelClient()
+void PicoPixelClient::SendMarkersToPicoPixel()
 {
-  if (impl_->receiver_thread_ != NULL)
+  if (!Connected())
+    return;
+
+  SendPacket* packet = impl_->AcquirePacket();
+  if (packet == NULL)
+    return;
+
+  // Also called by the receiver and connector threads when they connect.
+  EnterCriticalSection(&impl_->markers_lock_);
+  MarkerDataHeader payload;
+  payload.marker_count = (int)impl_->markers_.size();
+  bool success = packet->Append(&payload, sizeof(payload));
+  std::vector<Marker>::iterator it;
+  for (it = impl_->markers_.begin(); (it != impl_->markers_.end()) && success; ++it)
   {
-    ::CloseHandle(impl_->receiver_thread_);
-    impl_->receiver_thread_ = NULL;
+    impl_->SyncMarkerGroups(*it);
+    int str_size = (int)(*it).name_.size() + 1;
+    int use_count = (int)(*it).use_count_;
+    success = packet->Append(&((*it).index_),     sizeof(int)) &&
+              packet->Append(&use_count,          sizeof(int)) &&
+              packet->Append(&((*it).hex_color_), sizeof(int)) &&
+              packet->Append(&str_size,           sizeof(int)) &&
+              packet->Append((*it).name_.c_str(), str_size);
+  }
+  LeaveCriticalSection(&impl_->markers_lock_);
 
+  if (!success)
+  {
+    impl_->ReleasePacket(packet);
+    return;
   }
-  if (Connected())
+  impl_->SubmitPacket(packet);
+}
+
+bool PicoPixelClient::PixelPrintf(int marker_index, const ImageInfo& image_info, char* data)
+{
+  if (!impl_->TriggerMarker(marker_index))
   {
-    EndConnection();
+    impl_->RecordFlight(image_info.image_name, image_info.pixel_format, image_info.width, image_info.height,
+      image_info.pitch, image_info.srgb, image_info.upside_down, data);
+    return false;
   }
+
+  return PixelPrintf(image_info, data);
 }
 
-bool PicoPixelClient::StartConnection()
+bool PicoPixelClient::PixelPrintf(const ImageInfo& image_info, char* data)
 {
-  // Will attempt to connect to local port.
-  return StartConnectionToHost(std::string(""), PICO_PIXEL_SERVER_PORT);
+  return PixelPrintf(
+    image_info.image_name,
+    image_info.pixel_format,
+    image_info.width,
+    image_info.height,
+    image_info.pitch,
+    image_info.srgb,
+    image_info.upside_down,
+    data);
 }
 
-bool PicoPixelClient::StartConnectionToHost(std::string host_ip, int port)
+// Sends an image under 'image_name'. With a 'name_id' the name is only used on the client side.
+bool PicoPixelClient::Impl::SendImage(const std::string& image_name,
+                                      unsigned int name_id,
+                                      PicoPixelClient::PixelFormat pixel_format,
+                                      int width,
+                                      int height,
+                                      int pitch,
+                                      BOOL srgb,
+                                      BOOL upside_down,
+                                      char* data,
+                                      int pixel_stride,
+                                      int channel)
 {
+  RecordFlight(image_name, pixel_format, width, height, pitch, srgb, upside_down, data, pixel_stride, channel);
 
-  impl_->client_side_connection_termination_ = false;
+  if (!ReadyToSend())
+    return false;
 
-  if (Connected())
+  if (width <= 0 ||
+    height <= 0 ||
+    pitch <= 0)
+    return false;
+
+  if (data == NULL)
+    return false;
+
+  PixelLayout layout;
+  if (!DescribePixelLayout(pixel_format, pixel_stride, channel, layout))
+    return false;
+
+  // Regions, timings and name IDs need a viewer reading version 2 headers. Older viewers get the whole image
+  // with its name.
+  bool extended = viewer_protocol_version_ >= 2;
+  if (!extended)
   {
-    return true;
+    name_id = 0;
   }
-
-  if (port <= 1024)
+  UINT64 capture_time = (latency_tracing_ && extended) ? MonotonicMicroseconds() : 0;
+
+  // Only send the region of interest set by Pico Pixel. The rows of the region are read in place.
+  PixelRegionExtension region;
+  bool send_region = false;
+  int bytes_per_pixel = layout.bytes_per_pixel;
+  Impl::RegionOfInterest region_of_interest;
+  if (extended && (bytes_per_pixel > 0) && FindRegionOfInterest(image_name, region_of_interest))
   {
-    // Reserved ports on Windows
-    return false;
+    int x0 = region_of_interest.x < 0 ? 0 : region_of_interest.x;
+    int y0 = region_of_interest.y < 0 ? 0 : region_of_interest.y;
+    int x1 = region_of_interest.x + region_of_interest.width;
+    int y1 = region_of_interest.y + region_of_interest.height;
+    x1 = x1 > width ? width : x1;
+    y1 = y1 > height ? height : y1;
+
+    if ((x1 > x0) && (y1 > y0) && ((x1 - x0 != width) || (y1 - y0 != height)))
+    {
+      region.x = x0;
+      region.y = y0;
+      region.full_width = width;
+      region.full_height = height;
+      send_region = true;
+
+      data += (size_t)y0 * pitch + (size_t)x0 * layout.pixel_stride;
+      width = x1 - x0;
+      height = y1 - y0;
+    }
   }
 
-  int err = 0;
-  int ret = 0;
-  int const host_name_size = 512;
-  int const host_port_size = 32;
-  char host_name[host_name_size] = {0};
-  char host_port[host_port_size] = {0};
-  WSADATA wsaData;
+  // Half float packing, block compression and gathering convert rows straight into the packet.
+  PixelFormat half_float_format = HalfFloatPixelFormat(pixel_format);
+  bool pack_half_float = half_float_packing_ && (half_float_format != PIXEL_FORMAT_UNKNOWN) && !layout.gather;
+  PixelFormat block_format = block_compression_;
+  bool compress_blocks = (block_format != PIXEL_FORMAT_UNKNOWN) && !layout.gather &&
+    ((pixel_format == PIXEL_FORMAT_RGBA8) || (pixel_format == PIXEL_FORMAT_BGRA8));
+  int row_size = pitch;
+  int row_count = PixelInfoRowCount(pixel_format, height);
+  if (pack_half_float)
+  {
+    if (pitch < width * bytes_per_pixel)
+      return false;
 
-  std::memset(host_name, 0, host_name_size);
-  std::memset(host_port, 0, host_port_size);
+    row_size = width * DescribePixelFormat(half_float_format).bytes_per_pixel;
+  }
+  else if (compress_blocks)
+  {
+    if (pitch < width * bytes_per_pixel)
+      return false;
 
-  if (!host_ip.empty() && host_ip.size() < host_name_size - 1)
+    row_size = ((width + 3) / 4) * BlockSize(block_format);
+    row_count = PixelInfoRowCount(block_format, height);
+  }
+  else if (layout.gather)
   {
-    std::memcpy(host_name, host_ip.c_str(), host_ip.size());
+    row_size = width * layout.element_size;
+  }
+  else if (send_region)
+  {
+    // A region is sent with tightly packed rows.
+    row_size = width * bytes_per_pixel;
   }
 
-#if WIN32
-  err = sprintf_s(host_port, host_port_size-1, "%d", port);
-  if (err < 0)
-    return false;
-#else
-  err = snprintf(host_port, host_port_size-1, "%d", port);
-  if (err < 0)
+  PixelInfoHeader pixel_info;
+  pixel_info.width = width;
+  pixel_info.height = height;
+  pixel_info.pixel_format = pack_half_float ? half_float_format : (compress_blocks ? block_format : layout.sent_format);
+  pixel_info.pitch = row_size;
+  pixel_info.srgb = srgb;
+  pixel_info.upside_down = upside_down;
+  pixel_info.extensions = (send_region ? PIXEL_INFO_EXTENSION_REGION : 0) | (name_id != 0 ? PIXEL_INFO_EXTENSION_NAME_ID : 0) |
+    (capture_time != 0 ? PIXEL_INFO_EXTENSION_TIMING : 0);
+  pixel_info.picoversion = (pixel_info.extensions != 0) ? 2 : 1;
+
+  SendPacket* packet = AcquirePacket();
+  if (packet == NULL)
     return false;
-#endif
 
-#if WIN32
-  err = WSAStartup( MAKEWORD( 2, 2 ), &wsaData );
-  if (err != 0)
+  packet->protocol_version = pixel_info.picoversion;
+  bool success = packet->Append(&pixel_info, PixelInfoHeaderSize(pixel_info.picoversion));
+  if (success && send_region)
   {
-    printf("[PicoPixelClient::PicoPixelClient] WSAStartup has failed: %d\n", err);
-    return false;
+    success = packet->Append(&region, sizeof(PixelRegionExtension));
   }
-#endif
-
-  ////
-  struct addrinfo ai_hints;
-  struct addrinfo* ai_list = NULL;
 
-  ::memset(&ai_hints, 0, sizeof(ai_hints));
-  ai_hints.ai_family = PF_INET;
-  ai_hints.ai_socktype = SOCK_STREAM;
-  ai_hints.ai_protocol = IPPROTO_TCP;
+  packet->needs_credit = true;
+  packet->image_name = image_name;
+  packet->name_id = name_id;
+  packet->priority = FindImagePriority(image_name);
+  success = success && AppendTiming(packet, capture_time);
+  if (name_id != 0)
+  {
+    // The name was registered on the connection, only its ID goes with the image.
+    PixelNameIdExtension name_extension;
+    name_extension.name_id = name_id;
+    int name_size = 0;
+    success = success && packet->Append(&name_extension, sizeof(PixelNameIdExtension)) && packet->Append(&name_size, sizeof(int));
+  }
+  else
+  {
+    success = success && packet->AppendString(image_name);
+  }
 
-  ret = getaddrinfo(host_name, host_port, &ai_hints, &ai_list);
-  if (ret)
+  char* pixels = success ? packet->Append((size_t)row_size * row_count) : NULL;
+  if (pixels == NULL)
   {
-    printf("[LocalIPString] 'getaddrinfo' error: %d.\n", ret);
+    printf("[PixelPrintf] Out of memory.\n");
+    ReleasePacket(packet);
     return false;
   }
 
-  struct sockaddr_in* sa = (struct sockaddr_in*) ai_list->ai_addr;
-  host_name[0] = 0;
-  ret = sprintf_s(host_name, host_name_size, "%u.%u.%u.%u",
-    (UINT)(sa->sin_addr.S_un.S_un_b.s_b1),
-    (UINT)(sa->sin_addr.S_un.S_un_b.s_b2),
-    (UINT)(sa->sin_addr.S_un.S_un_b.s_b3),
-    (UINT)(sa->sin_addr.S_un.S_un_b.s_b4));
-
-  impl_->picopixel_server_ip_ = host_name;
-
-  struct addrinfo* ai = NULL;
-  for (ai = ai_list; ai; ai = ai->ai_next)
+  if (pack_half_float)
   {
-    impl_->sock_ = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
-    if (impl_->sock_ == INVALID_SOCKET)
+    int channel_count = bytes_per_pixel / sizeof(float);
+    for (int y = 0; y < height; ++y)
     {
-      int error_code = WSAGetLastError();
-      printf("[PixelPrintF] Failed to create network socket. Error code: %d.\n", error_code);
-
-      continue;
+      ConvertFloatToHalf((const float*)(data + (size_t)y * pitch),
+        (unsigned short*)(pixels + (size_t)y * row_size),
+        width * channel_count);
     }
-
-    ret = connect(impl_->sock_, ai->ai_addr, (int)ai->ai_addrlen);
-    if( ret == -1 )
+  }
+  else if (compress_blocks)
+  {
+    BlockCompressionTask task;
+    task.data = data;
+    task.width = width;
+    task.height = height;
+    task.pitch = pitch;
+    task.bgra = pixel_format == PIXEL_FORMAT_BGRA8;
+    task.block_format = block_format;
+    task.blocks = pixels;
+    task.block_row_size = row_size;
+    ParallelFor(row_count, CompressBlockRows, &task);
+  }
+  else if (layout.gather)
+  {
+    for (int y = 0; y < height; ++y)
     {
-      closesocket(impl_->sock_);
-      impl_->sock_ = INVALID_SOCKET;
-      continue;
+      GatherRow(pixels + (size_t)y * row_size, data + (size_t)y * pitch, width, layout);
     }
+  }
+  else if (row_size == pitch)
+  {
+    std::memcpy(pixels, data, (size_t)pitch * row_count);
+  }
+  else
+  {
+    for (int y = 0; y < height; ++y)
+    {
+      std::memcpy(pixels + (size_t)y * row_size, data + (size_t)y * pitch, row_size);
+    }
+  }
 
-    // we have a good connection.
-    break;
+  return SubmitPacket(packet);
+}
+
+
+bool PicoPixelClient::PixelPrintf(const std::string& image_name,
+                                  PicoPixelClient::PixelFormat pixel_format,
+                                  int width,
+                                  int height,
+                                  int pitch,
+                                  BOOL srgb,
+                                  BOOL upside_down,
+                                  char* data)
+{
+  if (image_name.empty())
+  {
+    return impl_->SendImage(impl_->UnnamedImageName(), 0, pixel_format, width, height, pitch, srgb, upside_down, data);
   }
 
-  freeaddrinfo(ai_list);
+  return impl_->SendImage(image_name, 0, pixel_format, width, height, pitch, srgb, upside_down, data);
+}
+
+// Start of the first pixel of a view, NULL if the view is invalid.
+static const char* ViewOrigin(const PicoPixelClient::ImageView& view)
+{
+  if ((view.data == NULL) || (view.origin_x < 0) || (view.origin_y < 0))
+    return NULL;
 
-  if (ai == NULL)
+  int pixel_stride = view.pixel_stride > 0 ? view.pixel_stride : DescribePixelFormat(view.pixel_format).bytes_per_pixel;
+  return view.data + (size_t)view.origin_y * view.row_stride + (size_t)view.origin_x * pixel_stride;
+}
+
+bool PicoPixelClient::PixelPrintfView(const std::string& image_name, const ImageView& view)
+{
+  const char* origin = ViewOrigin(view);
+  if (origin == NULL)
+    return false;
+
+  return impl_->SendImage(image_name.empty() ? impl_->UnnamedImageName() : image_name, 0, view.pixel_format,
+    view.width, view.height, view.row_stride, view.srgb, view.upside_down, (char*)origin, view.pixel_stride, view.channel);
+}
+
+bool PicoPixelClient::PixelPrintfView(int marker_index, const std::string& image_name, const ImageView& view)
+{
+  if (!impl_->TriggerMarker(marker_index))
   {
-    if (impl_->trying_to_reconnect_to_pico_pixel_ == false)
+    const char* origin = ViewOrigin(view);
+    if (origin != NULL)
     {
-      printf("[PicoPixelClient::PicoPixelClient] Connection failed.\n");
-      printf("[PicoPixelClient::PicoPixelClient] You need to launch Pico Pixel desktop application before running this program.\n");
-    }
-    else
-    {
-      printf("[PicoPixelClient::PicoPixelClient] Attempting reconnection to Pico Pixel.\n");
+      impl_->RecordFlight(image_name, view.pixel_format, view.width, view.height, view.row_stride, view.srgb,
+        view.upside_down, origin, view.pixel_stride, view.channel);
     }
     return false;
-  }
-
-  if (impl_->sock_ != INVALID_SOCKET)
-  {
-    impl_->HandShake(impl_->client_id_);
+  }
+
+  return PixelPrintfView(image_name, view);
+}
+
+PicoPixelClient::ImageNameId PicoPixelClient::RegisterImageName(const std::string& image_name)
+{
+  ImageNameId name_id;
+  if (image_name.empty())
+    return name_id;
+
+  EnterCriticalSection(&impl_->image_names_lock_);
+  std::map<std::string, unsigned int>::const_iterator it = impl_->image_name_ids_.find(image_name);
+  if (it != impl_->image_name_ids_.end())
+  {
+    name_id.id = it->second;
+  }
+  else if ((int)impl_->image_names_.size() < PIXEL_PRINTF_MAX_IMAGE_NAMES)
+  {
+    // image_names_ never grows past its reserved size, so other threads can read the names below
+    // image_name_count_ while one is added. The count is published after the name is stored.
+    impl_->image_names_.push_back(image_name);
+    name_id.id = (unsigned int)impl_->image_names_.size();
+    impl_->image_name_ids_[image_name] = name_id.id;
+    InterlockedExchange(&impl_->image_name_count_, (LONG)name_id.id);
+  }
+  else
+  {
+    printf("[PicoPixelClient::RegisterImageName] Too many image names.\n");
+  }
+  LeaveCriticalSection(&impl_->image_names_lock_);
+  return name_id;
+}
+
+bool PicoPixelClient::PixelPrintf(ImageNameId image_name,
+                                  PixelFormat pixel_format,
+                                  int width,
+                                  int height,
+                                  int pitch,
+                                  BOOL srgb,
+                                  BOOL upside_down,
+                                  char* data)
+{
+  if (image_name.id == 0 || image_name.id > (unsigned int)impl_->image_name_count_)
+    return false;
 
-    impl_->host_ip_ = host_name;
-    impl_->port_ = port;
+  return impl_->SendImage(impl_->image_names_[image_name.id - 1], image_name.id, pixel_format, width, height, pitch, srgb, upside_down, data);
+}
 
-    if (impl_->trying_to_reconnect_to_pico_pixel_ == false)
+bool PicoPixelClient::PixelPrintf(int marker_index,
+                                  ImageNameId image_name,
+                                  PixelFormat pixel_format,
+                                  int width,
+                                  int height,
+                                  int pitch,
+                                  BOOL srgb,
+                                  BOOL upside_down,
+                                  char* data)
+{
+  if (!impl_->TriggerMarker(marker_index))
+  {
+    if (image_name.id != 0 && image_name.id <= (unsigned int)impl_->image_name_count_)
     {
-      impl_->receiver_thread_ = ::CreateThread(NULL,
-        0,
-        PicoPixelClient::Impl::ReceiverThread,
-        this,
-        CREATE_SUSPENDED,
-        &impl_->thread_id_);
-
-      if (impl_->receiver_thread_ != NULL)
-      {
-        ResumeThread(impl_->receiver_thread_);
-        return true;
-      }
+      impl_->RecordFlight(impl_->image_names_[image_name.id - 1], pixel_format, width, height, pitch, srgb, upside_down, data);
     }
+    return false;
   }
 
-  return true;
+  return PixelPrintf(image_name, pixel_format, width, height, pitch, srgb, upside_down, data);
 }
 
-void PicoPixelClient::EnableAutoReconnectOnPicoPixelShutdown()
+void PicoPixelClient::SetSummaryHistogramRange(float min, float max)
 {
-  impl_->auto_reconnect_on_picopixel_shutdown_ = true;
+  if (max <= min)
+    return;
+
+  impl_->summary_histogram_min_ = min;
+  impl_->summary_histogram_max_ = max;
 }
 
-void PicoPixelClient::DisableAutoReconnectOnPicoPixelShutdown()
+void PicoPixelClient::SetGoldenComparison(float tolerance, unsigned int max_different_pixels)
 {
-  impl_->auto_reconnect_on_picopixel_shutdown_ = false;
+  if (!(tolerance >= 0.0f))
+    return;
+
+  impl_->golden_tolerance_ = tolerance;
+  impl_->golden_max_different_pixels_ = max_different_pixels;
 }
 
-void PicoPixelClient::EndConnection()
+bool PicoPixelClient::PixelPrintfIfDifferent(int marker_index, const ImageInfo& image_info, char* data, const char* golden,
+  ImageDifference* difference)
 {
-  impl_->client_side_connection_termination_ = true;
-  impl_->host_ip_.clear();
-  impl_->port_ = 0;
+  int width = (int)image_info.width;
+  int height = (int)image_info.height;
+  int pitch = (int)image_info.pitch;
+  if (width <= 0 || height <= 0 || pitch <= 0)
+    return false;
 
-  if (impl_->sock_ == INVALID_SOCKET)
-    return;
+  if (data == NULL || golden == NULL)
+    return false;
 
-  int res = shutdown(impl_->sock_, SD_BOTH);
+  DifferenceTask task;
+  task.pixel_format = image_info.pixel_format;
+  task.data = data;
+  task.golden = golden;
+  task.width = width;
+  task.pitch = pitch;
+  const PixelFormatDescription& format = DescribePixelFormat(image_info.pixel_format);
+  task.bytes_per_pixel = format.bytes_per_pixel;
+  task.decode = format.decode;
+  task.tolerance = impl_->golden_tolerance_;
+  task.heat_scale = 0.0f;
+  task.heat_map = NULL;
+  // Block compressed pixels cannot be compared one by one.
+  if (format.channel_count == 0 || pitch < width * task.bytes_per_pixel)
+    return false;
 
-  if (res == SOCKET_ERROR)
+  DifferenceAccumulator empty = { 0, 0.0f, 0.0 };
+  task.slices.assign(impl_->ParallelSliceCount(), empty);
+
+  impl_->ParallelFor(height, CompareRows, &task);
+
+  DifferenceAccumulator total = empty;
+  for (size_t i = 0; i < task.slices.size(); ++i)
   {
-    printf("[PicoPixelClient::EndConnection] shutdown failed: %d\n", WSAGetLastError());
+    total.different_pixels += task.slices[i].different_pixels;
+    total.max_error = task.slices[i].max_error > total.max_error ? task.slices[i].max_error : total.max_error;
+    total.error_sum += task.slices[i].error_sum;
   }
 
-  closesocket(impl_->sock_);
-  impl_->sock_ = INVALID_SOCKET;
+  if (difference != NULL)
+  {
+    difference->different_pixels = total.different_pixels;
+    difference->max_error = total.max_error;
+    difference->mean_error = (float)(total.error_sum / ((double)width * height));
+  }
 
-#if WIN32
-  WSACleanup();
-#endif
-}
+  if (total.different_pixels <= impl_->golden_max_different_pixels_)
+    return false;
 
-bool PicoPixelClient::Connected()
-{
-  return impl_->sock_ != INVALID_SOCKET;
-}
+  // The marker only counts the images that differ.
+  if (!impl_->TriggerMarker(marker_index))
+    return false;
 
-int PicoPixelClient::CreateMarker(std::string name, int use_count)
-{
-  return CreateMarker(name, use_count, PICO_PIXEL_MARKER_COLOR);
+  if (!PixelPrintf(image_info, data))
+    return false;
+
+  size_t capacity = 0;
+  task.heat_map = (unsigned char*)impl_->buffer_pool_.Acquire((size_t)width * height * 4, capacity);
+  if (task.heat_map == NULL)
+    return true;
+
+  float range = total.max_error - task.tolerance;
+  task.heat_scale = range > 0.0f ? 1.0f / range : 0.0f;
+  impl_->ParallelFor(height, HeatMapRows, &task);
+
+  std::string image_name = image_info.image_name.empty() ? impl_->UnnamedImageName() : image_info.image_name;
+  impl_->SendImage(image_name + " difference", 0, PIXEL_FORMAT_RGBA8, width, height, width * 4, FALSE,
+    image_info.upside_down, (char*)task.heat_map);
+  impl_->buffer_pool_.Release((char*)task.heat_map, capacity);
+
+  return true;
 }
 
-int PicoPixelClient::CreateMarker(std::string name, int use_count, unsigned int color)
+bool PicoPixelClient::PixelPrintfIfDifferent(int marker_index, const ImageInfo& image_info, char* data,
+  const std::string& golden_path, UINT64 offset, ImageDifference* difference)
 {
-  std::vector<Marker>::iterator it;
-  for (it = impl_->markers_.begin(); it != impl_->markers_.end(); ++it)
+  if ((int)image_info.height <= 0 || (int)image_info.pitch <= 0)
+    return false;
+
+  UINT64 size = (UINT64)image_info.pitch * image_info.height;
+
+  HANDLE file = ::CreateFile(golden_path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, NULL);
+  if (file == INVALID_HANDLE_VALUE)
   {
-    if ((*it).name_ == name)
-    {
-      std::cout << "[PicoPixelClient::CreateMarker] There is already a marker with name " << name << std::endl;
-      return -1;
-    }
+    printf("[PixelPrintfIfDifferent] Cannot open file %s.\n", golden_path.c_str());
+    return false;
   }
 
-  int index = (int)impl_->markers_.size();
-  Marker m(index, name, use_count, color);
+  LARGE_INTEGER file_size;
+  if (!GetFileSizeEx(file, &file_size) || ((UINT64)file_size.QuadPart < offset + size))
+  {
+    printf("[PixelPrintfIfDifferent] File %s is too small for the image.\n", golden_path.c_str());
+    ::CloseHandle(file);
+    return false;
+  }
 
-  impl_->markers_.push_back(m);
-  return index;
-}
+  HANDLE mapping = ::CreateFileMapping(file, NULL, PAGE_READONLY, 0, 0, NULL);
+  ::CloseHandle(file);
+  if (mapping == NULL)
+  {
+    printf("[PixelPrintfIfDifferent] CreateFileMapping failed: %d\n", (int)GetLastError());
+    return false;
+  }
 
-int PicoPixelClient::MarkerUseCount(int marker_index)
-{
-  int marker_count = (int) impl_->markers_.size();
-  if (marker_index >= marker_count)
+  // Views have to start on the allocation granularity.
+  SYSTEM_INFO system_info;
+  GetSystemInfo(&system_info);
+  UINT64 view_offset = offset - (offset % system_info.dwAllocationGranularity);
+  SIZE_T view_size = (SIZE_T)(offset - view_offset + size);
+
+  const char* view = (const char*)MapViewOfFile(mapping, FILE_MAP_READ, (DWORD)(view_offset >> 32), (DWORD)view_offset, view_size);
+  ::CloseHandle(mapping);
+  if (view == NULL)
   {
-    printf("[PicoPixelClient::MarkerUseCount] Invalid marker index.\n");
-    return -1;
+    printf("[PixelPrintfIfDifferent] MapViewOfFile failed: %d\n", (int)GetLastError());
+    return false;
   }
 
-  return impl_->markers_[marker_index].use_count_;
+  bool sent = PixelPrintfIfDifferent(marker_index, image_info, data, view + (offset - view_offset), difference);
+  UnmapViewOfFile(view);
+  return sent;
 }
 
-
-void PicoPixelClient::ResetMarker(int index)
+bool PicoPixelClient::PixelPrintfSummary(int marker_index, const ImageInfo& image_info, char* data)
 {
-  if (index < 0)
-    return;
+  bool success = PixelPrintfSummary(image_info, data);
 
-  if (index >= (int)impl_->markers_.size())
-    return;
+  // The full image goes through the marker.
+  PixelPrintf(marker_index, image_info, data);
 
-  impl_->markers_[index].use_count_ = 0;
+  return success;
 }
 
-void PicoPixelClient::ResetMarker(std::string name)
+bool PicoPixelClient::PixelPrintfSummary(const ImageInfo& image_info, char* data)
 {
-  if (name.empty())
-    return;
+  if (!impl_->ReadyToSend())
+    return false;
 
-  std::vector<Marker>::iterator it;
-  for (it = impl_->markers_.begin(); it != impl_->markers_.end(); ++it)
+  int width = (int)image_info.width;
+  int height = (int)image_info.height;
+  int pitch = (int)image_info.pitch;
+  if (width <= 0 || height <= 0 || pitch <= 0)
+    return false;
+
+  if (data == NULL)
+    return false;
+
+  SummaryTask task;
+  task.pixel_format = image_info.pixel_format;
+  task.data = data;
+  task.width = width;
+  task.pitch = pitch;
+  const PixelFormatDescription& format = DescribePixelFormat(image_info.pixel_format);
+  task.bytes_per_pixel = format.bytes_per_pixel;
+  task.channel_count = format.channel_count;
+  task.decode = format.decode;
+  if (task.channel_count == 0 || pitch < width * task.bytes_per_pixel)
+    return false;
+
+  int alpha_channel = format.alpha_channel;
+  int color_count = task.channel_count - (alpha_channel >= 0 ? 1 : 0);
+  for (int c = 0; c < 4; ++c)
   {
-    if ((*it).name_ == name)
-    {
-      (*it).use_count_ = 0;
-      return;
-    }
+    bool color = (c < task.channel_count) && (c != alpha_channel);
+    task.color_weights[c] = color ? 1.0f / color_count : 0.0f;
   }
-}
+  task.histogram_min = impl_->summary_histogram_min_;
+  task.histogram_scale = PICO_PIXEL_SUMMARY_HISTOGRAM_SIZE / (impl_->summary_histogram_max_ - impl_->summary_histogram_min_);
 
-void PicoPixelClient::DeleteAllAddMarkers()
-{
-  impl_->markers_.clear();
-  SendMarkersToPicoPixel();
-}
+  task.slices.resize(impl_->ParallelSliceCount());
+  for (size_t i = 0; i < task.slices.size(); ++i)
+  {
+    task.slices[i].Reset();
+  }
 
-void PicoPixelClient::DeleteMarker(int index)
-{
-  if (index < 0)
-    return;
+  impl_->ParallelFor(height, SummarizeRows, &task);
 
-  if (index >= (int)impl_->markers_.size())
-    return;
+  SummaryAccumulator total;
+  total.Reset();
+  for (size_t i = 0; i < task.slices.size(); ++i)
+  {
+    total.Merge(task.slices[i]);
+  }
 
-  std::vector<Marker>::iterator it;
-  for (it = impl_->markers_.begin(); it != impl_->markers_.end(); ++it)
+  ImageSummaryHeader summary;
+  summary.width = width;
+  summary.height = height;
+  summary.pixel_format = image_info.pixel_format;
+  summary.channel_count = task.channel_count;
+  for (int c = 0; c < task.channel_count; ++c)
   {
-    if ((*it).index_ == index && (*it).index_ != -1)
-    {
-      (*it).index_ = -1;
-      return;
-    }
+    bool valid = total.valid_count[c] > 0.0;
+    summary.min[c] = valid ? total.min[c] : 0.0f;
+    summary.max[c] = valid ? total.max[c] : 0.0f;
+    summary.mean[c] = valid ? (float)(total.sum[c] / total.valid_count[c]) : 0.0f;
   }
-}
+  summary.nan_count = total.nan_count;
+  summary.inf_count = total.inf_count;
+  summary.histogram_min = impl_->summary_histogram_min_;
+  summary.histogram_max = impl_->summary_histogram_max_;
+  std::memcpy(summary.histogram, total.histogram, sizeof(summary.histogram));
 
-void PicoPixelClient::DeleteMarker(std::string name)
-{
-  std::vector<Marker>::iterator it;
-  for (it = impl_->markers_.begin(); it != impl_->markers_.end(); ++it)
+  std::string network_image_name = image_info.image_name;
+  if (network_image_name.empty())
   {
-    if ((*it).name_ == name && (*it).index_ != -1)
-    {
-      (*it).index_ = -1;
-      return;
-    }
+    network_image_name = PIXEL_PRINTF_CLIENT_FILE_NAME;
   }
-}
 
-void PicoPixelClient::SynchronizeMarkers()
-{
-  std::vector<Marker>::iterator it;
-  for (it = impl_->markers_.begin(); it != impl_->markers_.end(); ++it)
+  SendPacket* packet = impl_->AcquirePacket();
+  if (packet == NULL)
+    return false;
+
+  if (!packet->Append(&summary, sizeof(ImageSummaryHeader)) || !packet->AppendString(network_image_name))
   {
-    if ((*it).use_count_pico_pixel_update_ >= 0)
-    {
-      (*it).use_count_pico_pixel_update_ = (*it).use_count_;
-    }
+    impl_->ReleasePacket(packet);
+    return false;
   }
-}
 
-void PicoPixelClient::AutoSynchronizeMarkers()
-{
-  impl_->markers_auto_sync_ = true;
+  packet->priority = impl_->FindImagePriority(network_image_name);
+  return impl_->SubmitPacket(packet);
 }
 
-void PicoPixelClient::DisableAutoSynchronizeMarkers()
+bool PicoPixelClient::PixelPrintfTexture(int marker_index, const TextureInfo& texture_info, const Subresource* subresources)
 {
-  impl_->markers_auto_sync_ = false;
+  if (!impl_->TriggerMarker(marker_index))
+    return false;
+
+  return PixelPrintfTexture(texture_info, subresources);
 }
 
-void PicoPixelClient::SendMarkersToPicoPixel()
+bool PicoPixelClient::PixelPrintfTexture(const TextureInfo& texture_info, const Subresource* subresources)
 {
-  if (!Connected())
-    return;
+  if (!impl_->ReadyToSend())
+    return false;
 
-  MarkerDataHeader payload;
-  payload.marker_count = (int)impl_->markers_.size();
-  impl_->SendRaw((const char*)&payload, sizeof(payload));
-  std::vector<Marker>::iterator it;
-  for (it = impl_->markers_.begin(); it != impl_->markers_.end(); ++it)
+  int width = (int)texture_info.width;
+  int height = (int)texture_info.height;
+  int depth = (int)texture_info.depth;
+  int mip_count = (int)texture_info.mip_count;
+  int array_size = (int)texture_info.array_size;
+  int face_count = texture_info.cubemap ? 6 : 1;
+  if (width <= 0 || height <= 0 || depth <= 0 || mip_count <= 0 || array_size <= 0)
+    return false;
+
+  // Pico Pixel refuses larger textures.
+  if (mip_count > PICO_PIXEL_TEXTURE_MAX_MIPS || array_size > PICO_PIXEL_TEXTURE_MAX_ARRAY_SIZE)
+    return false;
+
+  if (texture_info.cubemap && depth != 1)
+    return false;
+
+  if (subresources == NULL)
+    return false;
+
+  int bytes_per_pixel = DescribePixelFormat(texture_info.pixel_format).bytes_per_pixel;
+  if (bytes_per_pixel == 0)
+    return false;
+
+  TextureInfoHeader texture;
+  texture.width = width;
+  texture.height = height;
+  texture.depth = depth;
+  texture.mip_count = mip_count;
+  texture.array_size = array_size;
+  texture.face_count = face_count;
+  texture.pixel_format = texture_info.pixel_format;
+  texture.srgb = texture_info.srgb;
+  texture.upside_down = texture_info.upside_down;
+  texture.subresource_count = mip_count * face_count * array_size;
+
+  // Lay out the subresources one after the other in the payload.
+  std::vector<TextureSubresourceEntry> entries(texture.subresource_count);
+  UINT64 payload_size = 0;
+  for (int layer = 0; layer < array_size; ++layer)
   {
-    int str_size = (int)(*it).name_.size() + 1;
-    impl_->SendRaw((const char*)&((*it).index_),      sizeof(int));
-    impl_->SendRaw((const char*)&((*it).use_count_),  sizeof(int));
-    impl_->SendRaw((const char*)&((*it).hex_color_),  sizeof(int));
-    impl_->SendRaw((const char*)&str_size,            sizeof(int));
-    impl_->SendRaw((const char*)(*it).name_.c_str(),  str_size);
+    for (int face = 0; face < face_count; ++face)
+    {
+      for (int mip = 0; mip < mip_count; ++mip)
+      {
+        int index = mip + mip_count * (face + face_count * layer);
+        TextureSubresourceEntry& entry = entries[index];
+        entry.mip = mip;
+        entry.array_layer = layer;
+        entry.face = face;
+        entry.width = (width >> mip) > 0 ? (width >> mip) : 1;
+        entry.height = (height >> mip) > 0 ? (height >> mip) : 1;
+        entry.depth = (depth >> mip) > 0 ? (depth >> mip) : 1;
+        entry.pitch = entry.width * bytes_per_pixel;
+        entry.slice_pitch = entry.pitch * entry.height;
+        entry.offset = payload_size;
+        entry.size = (UINT64)entry.slice_pitch * entry.depth;
+        payload_size += entry.size;
+
+        const Subresource& subresource = subresources[index];
+        if ((subresource.data == NULL) ||
+            (subresource.pitch < (unsigned int)entry.pitch) ||
+            ((entry.depth > 1) && (subresource.slice_pitch < subresource.pitch * entry.height)))
+          return false;
+      }
+    }
   }
-}
 
-bool PicoPixelClient::PixelPrintf(int marker_index, const ImageInfo& image_info, char* data)
-{
-  int marker_count = (int) impl_->markers_.size();
-  if (marker_index >= marker_count)
+  std::string network_texture_name = texture_info.texture_name;
+  if (network_texture_name.empty())
+  {
+    network_texture_name = impl_->UnnamedImageName();
+  }
+
+  SendPacket* packet = impl_->AcquirePacket();
+  if (packet == NULL)
     return false;
-  
-  if (impl_->markers_[marker_index].use_count_ <= 0)
+
+  bool success = packet->Append(&texture, sizeof(TextureInfoHeader)) &&
+                 packet->AppendString(network_texture_name) &&
+                 packet->Append(&entries[0], entries.size() * sizeof(TextureSubresourceEntry));
+
+  char* payload = success ? packet->Append((size_t)payload_size) : NULL;
+  if (payload == NULL)
+  {
+    printf("[PixelPrintfTexture] Out of memory.\n");
+    impl_->ReleasePacket(packet);
     return false;
+  }
 
-  --impl_->markers_[marker_index].use_count_;
+  for (size_t i = 0; i < entries.size(); ++i)
+  {
+    const TextureSubresourceEntry& entry = entries[i];
+    const Subresource& subresource = subresources[i];
+    char* dst = payload + entry.offset;
+    for (int z = 0; z < entry.depth; ++z)
+    {
+      const char* src = subresource.data + (size_t)z * subresource.slice_pitch;
+      if (subresource.pitch == (unsigned int)entry.pitch)
+      {
+        std::memcpy(dst, src, entry.slice_pitch);
+        dst += entry.slice_pitch;
+        continue;
+      }
 
-  return PixelPrintf(image_info, data);
+      for (int y = 0; y < entry.height; ++y)
+      {
+        std::memcpy(dst, src + (size_t)y * subresource.pitch, entry.pitch);
+        dst += entry.pitch;
+      }
+    }
+  }
 
+  packet->needs_credit = true;
+  packet->image_name = network_texture_name;
+  packet->priority = impl_->FindImagePriority(network_texture_name);
+  return impl_->SubmitPacket(packet);
 }
 
-bool PicoPixelClient::PixelPrintf(const ImageInfo& image_info, char* data)
+bool PicoPixelClient::PixelPrintfFile(int marker_index, const std::string& path, UINT64 offset, const ImageInfo& image_info)
 {
-  return PixelPrintf(
-    image_info.image_name,
-    image_info.pixel_format,
-    image_info.width,
-    image_info.height,
-    image_info.pitch,
-    image_info.srgb,
-    image_info.upside_down,
-    data);
+  if (!impl_->TriggerMarker(marker_index))
+    return false;
+
+  return PixelPrintfFile(path, offset, image_info);
 }
 
-bool PicoPixelClient::PixelPrintf(std::string image_name,
-                                  PicoPixelClient::PixelFormat pixel_format,
-                                  int width,
-                                  int height,
-                                  int pitch,
-                                  BOOL srgb,
-                                  BOOL upside_down,
-                                  char* data)
+bool PicoPixelClient::PixelPrintfFile(const std::string& path, UINT64 offset, const ImageInfo& image_info)
 {
-  if (!Connected())
-    return false;
-
-  if (width <= 0 ||
-    height <= 0 ||
-    pitch <= 0)
+  if (!impl_->ReadyToSend())
     return false;
 
-  if (data == NULL)
+  if ((int)image_info.width <= 0 ||
+    (int)image_info.height <= 0 ||
+    (int)image_info.pitch <= 0)
     return false;
 
-  PixelInfoHeader pixel_info;
-  pixel_info.width = width;
-  pixel_info.height = height;
-  pixel_info.pixel_format = pixel_format;
-  pixel_info.pitch = pitch;
-  pixel_info.srgb = srgb;
-  pixel_info.upside_down = upside_down;
-
-  static int image_name_index = 0;
-
-  //Send the header over to the server
+  UINT64 capture_time = impl_->latency_tracing_ ? MonotonicMicroseconds() : 0;
+  UINT64 size = (UINT64)image_info.pitch * PixelInfoRowCount(image_info.pixel_format, image_info.height);
 
-  std::string network_image_name = image_name;
-  if (network_image_name.empty())
+  HANDLE file = ::CreateFile(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+  if (file == INVALID_HANDLE_VALUE)
   {
-    std::ostringstream stream;
-    stream << image_name_index++;
-    network_image_name = std::string(PIXEL_PRINTF_CLIENT_FILE_NAME) + stream.str();
+    printf("[PixelPrintfFile] Cannot open file %s.\n", path.c_str());
+    return false;
   }
 
-  bool success = impl_->SendRaw((const char*)&pixel_info, sizeof(PixelInfoHeader));
-  if (success == false)
+  LARGE_INTEGER file_size;
+  if (!GetFileSizeEx(file, &file_size) || ((UINT64)file_size.QuadPart < offset + size))
   {
-    printf("[PixelPrintf] Failed to send data to Pico Pixel server.");
+    printf("[PixelPrintfFile] File %s is too small for the image.\n", path.c_str());
+    ::CloseHandle(file);
     return false;
   }
 
-  success = impl_->SendString(network_image_name);
-  if (success == false)
+  PixelInfoHeader pixel_info;
+  pixel_info.width = image_info.width;
+  pixel_info.height = image_info.height;
+  pixel_info.pixel_format = image_info.pixel_format;
+  pixel_info.pitch = image_info.pitch;
+  pixel_info.srgb = image_info.srgb;
+  pixel_info.upside_down = image_info.upside_down;
+  if ((capture_time != 0) && (impl_->viewer_protocol_version_ >= 2))
+  {
+    pixel_info.picoversion = 2;
+    pixel_info.extensions = PIXEL_INFO_EXTENSION_TIMING;
+  }
+
+  SendPacket* packet = impl_->AcquirePacket();
+  if (packet == NULL)
   {
-    printf("[PixelPrintf] Failed to send data to Pico Pixel server.");
+    ::CloseHandle(file);
     return false;
   }
 
-  int size = pitch * height;
-  success = impl_->SendRaw(data, size);
-  if (success == false)
+  // The header and the image name go out with the file data in one call.
+  const std::string& image_name = image_info.image_name.empty() ? path : image_info.image_name;
+  packet->image_name = image_name;
+  packet->protocol_version = pixel_info.picoversion;
+  if (!packet->Append(&pixel_info, PixelInfoHeaderSize(pixel_info.picoversion)) ||
+      !impl_->AppendTiming(packet, capture_time) ||
+      !packet->AppendString(image_name))
   {
-    printf("[PixelPrintf] Failed to send data to Pico Pixel server.");
+    ::CloseHandle(file);
+    impl_->ReleasePacket(packet);
     return false;
   }
-  return true;
+
+  // The sender thread closes the file.
+  packet->needs_credit = true;
+  packet->priority = impl_->FindImagePriority(image_name);
+  packet->file = file;
+  packet->file_offset = offset;
+  packet->file_size = size;
+  return impl_->SubmitPacket(packet);
 }
 
 bool PicoPixelClient::PixelPrintf(int marker_index,
-                                  std::string image_name,
+                                  const std::string& image_name,
                                   PixelFormat pixel_format,
                                   int width,
                                   int height,
@@ -833,14 +5775,11 @@ bool PicoPixelClient::PixelPrintf(int marker_index,
                                   BOOL upside_down,
                                   char* data)
 {
-  int marker_count = (int) impl_->markers_.size();
-  if (marker_index >= marker_count)
-    return false;
-
-  if (impl_->markers_[marker_index].use_count_ <= 0)
+  if (!impl_->TriggerMarker(marker_index))
+  {
+    impl_->RecordFlight(image_name, pixel_format, width, height, pitch, srgb, upside_down, data);
     return false;
-
-  --impl_->markers_[marker_index].use_count_;
+  }
 
   return PixelPrintf(
     image_name,
@@ -858,7 +5797,7 @@ bool PicoPixelClient::PixelPrintf(int marker_index,
 // Experimental
 #include <GL/gl.h>
 
-bool PicoPixelClient::PixelPrintfGLColorBuffer(int marker_index, std::string image_name, BOOL upside_down)
+bool PicoPixelClient::PixelPrintfGLColorBuffer(int marker_index, const std::string& image_name, BOOL upside_down)
 {
   int pack_align = 1;
   int viewport[4];
@@ -872,7 +5811,10 @@ bool PicoPixelClient::PixelPrintfGLColorBuffer(int marker_index, std::string ima
   glGetIntegerv(GL_PACK_ALIGNMENT, &pack_align);
   GLsizei pitch = width*color_byte_size + (pack_align - 1) & ~(pack_align - 1);
 
-  char* color_buffer = new char[pitch*height];
+  size_t capacity = 0;
+  char* color_buffer = impl_->buffer_pool_.Acquire((size_t)pitch * height, capacity);
+  if (color_buffer == NULL)
+    return false;
 
   glReadPixels(x, y, width, height, GL_RGBA, GL_UNSIGNED_BYTE, color_buffer);
   bool ret = PixelPrintf(marker_index, image_name,
@@ -883,12 +5825,12 @@ bool PicoPixelClient::PixelPrintfGLColorBuffer(int marker_index, std::string ima
     FALSE,
     upside_down,
     color_buffer);
-  delete [] color_buffer;
+  impl_->buffer_pool_.Release(color_buffer, capacity);
 
   return ret;
 }
 
-bool PicoPixelClient::PixelPrintfGLDepthBuffer(int marker_index, std::string image_name, BOOL upside_down)
+bool PicoPixelClient::PixelPrintfGLDepthBuffer(int marker_index, const std::string& image_name, BOOL upside_down)
 {
   int pack_align = 1;
   int viewport[4];
@@ -902,7 +5844,10 @@ bool PicoPixelClient::PixelPrintfGLDepthBuffer(int marker_index, std::string ima
   glGetIntegerv(GL_PACK_ALIGNMENT, &pack_align);
   GLsizei pitch = width*depth_byte_size + (pack_align - 1) & ~(pack_align - 1);
 
-  char* depth_buffer = new char[pitch*height];
+  size_t capacity = 0;
+  char* depth_buffer = impl_->buffer_pool_.Acquire((size_t)pitch * height, capacity);
+  if (depth_buffer == NULL)
+    return false;
 
   glReadPixels(x, y, width, height, GL_DEPTH_COMPONENT, GL_FLOAT, depth_buffer);
   bool ret = PixelPrintf(marker_index, image_name,
@@ -913,7 +5858,7 @@ bool PicoPixelClient::PixelPrintfGLDepthBuffer(int marker_index, std::string ima
     FALSE,
     upside_down,
     depth_buffer);
-  delete [] depth_buffer;
+  impl_->buffer_pool_.Release(depth_buffer, capacity);
 
   return ret;
 }
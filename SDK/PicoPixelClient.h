@@ -21,10 +21,64 @@ public:
     PIXEL_FORMAT_BGR8,
     PIXEL_FORMAT_R5G6B5,
     PIXEL_FORMAT_DEPTH,
+    PIXEL_FORMAT_R16F,
+    PIXEL_FORMAT_RG16F,
+    PIXEL_FORMAT_RGB16F,
+    PIXEL_FORMAT_RGBA16F,
+    PIXEL_FORMAT_R32F,
+    PIXEL_FORMAT_RG32F,
+    PIXEL_FORMAT_RGB32F,
+    PIXEL_FORMAT_RGBA32F,
+    PIXEL_FORMAT_R11G11B10F,
+    PIXEL_FORMAT_BC1,           //!< 4x4 blocks of 8 bytes. The pitch is the size of a row of blocks.
+    PIXEL_FORMAT_BC3,           //!< 4x4 blocks of 16 bytes, BC1 color with interpolated alpha.
+    PIXEL_FORMAT_BC7,           //!< 4x4 blocks of 16 bytes.
+    PIXEL_FORMAT_R8,
     // more pixel formats to come...
     PIXEL_FORMAT_FORCE32 = 0x7fffffff
   };
 
+  /*!
+      Compile-time description of a pixel format. Specialized after the class for every PixelFormat but the
+      block compressed ones:
+
+        PixelType       Type of one pixel in memory.
+        ChannelType     Type of one channel (unsigned short is a half float in 16-bit float formats).
+        bytes_per_pixel Size of one pixel in bytes.
+        channel_count   Number of channels.
+        alpha_channel   Index of the alpha channel in memory order, or -1.
+        is_float        True if the channels are floating point values.
+        is_packed       True if the channels are bit fields of PixelType rather than an array of ChannelType.
+        srgb_capable    True if the format can hold sRGB encoded data.
+        Layout()        Channels in memory order, such as "BGRA".
+  */
+  template <PixelFormat Format>
+  struct PixelFormatTraits;
+
+  //! Pixel made of 'Count' channels of type 'T'. Used as PixelType by multi-channel formats.
+  template <typename T, int Count>
+  struct PixelChannels
+  {
+    T channel[Count];
+  };
+
+  //! What to do with images when Pico Pixel has not granted enough credits to send them.
+  enum FlowControl
+  {
+    FLOW_CONTROL_OFF,   //!< Send everything as fast as the socket accepts it.
+    FLOW_CONTROL_HOLD,  //!< Keep images, and anything queued after them, until credits arrive. Only the newest
+                        //!< held image of each name is kept.
+    FLOW_CONTROL_DROP,  //!< Drop images. Markers and other packages are still sent.
+  };
+
+  //! Share of the bandwidth given to an image when several images are being sent.
+  enum ImagePriority
+  {
+    IMAGE_PRIORITY_BACKGROUND,
+    IMAGE_PRIORITY_NORMAL,
+    IMAGE_PRIORITY_HIGH,
+  };
+
   struct ImageInfo
   {
     PixelFormat       pixel_format;
@@ -37,11 +91,219 @@ public:
     std::string       image_name;
   };
 
+  /*!
+      Handle of an image name registered with RegisterImageName.
+  */
+  struct ImageNameId
+  {
+    ImageNameId()
+      : id(0)
+    {}
+
+    unsigned int      id;             //!< 0 is not a registered name.
+  };
+
+  /*!
+      Describes a texture made of several subresources: mip levels, array layers, cube faces or volume slices.
+  */
+  struct TextureInfo
+  {
+    TextureInfo()
+      : pixel_format(PIXEL_FORMAT_UNKNOWN)
+      , width(0)
+      , height(0)
+      , depth(1)
+      , mip_count(1)
+      , array_size(1)
+      , cubemap(false)
+      , srgb(FALSE)
+      , upside_down(FALSE)
+    {}
+
+    PixelFormat       pixel_format;
+    unsigned int      width;          //!< Size of mip 0.
+    unsigned int      height;
+    unsigned int      depth;          //!< Number of slices of a volume texture. 1 otherwise.
+    unsigned int      mip_count;      //!< Up to 32.
+    unsigned int      array_size;     //!< Up to 2048.
+    bool              cubemap;        //!< Each array layer has 6 faces, in D3D order: +X, -X, +Y, -Y, +Z, -Z.
+    BOOL              srgb;
+    BOOL              upside_down;
+    std::string       texture_name;
+  };
+
+  /*!
+      Pixels that are not packed row after row from the start of a buffer: a sub-rectangle of an atlas, one plane
+      of a planar buffer, pixels interleaved with other data, or one channel of an image. Pixel (x, y) of the view
+      starts at data + (origin_y + y) * row_stride + (origin_x + x) * pixel_stride.
+  */
+  struct ImageView
+  {
+    ImageView()
+      : data(NULL)
+      , pixel_format(PIXEL_FORMAT_UNKNOWN)
+      , origin_x(0)
+      , origin_y(0)
+      , width(0)
+      , height(0)
+      , row_stride(0)
+      , pixel_stride(0)
+      , channel(-1)
+      , srgb(FALSE)
+      , upside_down(FALSE)
+    {}
+
+    const char*       data;           //!< Start of the buffer.
+    PixelFormat       pixel_format;   //!< Format of one pixel of the buffer.
+    int               origin_x;       //!< First pixel of the view.
+    int               origin_y;
+    int               width;          //!< Size of the view in pixels.
+    int               height;
+    int               row_stride;     //!< Bytes from one row to the next.
+    int               pixel_stride;   //!< Bytes from one pixel to the next. 0 for the size of a pixel.
+    int               channel;        //!< Channel to send alone, in memory order. -1 sends every channel.
+    BOOL              srgb;
+    BOOL              upside_down;
+  };
+
+  //! How an image differs from its golden image.
+  struct ImageDifference
+  {
+    unsigned int      different_pixels;   //!< Pixels with an error over the tolerance.
+    float             max_error;          //!< Largest channel difference, 8-bit channels in [0, 1].
+    float             mean_error;         //!< Mean over the pixels of their largest channel difference.
+  };
+
+  //! Location of one subresource in memory.
+  struct Subresource
+  {
+    const char*       data;
+    unsigned int      pitch;          //!< Bytes from one row to the next.
+    unsigned int      slice_pitch;    //!< Bytes from one depth slice to the next. Ignored unless depth > 1.
+  };
+
+  /*!
+      Trigger policy of a marker. All the conditions that are set have to be met for the marker to fire.
+  */
+  struct MarkerTrigger
+  {
+    MarkerTrigger()
+      : every_nth(0)
+      , min_interval_ms(0)
+      , first_frame(-1)
+      , last_frame(-1)
+      , one_shot(false)
+      , ignore_use_count(false)
+      , condition(NULL)
+      , condition_data(NULL)
+    {}
+
+    int           every_nth;          //!< Fire on every Nth use of the marker. 0 or 1 fires on every use.
+    unsigned int  min_interval_ms;    //!< Minimum time between two fires in milliseconds. 0 disables.
+    int           first_frame;        //!< First frame (see NextFrame) the marker can fire on. -1 disables.
+    int           last_frame;         //!< Last frame the marker can fire on. -1 disables.
+    bool          one_shot;           //!< Fire only once, until the trigger is set again.
+    bool          ignore_use_count;   //!< Fire without the use count being armed. The use count is left alone.
+    bool          (*condition)(void* condition_data); //!< Fire only when the condition returns true.
+    void*         condition_data;
+  };
+
+  /*!
+      Called from the receiver thread when Pico Pixel sets the use count of a marker.
+
+      @param marker_index   Marker index.
+      @param use_count      Use count set by Pico Pixel.
+      @param callback_data  Pointer given with the callback.
+  */
+  typedef void (*MarkerChangedCallback)(int marker_index, int use_count, void* callback_data);
+
+  /*!
+      Socket settings picked by the client and the measurements they are based on.
+  */
+  struct TransportSettings
+  {
+    bool          no_delay;           //!< TCP_NODELAY. Packages are written in one piece so Nagle only delays them.
+    unsigned int  send_buffer_size;   //!< SO_SNDBUF in bytes.
+    bool          zero_copy;          //!< Large images are sent from their own buffers. See EnableZeroCopySend.
+    double        throughput_mbps;    //!< Smoothed rate of bytes acknowledged by the viewer while images are sent, in
+                                      //!< megabits per second. 0 until measured, or if TCP does not report it.
+    double        rtt_ms;             //!< Smoothed round-trip time reported by TCP. 0 if unknown.
+    unsigned int  ideal_backlog;      //!< Send backlog TCP recommends for the connection, in bytes. 0 if unknown.
+  };
+
+  /*!
+      Functions the client allocates its buffers with. They may be called from any thread.
+  */
+  struct Allocator
+  {
+    void*         (*allocate)(size_t size, void* allocator_data);              //!< Returns NULL on failure.
+    void          (*deallocate)(void* ptr, size_t size, void* allocator_data);
+    void*         allocator_data;
+  };
+
+  /*!
+      Memory held by the client for images: packets waiting to be sent, staging buffers and the flight recorder.
+  */
+  struct MemoryStatistics
+  {
+    UINT64        budget;             //!< 0 if there is no budget.
+    UINT64        allocated;          //!< Bytes obtained from the allocator, in use or kept for reuse.
+    UINT64        in_use;
+    UINT64        peak_allocated;
+    UINT64        allocation_count;   //!< Calls to the allocator so far. Steady once the same images are sent again.
+    unsigned int  failed_allocations; //!< Buffers refused by the budget or the allocator. Their image was not sent.
+  };
+
+  /*!
+      Latency distribution of one step of the trip of an image to Pico Pixel, in milliseconds.
+      Percentiles are estimated from a histogram with power of two buckets.
+  */
+  struct LatencyStatistics
+  {
+    unsigned int  count;
+    double        min_ms;
+    double        mean_ms;
+    double        max_ms;
+    double        p50_ms;
+    double        p90_ms;
+    double        p99_ms;
+  };
+
+  /*!
+      Latencies of the images sent under one name while latency tracing is enabled.
+  */
+  struct ImageLatency
+  {
+    LatencyStatistics queueing;   //!< From the PixelPrintf call to the sender thread starting to write the image.
+    LatencyStatistics transfer;   //!< Writing the image to the socket.
+    LatencyStatistics round_trip; //!< From the PixelPrintf call to Pico Pixel acknowledging the image.
+  };
+
   PicoPixelClient(std::string client_id);
   ~PicoPixelClient();
 
   bool StartConnection();
   bool StartConnectionToHost(std::string host_ip, int port);
+
+  /*!
+      Connects to Pico Pixel through a PicoPixelRelay running on the same machine.
+
+      @param path Path of the relay's Unix domain socket.
+      @return False if the relay could not be reached.
+  */
+  bool StartConnectionToRelay(const std::string& path);
+
+  /*!
+      Sets up a connection without blocking. The host is resolved once on a background thread and the
+      connection is made, also in the background, when the first image is sent. Images sent before the
+      connection is made are dropped without being copied. If the host has several addresses, each is
+      tried in turn. If Pico Pixel is not running, new attempts are made at most every two seconds, each
+      triggered by an image.
+
+      @return False if the background thread could not be started.
+  */
+  bool StartLazyConnection();
+  bool StartLazyConnectionToHost(std::string host_ip, int port);
   void EnableAutoReconnectOnPicoPixelShutdown();
   void DisableAutoReconnectOnPicoPixelShutdown();
   void EndConnection();
@@ -51,9 +313,168 @@ public:
   */
   bool Connected();
 
+  /*!
+      @return True if the client is connected or a lazy connection is set up.
+  */
+  bool Active();
+
+  /*!
+      PixelPrintf calls copy the image into a package that is queued and sent by a background thread.
+      Flush waits until every queued package has been sent.
+
+      @param timeout_ms Maximum time to wait in milliseconds.
+      @return False if packages are still queued after timeout_ms.
+  */
+  bool Flush(unsigned int timeout_ms);
+
+  /*!
+      Adds a timestamp and a sequence number to every image sent to Pico Pixel and collects, per image name,
+      how long images wait in the send queue, how long they take to write to the socket and, when Pico Pixel
+      acknowledges them, the round-trip time. Disabled by default.
+  */
+  void EnableLatencyTracing();
+  void DisableLatencyTracing();
+
+  /*!
+      @param image_name The name of the image.
+      @param latency    Receives the latencies of the image.
+      @return False if no traced image with this name has been sent.
+  */
+  bool ImageLatencyStatistics(const std::string& image_name, ImageLatency& latency);
+
+  /*!
+      Clears the latencies collected so far.
+  */
+  void ResetLatencyStatistics();
+
+  /*!
+      Starts keeping the last frames of the images added with AddFlightRecorderImage, whether they are sent to
+      Pico Pixel or not, so that a glitch can be looked at after it happened. The memory is allocated once;
+      recording an image copies it and overwrites the oldest images when the memory is full. Frames are
+      counted by NextFrame().
+
+      @param frame_count  Number of frames to keep.
+      @param memory_size  Bytes allocated for the images.
+      @return False if the memory could not be allocated.
+  */
+  bool StartFlightRecorder(int frame_count, unsigned int memory_size);
+  void StopFlightRecorder();
+
+  /*!
+      Selects an image for the flight recorder. Images sent with PixelPrintf under this name are recorded,
+      markers or not.
+
+      @param image_name The name of the image.
+  */
+  void AddFlightRecorderImage(const std::string& image_name);
+  void RemoveFlightRecorderImage(const std::string& image_name);
+
+  /*!
+      Sends the recorded images to Pico Pixel, oldest first. Each image is named after its frame, as in
+      "color-framebuffer [frame 1234]". Pico Pixel may also ask for a dump.
+
+      @return False if the client is not connected or nothing was recorded.
+  */
+  bool DumpFlightRecorder();
+
+  /*!
+      Writes the recorded images to a file, oldest first, as the image packages that would be sent to
+      Pico Pixel.
+
+      @param path The file to create.
+      @return False if the file could not be written or nothing was recorded.
+  */
+  bool DumpFlightRecorder(const std::string& path);
+
+  /*!
+      Converts 32-bit floating point images (PIXEL_FORMAT_R32F to PIXEL_FORMAT_RGBA32F) to their 16-bit
+      floating point counterpart before they are sent to Pico Pixel. This halves the amount of data going over
+      the network at the cost of precision. Disabled by default.
+  */
+  void EnableHalfFloatPacking();
+  void DisableHalfFloatPacking();
+
+  /*!
+      Encodes PIXEL_FORMAT_RGBA8 and PIXEL_FORMAT_BGRA8 images to a block compressed format before they are sent
+      to Pico Pixel. BC1 sends 8 times less data and drops alpha, BC3 and BC7 send 4 times less. The encoding is
+      lossy and meant for previews over slow links. Disabled by default.
+
+      @param block_format   PIXEL_FORMAT_BC1, PIXEL_FORMAT_BC3 or PIXEL_FORMAT_BC7.
+  */
+  void EnableBlockCompression(PixelFormat block_format);
+  void DisableBlockCompression();
+
+  /*!
+      Sends large images straight from their buffers with overlapped sends instead of copying them to the socket
+      send buffer, which is set to 0. Several images are in flight at once and each buffer is released when its
+      send completes. The send buffer is not sized after the bandwidth-delay product meanwhile. Whether this is
+      faster than the plain path has not been measured; it depends on the link and the viewer. Disabled by
+      default.
+
+      @param max_bytes_in_flight  Bytes of images the overlapped sends may hold at once.
+  */
+  void EnableZeroCopySend(unsigned int max_bytes_in_flight = 64 * 1024 * 1024);
+  void DisableZeroCopySend();
+
+  /*!
+      Replaces malloc and free for the client buffers. Call it before the first image is sent.
+
+      @param allocator  Allocation functions.
+      @return False if buffers were already allocated.
+  */
+  bool SetAllocator(const Allocator& allocator);
+
+  /*!
+      Bounds the memory the client allocates for images. Buffers are reused from one image to the next, and an
+      image that does not fit in the budget is not sent. Buffers kept for reuse are freed to make room first.
+
+      @param max_bytes  Budget in bytes. 0 for no limit, the default.
+  */
+  void SetMemoryBudget(UINT64 max_bytes);
+
+  /*!
+      @param statistics   Receives the memory use of the client.
+  */
+  void QueryMemoryStatistics(MemoryStatistics& statistics);
+
+  /*!
+      Bounds the number of images and bytes in flight to Pico Pixel so that slow decoding on the viewer side
+      does not fill the socket buffers with old frames. The window is requested during the connection hand
+      shake, so call this before StartConnection. Pico Pixel grants credits as it consumes images; versions that
+      do not grant credits are not limited.
+
+      @param flow_control         What to do with images sent without credits.
+      @param max_images_in_flight Images that may be in flight. 0 for no limit.
+      @param max_bytes_in_flight  Bytes that may be in flight. 0 for no limit.
+  */
+  void SetFlowControl(FlowControl flow_control, int max_images_in_flight, unsigned int max_bytes_in_flight);
+
+  /*!
+      Bounds the bytes of the images queued for the sender thread. An image that would go over it is dropped
+      and PixelPrintf returns false. An image is always queued when the queue is empty, whatever its size.
+
+      @param max_bytes  Bound in bytes. 0 for no limit. 512MB by default.
+  */
+  void SetSendQueueLimit(UINT64 max_bytes);
+
+  /*!
+      @return Number of images dropped by FLOW_CONTROL_DROP or a full send queue since the client was created.
+  */
+  unsigned int DroppedImageCount();
+
+  /*!
+      The client disables Nagle's algorithm on its socket and, while images are sent, sizes the socket send
+      buffer after the bandwidth-delay product of the connection.
+
+      @param settings   Receives the settings in use.
+      @return False if the client is not connected.
+  */
+  bool QueryTransportSettings(TransportSettings& settings);
+
   /*!
       Defines a uniquely named marker. If a marker with the same name already exists, the
       function return -1;
+      Markers and their groups are looked up without a lock: create them before other threads use markers.
 
       @param name A unique name for the marker.
       @param use_count The marker's counter value.
@@ -94,6 +515,103 @@ public:
   */
   void ResetMarker(std::string name);
 
+  /*!
+      Returns a group of markers. Markers named like paths, "frame/shadow/cascade2", belong to the groups of their
+      path: "frame/shadow" and "frame". A group is created with its first marker. Up to 1024 groups are made; the
+      markers of further groups belong to none.
+
+      @param name   Name of the group, "frame/shadow".
+      @return -1 if no marker belongs to the group.
+  */
+  int FindMarkerGroup(const std::string& name);
+
+  /*!
+      Sets the use count of every marker of a group and of its sub-groups at once. This takes the same time
+      whatever the number of markers: each marker takes the use count when it is next used or queried. A use
+      count set afterwards on a marker, by Pico Pixel or ResetMarker, takes precedence.
+
+      @param group_index    Group index.
+      @param use_count      Use count of each marker of the group.
+  */
+  void ArmMarkerGroup(int group_index, int use_count);
+  void ArmMarkerGroup(const std::string& name, int use_count);
+
+  /*!
+      Resets the use count of every marker of a group and of its sub-groups to 0.
+      @param group_index    Group index.
+  */
+  void ResetMarkerGroup(int group_index);
+  void ResetMarkerGroup(const std::string& name);
+
+  /*!
+      Returns the use count given to the markers of a group by the last arm or reset of the group or of a parent
+      group. 0 if none was made, -1 for an invalid group.
+
+      @param group_index    Group index.
+  */
+  int MarkerGroupUseCount(int group_index);
+
+  /*!
+      Checks a marker and consumes one use of it, as PixelPrintf does with a marker. Used by PICO_PIXEL_PRINTF
+      to test the marker before the arguments of PixelPrintf are evaluated.
+
+      @param marker_index   Marker index.
+      @return True if data using the marker should be sent.
+  */
+  bool TriggerMarker(int marker_index);
+
+  /*!
+      Sets a marker's trigger policy. Set the trigger before the marker is used from several threads.
+
+      @param marker_index   Marker index.
+      @param trigger        Trigger policy.
+  */
+  void SetMarkerTrigger(int marker_index, const MarkerTrigger& trigger);
+
+  /*!
+      Removes a marker's trigger policy. The marker only depends on its use count again.
+      @param marker_index   Marker index.
+  */
+  void ClearMarkerTrigger(int marker_index);
+
+  /*!
+      Advances the frame counter used by marker frame ranges. Call it once per frame.
+  */
+  void NextFrame();
+
+  /*!
+      @return The current frame counter value.
+  */
+  int Frame();
+
+  /*!
+      Waits until a marker's use count is greater than 0. With automatic synchronization disabled, the use count
+      set by Pico Pixel only counts once UpdateMarkersFromPicoPixel has applied it.
+
+      @param marker_index   Marker index.
+      @param timeout_ms     Time to wait in milliseconds. INFINITE waits until the marker is armed.
+      @return True if the marker is armed, false on timeout or for an invalid marker.
+  */
+  bool WaitForMarkerArmed(int marker_index, unsigned int timeout_ms);
+
+  /*!
+      Registers a callback called each time Pico Pixel sets the use count of a marker. The callback runs on the
+      receiver thread and must return quickly; start expensive work on a thread of your own.
+
+      @param callback       Function to call.
+      @param callback_data  Pointer passed to the callback.
+      @return Callback ID, to remove the callback with.
+  */
+  int AddMarkerChangedCallback(MarkerChangedCallback callback, void* callback_data);
+
+  /*!
+      Removes a callback. Once the function returns, the callback is not running and will not be called again,
+      unless it is the callback removing itself.
+
+      @param callback_id    ID returned by AddMarkerChangedCallback.
+  */
+  void RemoveMarkerChangedCallback(int callback_id);
+
   void DeleteAllAddMarkers();
   void DeleteMarker(int index);
   void DeleteMarker(std::string name);
@@ -102,15 +620,49 @@ public:
   void DisableAutoSynchronizeMarkers();
 
   void SendMarkersToPicoPixel();
+
+  /*!
+      Applies the use counts received from Pico Pixel while automatic synchronization is disabled.
+  */
   void UpdateMarkersFromPicoPixel();
 
   /*!
-      Sends an image raw data to PicoPixel.
+      Restricts the data sent for an image to a sub-rectangle. Pico Pixel sets the region of interest
+      when zooming into an image. The region is clamped to the image size when the image is sent.
+
+      @param image_name The name of the image.
+      @param x          Left of the region in pixels.
+      @param y          Top of the region in pixels (first row in memory).
+      @param width      Region width. 0 clears the region.
+      @param height     Region height. 0 clears the region.
+  */
+  void SetRegionOfInterest(const std::string& image_name, int x, int y, int width, int height);
+
+  /*!
+      Clears the region of interest of an image. The full image will be sent.
+      @param image_name The name of the image.
+  */
+  void ClearRegionOfInterest(const std::string& image_name);
+
+  /*!
+      Sets the priority of an image. Images of different priorities share the connection by weight, and large
+      images are sent in chunks so that a high priority image never waits for a background image in progress.
+      Images of the same priority are sent in call order. Images are sent whole, in call order, while no
+      priority is set.
+
+      @param image_name The name of the image.
+      @param priority   IMAGE_PRIORITY_NORMAL clears the priority.
+  */
+  void SetImagePriority(const std::string& image_name, ImagePriority priority);
+
+  /*!
+      Sends an image raw data to PicoPixel. PixelPrintf may be called from any thread. The data is copied
+      before the function returns and sent by a background thread.
 
       @param image_info     Structure holding the information of the image to send.
       @param data           The image raw data.
 
-      @return Returns true is the pixel data was sent successfully.
+      @return Returns true is the pixel data was queued successfully.
   */
   bool PixelPrintf(const ImageInfo& image_info, char* data);
 
@@ -127,7 +679,7 @@ public:
 
       @return Returns true is the pixel data was sent successfully.
   */
-  bool PixelPrintf(std::string image_name,
+  bool PixelPrintf(const std::string& image_name,
     PixelFormat pixel_format,
     int width,
     int height,
@@ -146,6 +698,47 @@ public:
   */
   bool PixelPrintf(int marker_index, const ImageInfo& image_info, char* data);
 
+  /*!
+      Registers an image name. Images sent with the returned ID carry the ID instead of the name: the name is
+      sent once per connection, before the first image that uses it. Registering a name again returns the
+      same ID. Register names once, outside of the per frame code.
+
+      @param image_name     The name of the image.
+      @return The ID of the name. Its id is 0 if the name is empty or too many names are registered.
+  */
+  ImageNameId RegisterImageName(const std::string& image_name);
+
+  /*!
+      Sends an image raw data to PicoPixel under a registered name. No string is built or sent per image.
+
+      @param image_name     ID returned by RegisterImageName.
+      @param pixel_format   Pixel format of the image.
+      @param width          Image width.
+      @param height         Image height.
+      @param pitch          Image pitch. This is the number of bytes from one pixel in the image to the pixel just below.
+      @param data           The image raw data.
+
+      @return Returns true is the pixel data was queued successfully.
+  */
+  bool PixelPrintf(ImageNameId image_name,
+    PixelFormat pixel_format,
+    int width,
+    int height,
+    int pitch,
+    BOOL srgb,
+    BOOL upside_down,
+    char* data);
+
+  bool PixelPrintf(int marker_index,
+    ImageNameId image_name,
+    PixelFormat pixel_format,
+    int width,
+    int height,
+    int pitch,
+    BOOL srgb,
+    BOOL upside_down,
+    char* data);
+
   /*!
       Sends an image raw data to PicoPixel.
 
@@ -160,7 +753,7 @@ public:
       @return Returns true is the pixel data was sent successfully.
   */
   bool PixelPrintf(int marker_index,
-    std::string image_name,
+    const std::string& image_name,
     PixelFormat pixel_format,
     int width,
     int height,
@@ -169,15 +762,257 @@ public:
     BOOL upside_down,
     char* data);
 
+  /*!
+      Sends an image stored in a file, such as a raw dump or the payload of a DDS file. The file data is sent
+      by the operating system straight from the file system cache, it is never copied into a buffer of the
+      program. Regions of interest and half float packing are not applied.
+
+      @param path           Path of the file.
+      @param offset         Offset in bytes of the first pixel in the file.
+      @param image_info     Structure holding the information of the image. The file name is used when
+                            image_name is empty.
+
+      @return Returns true is the pixel data was sent successfully.
+  */
+  bool PixelPrintfFile(const std::string& path, UINT64 offset, const ImageInfo& image_info);
+  bool PixelPrintfFile(int marker_index, const std::string& path, UINT64 offset, const ImageInfo& image_info);
+
+  /*!
+      Sends statistics of an image instead of its pixels: per channel min, max and mean, the number of NaN and
+      infinite values and a 256 bins histogram. This is about a kilobyte whatever the size of the image,
+      cheap enough to be sent every frame. The statistics are computed in parallel.
+
+      @param image_info     Structure holding the information of the image.
+      @param data           The image raw data.
+
+      @return Returns true is the summary was sent successfully.
+  */
+  bool PixelPrintfSummary(const ImageInfo& image_info, char* data);
+
+  /*!
+      Sends statistics of an image every time, and the full image when the marker is armed.
+
+      @param marker_index   Data marker for the full image.
+      @param image_info     Structure holding the information of the image.
+      @param data           The image raw data.
+
+      @return Returns true is the summary was sent successfully.
+  */
+  bool PixelPrintfSummary(int marker_index, const ImageInfo& image_info, char* data);
+
+  /*!
+      Sets the range of values covered by the summary histogram. Default is [0, 1].
+  */
+  void SetSummaryHistogramRange(float min, float max);
+
+  /*!
+      Sends an image only when it differs from a golden image: a regression check that costs no bandwidth
+      while the output is right. The comparison runs in parallel. When more pixels than allowed differ by more
+      than the tolerance, the image is sent with a heat map of the differences, named after the image with
+      " difference" appended: black where the pixels match, red to yellow up to the largest difference.
+
+      @param marker_index   Data marker the image goes through. It is triggered only when the image differs.
+      @param image_info     Structure holding the information of the image.
+      @param data           The image raw data.
+      @param golden         The golden image, with the format, size and pitch of image_info.
+      @param difference     Receives the result of the comparison. May be NULL.
+
+      @return Returns true if the image differs and was sent.
+  */
+  bool PixelPrintfIfDifferent(int marker_index, const ImageInfo& image_info, char* data, const char* golden,
+    ImageDifference* difference = NULL);
+
+  /*!
+      Same as above, the golden image is read from a file.
+
+      @param golden_path    Path of the file holding the golden image.
+      @param offset         Offset in bytes of the first pixel in the file.
+  */
+  bool PixelPrintfIfDifferent(int marker_index, const ImageInfo& image_info, char* data,
+    const std::string& golden_path, UINT64 offset, ImageDifference* difference = NULL);
+
+  /*!
+      Sets when PixelPrintfIfDifferent considers images different. Default is any difference at all.
+
+      @param tolerance              Largest channel difference of matching pixels. 8-bit channels are in [0, 1].
+      @param max_different_pixels   Number of pixels over the tolerance still considered a match.
+  */
+  void SetGoldenComparison(float tolerance, unsigned int max_different_pixels);
+
+  /*!
+      Sends the pixels of a view. They are read straight from the buffer, no packed copy is needed. A single
+      channel is sent as PIXEL_FORMAT_R8, PIXEL_FORMAT_R16F, PIXEL_FORMAT_R32F or PIXEL_FORMAT_DEPTH. Pixels that
+      are not packed, or a single channel, are sent as they are, without half float packing or block compression.
+
+      @param image_name     The name of the image.
+      @param view           Where the pixels are.
+
+      @return Returns true is the image was queued successfully.
+  */
+  bool PixelPrintfView(const std::string& image_name, const ImageView& view);
+  bool PixelPrintfView(int marker_index, const std::string& image_name, const ImageView& view);
+
+  /*!
+      Sends a whole texture in one package: its mip chain, array layers, cube faces and volume slices. Pico Pixel
+      shows it as a single texture.
+
+      @param texture_info   Structure holding the information of the texture.
+      @param subresources   mip_count * array_size subresources (times 6 for cubemaps), mip first:
+                            subresources[mip + mip_count * (face + face_count * array_layer)].
+                            The size of mip 'm' is max(1, size >> m) in each dimension.
+
+      @return Returns true is the texture was queued successfully.
+  */
+  bool PixelPrintfTexture(const TextureInfo& texture_info, const Subresource* subresources);
+  bool PixelPrintfTexture(int marker_index, const TextureInfo& texture_info, const Subresource* subresources);
+
+  /*!
+      Sends typed image data to PicoPixel. The pitch is derived from the pixel type so it can't disagree with
+      the format:
+
+        PixelPrintf<PicoPixelClient::PIXEL_FORMAT_RGBA8>("albedo", rgba_pixels, 400, 300, 400, FALSE, FALSE);
+
+      @param image_name     The name of the image. It will be displayed in PicoPixel title bar.
+      @param pixels         The pixels, row after row.
+      @param width          Image width.
+      @param height         Image height.
+      @param row_length     Number of pixels from one row to the next (>= width).
+
+      @return Returns true is the pixel data was queued successfully.
+  */
+  template <PixelFormat Format>
+  bool PixelPrintf(const std::string& image_name,
+    const typename PixelFormatTraits<Format>::PixelType* pixels,
+    int width,
+    int height,
+    int row_length,
+    BOOL srgb,
+    BOOL upside_down);
+
+  template <PixelFormat Format>
+  bool PixelPrintf(int marker_index,
+    const std::string& image_name,
+    const typename PixelFormatTraits<Format>::PixelType* pixels,
+    int width,
+    int height,
+    int row_length,
+    BOOL srgb,
+    BOOL upside_down);
+
 #ifdef PICO_PIXEL_CLIENT_OPENGL
   // Experimental
-  bool PixelPrintfGLColorBuffer(int marker_index, std::string image_name, BOOL upside_down);
-  bool PixelPrintfGLDepthBuffer(int marker_index, std::string image_name, BOOL upside_down);
+  bool PixelPrintfGLColorBuffer(int marker_index, const std::string& image_name, BOOL upside_down);
+  bool PixelPrintfGLDepthBuffer(int marker_index, const std::string& image_name, BOOL upside_down);
 #endif
 
 private:
   struct Impl;
   Impl* impl_;
+
+  PicoPixelClient(const PicoPixelClient&);
+  PicoPixelClient& operator=(const PicoPixelClient&);
 };
 
+// The pixel type comes last as it may contain commas.
+#define PICO_PIXEL_FORMAT_TRAITS(format, channel_type, channels, alpha, float_format, packed, srgb, layout, ...) \
+  template <> \
+  struct PicoPixelClient::PixelFormatTraits<PicoPixelClient::format> \
+  { \
+    typedef __VA_ARGS__ PixelType; \
+    typedef channel_type ChannelType; \
+    static const int bytes_per_pixel = sizeof(PixelType); \
+    static const int channel_count = channels; \
+    static const int alpha_channel = alpha; \
+    static const bool is_float = float_format; \
+    static const bool is_packed = packed; \
+    static const bool srgb_capable = srgb; \
+    static const char* Layout() { return layout; } \
+  };
+
+PICO_PIXEL_FORMAT_TRAITS(PIXEL_FORMAT_RGBA8,      unsigned char,  4, 3,  false, false, true,  "RGBA", unsigned int)
+PICO_PIXEL_FORMAT_TRAITS(PIXEL_FORMAT_BGRA8,      unsigned char,  4, 3,  false, false, true,  "BGRA", unsigned int)
+PICO_PIXEL_FORMAT_TRAITS(PIXEL_FORMAT_ARGB8,      unsigned char,  4, 0,  false, false, true,  "ARGB", unsigned int)
+PICO_PIXEL_FORMAT_TRAITS(PIXEL_FORMAT_ABGR8,      unsigned char,  4, 0,  false, false, true,  "ABGR", unsigned int)
+PICO_PIXEL_FORMAT_TRAITS(PIXEL_FORMAT_RGB8,       unsigned char,  3, -1, false, false, true,  "RGB",  PicoPixelClient::PixelChannels<unsigned char, 3>)
+PICO_PIXEL_FORMAT_TRAITS(PIXEL_FORMAT_BGR8,       unsigned char,  3, -1, false, false, true,  "BGR",  PicoPixelClient::PixelChannels<unsigned char, 3>)
+PICO_PIXEL_FORMAT_TRAITS(PIXEL_FORMAT_R5G6B5,     unsigned short, 3, -1, false, true,  false, "RGB",  unsigned short)
+PICO_PIXEL_FORMAT_TRAITS(PIXEL_FORMAT_DEPTH,      float,          1, -1, true,  false, false, "D",    float)
+PICO_PIXEL_FORMAT_TRAITS(PIXEL_FORMAT_R16F,       unsigned short, 1, -1, true,  false, false, "R",    unsigned short)
+PICO_PIXEL_FORMAT_TRAITS(PIXEL_FORMAT_RG16F,      unsigned short, 2, -1, true,  false, false, "RG",   PicoPixelClient::PixelChannels<unsigned short, 2>)
+PICO_PIXEL_FORMAT_TRAITS(PIXEL_FORMAT_RGB16F,     unsigned short, 3, -1, true,  false, false, "RGB",  PicoPixelClient::PixelChannels<unsigned short, 3>)
+PICO_PIXEL_FORMAT_TRAITS(PIXEL_FORMAT_RGBA16F,    unsigned short, 4, 3,  true,  false, false, "RGBA", PicoPixelClient::PixelChannels<unsigned short, 4>)
+PICO_PIXEL_FORMAT_TRAITS(PIXEL_FORMAT_R32F,       float,          1, -1, true,  false, false, "R",    float)
+PICO_PIXEL_FORMAT_TRAITS(PIXEL_FORMAT_RG32F,      float,          2, -1, true,  false, false, "RG",   PicoPixelClient::PixelChannels<float, 2>)
+PICO_PIXEL_FORMAT_TRAITS(PIXEL_FORMAT_RGB32F,     float,          3, -1, true,  false, false, "RGB",  PicoPixelClient::PixelChannels<float, 3>)
+PICO_PIXEL_FORMAT_TRAITS(PIXEL_FORMAT_RGBA32F,    float,          4, 3,  true,  false, false, "RGBA", PicoPixelClient::PixelChannels<float, 4>)
+PICO_PIXEL_FORMAT_TRAITS(PIXEL_FORMAT_R11G11B10F, unsigned int,   3, -1, true,  true,  false, "RGB",  unsigned int)
+PICO_PIXEL_FORMAT_TRAITS(PIXEL_FORMAT_R8,         unsigned char,  1, -1, false, false, false, "R",    unsigned char)
+
+#undef PICO_PIXEL_FORMAT_TRAITS
+
+template <PicoPixelClient::PixelFormat Format>
+bool PicoPixelClient::PixelPrintf(const std::string& image_name,
+                                  const typename PixelFormatTraits<Format>::PixelType* pixels,
+                                  int width,
+                                  int height,
+                                  int row_length,
+                                  BOOL srgb,
+                                  BOOL upside_down)
+{
+  typedef PixelFormatTraits<Format> Traits;
+  static_assert(sizeof(typename Traits::PixelType) == Traits::bytes_per_pixel, "PixelType does not match the pixel size");
+
+  if (srgb && !Traits::srgb_capable)
+    return false;
+
+  if (row_length < width)
+    return false;
+
+  return PixelPrintf(image_name,
+    Format,
+    width,
+    height,
+    row_length * Traits::bytes_per_pixel,
+    srgb,
+    upside_down,
+    (char*)pixels);
+}
+
+template <PicoPixelClient::PixelFormat Format>
+bool PicoPixelClient::PixelPrintf(int marker_index,
+                                  const std::string& image_name,
+                                  const typename PixelFormatTraits<Format>::PixelType* pixels,
+                                  int width,
+                                  int height,
+                                  int row_length,
+                                  BOOL srgb,
+                                  BOOL upside_down)
+{
+  if (!TriggerMarker(marker_index))
+    return false;
+
+  return PixelPrintf<Format>(image_name, pixels, width, height, row_length, srgb, upside_down);
+}
+
+/*!
+    Front end to PixelPrintf for debug hooks that stay in the code. The marker is checked first and the
+    remaining arguments are only evaluated when it fires:
+
+      PICO_PIXEL_PRINTF(pico_pixel_client, marker, image_info, raw_data);
+      PICO_PIXEL_PRINTF(pico_pixel_client, marker, "color-framebuffer", PicoPixelClient::PIXEL_FORMAT_BGR8,
+        400, 300, 1200, FALSE, FALSE, raw_data);
+
+    Define PICO_PIXEL_CLIENT_DISABLE to compile the calls out entirely.
+*/
+#ifdef PICO_PIXEL_CLIENT_DISABLE
+# define PICO_PIXEL_PRINTF(client, marker_index, ...) ((void)0)
+#else
+# define PICO_PIXEL_PRINTF(client, marker_index, ...) \
+  do \
+  { \
+    if ((client).Active() && (client).TriggerMarker(marker_index)) \
+      (client).PixelPrintf(__VA_ARGS__); \
+  } while (0)
+#endif
+
 #endif PICO_PIXEL_CLIENT_H
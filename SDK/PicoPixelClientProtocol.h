@@ -11,6 +11,32 @@ enum PackageType
   PACKAGE_TYPE_CLIENT_HANDSHAKE,
   PACKAGE_TYPE_IMAGE,
   PACKAGE_TYPE_MARKER,
+  PACKAGE_TYPE_REGION_OF_INTEREST,
+  PACKAGE_TYPE_IMAGE_SUMMARY,
+  PACKAGE_TYPE_IMAGE_ACK,
+  PACKAGE_TYPE_FLOW_CONTROL_REQUEST,
+  PACKAGE_TYPE_FLOW_CREDIT,
+  PACKAGE_TYPE_TEXTURE,
+  PACKAGE_TYPE_IMAGE_NAME,
+  PACKAGE_TYPE_CHUNK,
+  PACKAGE_TYPE_FLIGHT_RECORDER_DUMP,
+  PACKAGE_TYPE_RELAY_CLIENT,
+  PACKAGE_TYPE_RELAY_DATA,
+  PACKAGE_TYPE_VIEWER_HANDSHAKE,
+};
+
+// Highest protocol version of this SDK. Version 1 is the protocol of the first Pico Pixel viewers. Version 2 adds
+// the PixelInfoHeader extensions.
+static const int PICO_PIXEL_PROTOCOL_VERSION = 2;
+
+static const int PICO_PIXEL_SUMMARY_HISTOGRAM_SIZE = 256;
+
+// Optional blocks following a version 2 PixelInfoHeader. They are sent in the order of their bit.
+enum PixelInfoExtension
+{
+  PIXEL_INFO_EXTENSION_REGION  = 1 << 0, // PixelRegionExtension
+  PIXEL_INFO_EXTENSION_TIMING  = 1 << 1, // PixelTimingExtension
+  PIXEL_INFO_EXTENSION_NAME_ID = 1 << 2, // PixelNameIdExtension
 };
 
 #pragma pack(push, 4)
@@ -40,14 +66,68 @@ struct HandShakeHeader: PixelPrintfProtocol
   }
 };
 
+// Optional packages a viewer reads, advertised in its ViewerHandShakeHeader.
+enum ViewerFeature
+{
+  VIEWER_FEATURE_RELAY    = 0x1,  // RelayClientHeader and RelayDataHeader packages.
+};
+
+// Sent by a viewer that reads protocol versions above 1, in answer to the client's HandShakeHeader. Clients send
+// version 1 packages until it arrives, so viewers that never send it keep working.
+struct ViewerHandShakeHeader: PixelPrintfProtocol
+{
+  int     protocol_version; // Highest protocol version the viewer reads.
+  int     features;         // ViewerFeature flags.
+
+  ViewerHandShakeHeader()
+  {
+    payload_type = PackageType::PACKAGE_TYPE_VIEWER_HANDSHAKE;
+    protocol_version = PICO_PIXEL_PROTOCOL_VERSION;
+    features = 0;
+  }
+};
+
+// Sent by the client right after the HandShakeHeader when it wants flow control. Pico Pixel answers with a
+// FlowCreditHeader granting the initial window. Until the first grant arrives the client sends freely, so
+// versions of Pico Pixel that ignore the request keep working.
+struct FlowControlRequestHeader: PixelPrintfProtocol
+{
+  int     max_images;       // Images the client would like in flight. 0 for no image limit.
+  INT64   max_bytes;        // Bytes the client would like in flight. 0 for no byte limit.
+
+  FlowControlRequestHeader()
+  {
+    payload_type = PackageType::PACKAGE_TYPE_FLOW_CONTROL_REQUEST;
+    max_images = 0;
+    max_bytes = 0;
+  }
+};
+
+// Sent by Pico Pixel to the client. Adds credits to the client's window, typically one image and its size
+// each time Pico Pixel is done with an image. Each image package consumes one image credit and its size in
+// byte credits. A limit applies once credits have been granted for it.
+struct FlowCreditHeader: PixelPrintfProtocol
+{
+  int     images;
+  INT64   bytes;
+
+  FlowCreditHeader()
+  {
+    payload_type = PackageType::PACKAGE_TYPE_FLOW_CREDIT;
+    images = 0;
+    bytes = 0;
+  }
+};
+
 struct PixelInfoHeader: PixelPrintfProtocol
 {
   int     width;
   int     height;
   int     pitch;
-  int     pixel_format;
+  int     pixel_format; // PicoPixelClient::PixelFormat. 16-bit and 32-bit float formats are little endian IEEE 754.
   BOOL    srgb;
   BOOL    upside_down;
+  int     extensions;   // PixelInfoExtension flags. Only on the wire when picoversion is 2.
 
   PixelInfoHeader()
   {
@@ -58,10 +138,308 @@ struct PixelInfoHeader: PixelPrintfProtocol
     pixel_format = 0;
     srgb = FALSE;
     upside_down = FALSE;
+    extensions = 0;
   }
-  // [image 0 name size]    (4 bytes)
+  // [extension blocks]     (see PixelInfoExtension) version 2 only
+  // [image 0 name size]    (4 bytes) 0 with PIXEL_INFO_EXTENSION_NAME_ID
   // [image name]           (size bytes)
-  // [image raw data]       (size bytes)
+  // [image raw data]       (pitch * PixelInfoRowCount(pixel_format, height) bytes)
+};
+
+// Size of a PixelInfoHeader on the wire. Version 1 headers end before 'extensions'.
+inline int PixelInfoHeaderSize(int picoversion)
+{
+  return (picoversion >= 2) ? (int)sizeof(PixelInfoHeader) : (int)(sizeof(PixelInfoHeader) - sizeof(int));
+}
+
+// PicoPixelClient::PIXEL_FORMAT_BC1, PIXEL_FORMAT_BC3 and PIXEL_FORMAT_BC7 are made of 4x4 blocks. Their pitch is
+// the size of a row of blocks.
+static const int PICO_PIXEL_FORMAT_BC1 = 18;
+static const int PICO_PIXEL_FORMAT_BC3 = 19;
+static const int PICO_PIXEL_FORMAT_BC7 = 20;
+
+// Number of rows of pitch bytes in the data of an image.
+inline int PixelInfoRowCount(int pixel_format, int height)
+{
+  if ((pixel_format >= PICO_PIXEL_FORMAT_BC1) && (pixel_format <= PICO_PIXEL_FORMAT_BC7))
+    return (height + 3) / 4;
+
+  return height;
+}
+
+static const int PICO_PIXEL_TEXTURE_MAX_MIPS       = 32;
+static const int PICO_PIXEL_TEXTURE_MAX_ARRAY_SIZE = 2048;
+
+// A whole texture in one package: every mip level of every array layer and cube face, or of every slice
+// of a volume.
+struct TextureInfoHeader: PixelPrintfProtocol
+{
+  int     width;              // Size of mip 0.
+  int     height;
+  int     depth;              // 1 unless the texture is a volume.
+  int     mip_count;
+  int     array_size;
+  int     face_count;         // 6 for cubemaps, 1 otherwise.
+  int     pixel_format;       // PicoPixelClient::PixelFormat
+  BOOL    srgb;
+  BOOL    upside_down;
+  int     subresource_count;  // mip_count * face_count * array_size
+
+  TextureInfoHeader()
+  {
+    payload_type = PackageType::PACKAGE_TYPE_TEXTURE;
+    width = 0;
+    height = 0;
+    depth = 1;
+    mip_count = 1;
+    array_size = 1;
+    face_count = 1;
+    pixel_format = 0;
+    srgb = FALSE;
+    upside_down = FALSE;
+    subresource_count = 0;
+  }
+  // [texture name size]                  (4 bytes)
+  // [texture name string + null char]    (name size bytes)
+  // [subresource 0]                      (TextureSubresourceEntry)
+  // [subresource 1]                      (TextureSubresourceEntry)
+  // .
+  // .
+  // [texture raw data]                   (sum of the subresource sizes)
+};
+
+// Location of one subresource in the texture raw data. Subresources are listed mip first:
+// index = mip + mip_count * (face + face_count * array_layer). Rows and slices are tightly packed.
+struct TextureSubresourceEntry
+{
+  int     mip;
+  int     array_layer;
+  int     face;               // D3D cube face order: +X, -X, +Y, -Y, +Z, -Z.
+  int     width;
+  int     height;
+  int     depth;
+  int     pitch;              // Bytes per row.
+  int     slice_pitch;        // Bytes per depth slice.
+  UINT64  offset;             // From the start of the texture raw data.
+  UINT64  size;
+
+  TextureSubresourceEntry()
+  {
+    mip = 0;
+    array_layer = 0;
+    face = 0;
+    width = 0;
+    height = 0;
+    depth = 0;
+    pitch = 0;
+    slice_pitch = 0;
+    offset = 0;
+    size = 0;
+  }
+};
+
+// The image data is a sub-rectangle of a larger image. width and height in PixelInfoHeader are the size
+// of the region.
+struct PixelRegionExtension
+{
+  int x;
+  int y;
+  int full_width;
+  int full_height;
+
+  PixelRegionExtension()
+  {
+    x = 0;
+    y = 0;
+    full_width = 0;
+    full_height = 0;
+  }
+};
+
+// Sent when the client traces latencies. Pico Pixel may answer with an ImageAckHeader carrying the sequence
+// number once the image has been received.
+struct PixelTimingExtension
+{
+  UINT64  sequence;         // Increases by one for each traced image of a client. Starts at 1.
+  UINT64  capture_time_us;  // Client monotonic clock, in microseconds, when the image was handed to the SDK.
+  int     frame;            // PicoPixelClient::Frame() when the image was handed to the SDK.
+
+  PixelTimingExtension()
+  {
+    sequence = 0;
+    capture_time_us = 0;
+    frame = 0;
+  }
+};
+
+// The image is named by an ID registered with an ImageNameHeader on the same connection. The name that follows
+// the extensions is empty.
+struct PixelNameIdExtension
+{
+  unsigned int name_id;
+
+  PixelNameIdExtension()
+  {
+    name_id = 0;
+  }
+};
+
+// Registers an image name once per connection. Images then refer to it with a PixelNameIdExtension.
+// IDs are chosen by the client and are never 0.
+struct ImageNameHeader: PixelPrintfProtocol
+{
+  unsigned int name_id;
+
+  ImageNameHeader()
+  {
+    payload_type = PackageType::PACKAGE_TYPE_IMAGE_NAME;
+    name_id = 0;
+  }
+  // [image name size]                  (4 bytes)
+  // [image name string + null char]    (name size bytes)
+};
+
+// A piece of a package sent interleaved with other packages. The chunks of a stream are concatenated in
+// order and the package they form is handled when the last chunk arrives. Packages that are not chunked
+// may come between two chunks of a stream.
+struct PackageChunkHeader: PixelPrintfProtocol
+{
+  unsigned int stream_id;   // Chosen by the client, unique among the streams in progress.
+  int          last;        // 1 on the last chunk of the package.
+  INT64        size;        // Bytes following the header.
+
+  PackageChunkHeader()
+  {
+    payload_type = PackageType::PACKAGE_TYPE_CHUNK;
+    stream_id = 0;
+    last = 0;
+    size = 0;
+  }
+  // [package bytes]        (size bytes)
+};
+
+// Sent by a relay when one of its clients connects or disconnects. A relay forwards the connections of the
+// processes of a machine over its own connection: the bytes of each client, starting with its hand shake,
+// follow in RelayDataHeader packages. A relay only sends them to a viewer whose ViewerHandShakeHeader has
+// VIEWER_FEATURE_RELAY.
+struct RelayClientHeader: PixelPrintfProtocol
+{
+  int      client;          // Chosen by the relay, unique among its connected clients.
+  int      connected;       // 1 when the client connects, 0 when it disconnects.
+
+  RelayClientHeader()
+  {
+    payload_type = PackageType::PACKAGE_TYPE_RELAY_CLIENT;
+    client = 0;
+    connected = 0;
+  }
+  // [client id size]       (4 bytes)
+  // [client id + null char](size bytes)
+};
+
+// Bytes of a relayed connection, in either direction: from a client to Pico Pixel, or from Pico Pixel to a
+// client. They are a slice of the byte stream of the connection and do not follow package boundaries.
+struct RelayDataHeader: PixelPrintfProtocol
+{
+  int      client;
+  int      size;            // Bytes following the header.
+
+  RelayDataHeader()
+  {
+    payload_type = PackageType::PACKAGE_TYPE_RELAY_DATA;
+    client = 0;
+    size = 0;
+  }
+};
+
+// Sent by Pico Pixel to the client when an image with a PixelTimingExtension has been received.
+struct ImageAckHeader: PixelPrintfProtocol
+{
+  UINT64  sequence;         // PixelTimingExtension::sequence of the image.
+
+  ImageAckHeader()
+  {
+    payload_type = PackageType::PACKAGE_TYPE_IMAGE_ACK;
+    sequence = 0;
+  }
+};
+
+// Sent by Pico Pixel to the client. Asks the client to send the images kept by its flight recorder.
+struct FlightRecorderDumpHeader: PixelPrintfProtocol
+{
+  int      frame_count;     // Most recent frames to send. 0 sends every frame kept.
+
+  FlightRecorderDumpHeader()
+  {
+    payload_type = PackageType::PACKAGE_TYPE_FLIGHT_RECORDER_DUMP;
+    frame_count = 0;
+  }
+};
+
+// Sent by Pico Pixel to the client. Asks the client to only send a region of the named image.
+// A width or height of 0 clears the region and the full image is sent again.
+struct RegionOfInterestHeader: PixelPrintfProtocol
+{
+  int x;
+  int y;
+  int width;
+  int height;
+  RegionOfInterestHeader()
+  {
+    payload_type = PackageType::PACKAGE_TYPE_REGION_OF_INTEREST;
+    x = 0;
+    y = 0;
+    width = 0;
+    height = 0;
+  }
+  // [image name size]                  (4 bytes)
+  // [image name string + null char]    (name size bytes)
+};
+
+// Statistics of an image, sent instead of its pixels. Channels are in the memory order of pixel_format.
+// 8-bit and R5G6B5 channels are normalized to [0, 1]. NaN and infinite values are counted but are not part
+// of min, max, mean and the histogram.
+// The histogram counts the mean of the color channels (alpha excluded) of each pixel. Bins cover
+// [histogram_min, histogram_max]. Values outside of that range go into the first or last bin.
+struct ImageSummaryHeader: PixelPrintfProtocol
+{
+  int           width;
+  int           height;
+  int           pixel_format;
+  int           channel_count;
+  float         min[4];
+  float         max[4];
+  float         mean[4];
+  unsigned int  nan_count;
+  unsigned int  inf_count;
+  float         histogram_min;
+  float         histogram_max;
+  unsigned int  histogram[PICO_PIXEL_SUMMARY_HISTOGRAM_SIZE];
+
+  ImageSummaryHeader()
+  {
+    payload_type = PackageType::PACKAGE_TYPE_IMAGE_SUMMARY;
+    width = 0;
+    height = 0;
+    pixel_format = 0;
+    channel_count = 0;
+    for (int i = 0; i < 4; ++i)
+    {
+      min[i] = 0.0f;
+      max[i] = 0.0f;
+      mean[i] = 0.0f;
+    }
+    nan_count = 0;
+    inf_count = 0;
+    histogram_min = 0.0f;
+    histogram_max = 1.0f;
+    for (int i = 0; i < PICO_PIXEL_SUMMARY_HISTOGRAM_SIZE; ++i)
+    {
+      histogram[i] = 0;
+    }
+  }
+  // [image name size]                  (4 bytes)
+  // [image name string + null char]    (name size bytes)
 };
 
 struct MarkerDataHeader: PixelPrintfProtocol
@@ -99,6 +477,10 @@ struct MarkerDataHeader: PixelPrintfProtocol
 // is decremented by 1.
 // When a marker use_count reach zero, the marker can no longer be use to send data to Pico Pixel. Its use_count has
 // to be reloaded before it can be used again.
+// A marker may also have a trigger policy: fire every Nth use, at most once per time interval, within a range
+// of frames, or once when a condition is met. The policy is checked together with the use_count.
+// On the client, markers named like paths belong to groups. Arming a group stamps it with a generation; a marker
+// takes the use_count of the newest stamp of its groups if it is newer than group_generation_.
 
 struct Marker
 {
@@ -109,6 +491,9 @@ struct Marker
     use_count_ = use_count;
     hex_color_ = hex_color;
     use_count_pico_pixel_update_ = -1;
+    group_ = -1;
+    group_generation_ = 0;
+    ClearTrigger();
   }
 
   Marker(int index, std::string name, int use_count)
@@ -118,6 +503,9 @@ struct Marker
     use_count_ = use_count;
     hex_color_ = PICO_PIXEL_MARKER_COLOR;
     use_count_pico_pixel_update_ = -1;
+    group_ = -1;
+    group_generation_ = 0;
+    ClearTrigger();
   }
 
   Marker()
@@ -125,6 +513,9 @@ struct Marker
     index_ = -1;
     use_count_ = 0;
     use_count_pico_pixel_update_ = -1;
+    group_ = -1;
+    group_generation_ = 0;
+    ClearTrigger();
   }
 
   void SetTriggerCount(int count)
@@ -139,17 +530,120 @@ struct Marker
 
   int DecrementTriggerCount()
   {
-    if (use_count_ == 0)
+    if (use_count_ <= 0)
+      return 0;
+
+    LONG count = InterlockedDecrement(&use_count_);
+    if (count < 0)
+    {
+      InterlockedIncrement(&use_count_);
       return 0;
+    }
+    return count;
+  }
 
-    return --use_count_;
+  void ClearTrigger()
+  {
+    trigger_every_nth_ = 0;
+    trigger_min_interval_ms_ = 0;
+    trigger_first_frame_ = -1;
+    trigger_last_frame_ = -1;
+    trigger_one_shot_ = false;
+    trigger_ignore_use_count_ = false;
+    trigger_condition_ = NULL;
+    trigger_condition_data_ = NULL;
+    trigger_call_count_ = 0;
+    trigger_last_time_ = 0;
+    trigger_fired_ = 0;
+  }
+
+  // Decides whether a call using this marker sends its data. Every step is a bounded number of
+  // interlocked operations so many threads may use the same marker.
+  bool Trigger(int frame)
+  {
+    if ((trigger_first_frame_ >= 0) && (frame < trigger_first_frame_))
+      return false;
+
+    if ((trigger_last_frame_ >= 0) && (frame > trigger_last_frame_))
+      return false;
+
+    if (trigger_one_shot_ && trigger_fired_)
+      return false;
+
+    if (!trigger_ignore_use_count_ && (use_count_ <= 0))
+      return false;
+
+    if ((trigger_condition_ != NULL) && !trigger_condition_(trigger_condition_data_))
+      return false;
+
+    if (trigger_every_nth_ > 1)
+    {
+      LONG call = InterlockedIncrement(&trigger_call_count_) - 1;
+      if (call % trigger_every_nth_ != 0)
+        return false;
+    }
+
+    // Claims are made in this order and given back when a later step refuses, so a call that does not fire
+    // neither spends the one-shot, nor a use, nor the interval.
+    if (trigger_one_shot_ && (InterlockedExchange(&trigger_fired_, 1) != 0))
+      return false;
+
+    if (!trigger_ignore_use_count_)
+    {
+      if (InterlockedDecrement(&use_count_) < 0)
+      {
+        InterlockedIncrement(&use_count_);
+        ReleaseTriggerClaims(false);
+        return false;
+      }
+    }
+
+    if (trigger_min_interval_ms_ > 0)
+    {
+      LONG now = (LONG)GetTickCount();
+      LONG last = trigger_last_time_;
+
+      // Too early, or another thread fired in the meantime.
+      if (((DWORD)(now - last) < trigger_min_interval_ms_) ||
+          (InterlockedCompareExchange(&trigger_last_time_, now, last) != last))
+      {
+        ReleaseTriggerClaims(!trigger_ignore_use_count_);
+        return false;
+      }
+    }
+
+    return true;
+  }
+
+  // Gives back the one-shot and, if 'use' is true, the use claimed by a call of Trigger that does not fire.
+  void ReleaseTriggerClaims(bool use)
+  {
+    if (use)
+      InterlockedIncrement(&use_count_);
+
+    if (trigger_one_shot_)
+      InterlockedExchange(&trigger_fired_, 0);
   }
 
   int index_;
-  int use_count_;
+  volatile LONG use_count_;
   int use_count_pico_pixel_update_;
   unsigned int hex_color_; //!< Color to be display in Pico Pixel interface
   std::string name_;
+  int group_;                             //!< Innermost group of the marker, -1 for none. Client side only.
+  volatile LONG group_generation_;        //!< Generation of the last use count set, by a group or on the marker.
+
+  int trigger_every_nth_;                 //!< Fire on every Nth use. 0 or 1 fires on every use.
+  unsigned int trigger_min_interval_ms_;  //!< Minimum time between two fires. 0 disables.
+  int trigger_first_frame_;               //!< First frame the marker can fire on. -1 disables.
+  int trigger_last_frame_;                //!< Last frame the marker can fire on. -1 disables.
+  bool trigger_one_shot_;                 //!< Fire once, until the trigger is set again.
+  bool trigger_ignore_use_count_;         //!< Fire without consuming the use_count.
+  bool (*trigger_condition_)(void* data); //!< Fire only when the condition returns true.
+  void* trigger_condition_data_;
+  volatile LONG trigger_call_count_;
+  volatile LONG trigger_last_time_;
+  volatile LONG trigger_fired_;
 };
 #pragma pack(pop)
 
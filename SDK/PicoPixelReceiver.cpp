@@ -0,0 +1,1195 @@
+#include "PicoPixelReceiver.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#if WIN32
+# define PIXEL_RECEIVER_SEND_FLAGS 0
+#else
+# include <pthread.h>
+# include <sys/socket.h>
+# include <netinet/in.h>
+# include <netinet/tcp.h>
+# include <unistd.h>
+# include <time.h>
+# define closesocket close
+# define SD_BOTH SHUT_RDWR
+# define PIXEL_RECEIVER_SEND_FLAGS MSG_NOSIGNAL
+
+unsigned int GetTickCount()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (unsigned int)(now.tv_sec * 1000 + now.tv_nsec / 1000000);
+}
+#endif
+
+static const int PIXEL_RECEIVER_MAX_NAME_SIZE   = 4096;
+static const int PIXEL_RECEIVER_MAX_MARKERS     = 4096;
+static const int PIXEL_RECEIVER_MAX_IMAGE_NAMES = 65536;
+static const int PIXEL_RECEIVER_MAX_FREE_BUFFERS = 16;
+static const int PIXEL_RECEIVER_MAX_CHUNK_STREAMS = 16;
+static const int PIXEL_RECEIVER_RECV_CHUNK      = 1024 * 1024 * 1024;
+static const int PIXEL_RECEIVER_MAX_PIPE_SIZE   = 64 * 1024 * 1024;   // Bytes buffered for a relayed client
+static const UINT64 PIXEL_RECEIVER_MAX_PAYLOAD = (UINT64)16 * 1024 * 1024 * 1024;
+
+// Thin layer over the threads and locks of the platform.
+#if WIN32
+class ReceiverLock
+{
+public:
+  ReceiverLock()  { InitializeCriticalSection(&lock_); }
+  ~ReceiverLock() { DeleteCriticalSection(&lock_); }
+  void Enter()    { EnterCriticalSection(&lock_); }
+  void Leave()    { LeaveCriticalSection(&lock_); }
+private:
+  CRITICAL_SECTION lock_;
+};
+typedef HANDLE ReceiverThread;
+
+class ReceiverCondition
+{
+public:
+  ReceiverCondition()  { InitializeCriticalSection(&lock_); InitializeConditionVariable(&condition_); }
+  ~ReceiverCondition() { DeleteCriticalSection(&lock_); }
+  void Enter()         { EnterCriticalSection(&lock_); }
+  void Leave()         { LeaveCriticalSection(&lock_); }
+  void Wait()          { SleepConditionVariableCS(&condition_, &lock_, INFINITE); }
+  void WakeAll()       { WakeAllConditionVariable(&condition_); }
+private:
+  CRITICAL_SECTION lock_;
+  CONDITION_VARIABLE condition_;
+};
+#else
+class ReceiverLock
+{
+public:
+  ReceiverLock()  { pthread_mutex_init(&lock_, NULL); }
+  ~ReceiverLock() { pthread_mutex_destroy(&lock_); }
+  void Enter()    { pthread_mutex_lock(&lock_); }
+  void Leave()    { pthread_mutex_unlock(&lock_); }
+private:
+  pthread_mutex_t lock_;
+};
+typedef pthread_t ReceiverThread;
+
+class ReceiverCondition
+{
+public:
+  ReceiverCondition()  { pthread_mutex_init(&lock_, NULL); pthread_cond_init(&condition_, NULL); }
+  ~ReceiverCondition() { pthread_cond_destroy(&condition_); pthread_mutex_destroy(&lock_); }
+  void Enter()         { pthread_mutex_lock(&lock_); }
+  void Leave()         { pthread_mutex_unlock(&lock_); }
+  void Wait()          { pthread_cond_wait(&condition_, &lock_); }
+  void WakeAll()       { pthread_cond_broadcast(&condition_); }
+private:
+  pthread_mutex_t lock_;
+  pthread_cond_t condition_;
+};
+#endif
+
+struct ThreadStart
+{
+  void (*proc)(void* arg);
+  void* arg;
+};
+
+#if WIN32
+static DWORD WINAPI ThreadTrampoline(void* ptr)
+#else
+static void* ThreadTrampoline(void* ptr)
+#endif
+{
+  ThreadStart start = *(ThreadStart*)ptr;
+  delete (ThreadStart*)ptr;
+  start.proc(start.arg);
+  return 0;
+}
+
+static bool StartThread(ReceiverThread& thread, void (*proc)(void* arg), void* arg)
+{
+  ThreadStart* start = new ThreadStart;
+  start->proc = proc;
+  start->arg = arg;
+#if WIN32
+  thread = ::CreateThread(NULL, 0, ThreadTrampoline, start, 0, NULL);
+  bool started = thread != NULL;
+#else
+  bool started = pthread_create(&thread, NULL, ThreadTrampoline, start) == 0;
+#endif
+  if (!started)
+  {
+    delete start;
+  }
+  return started;
+}
+
+static void JoinThread(ReceiverThread& thread)
+{
+#if WIN32
+  WaitForSingleObject(thread, INFINITE);
+  ::CloseHandle(thread);
+#else
+  pthread_join(thread, NULL);
+#endif
+}
+
+static bool RecvAll(SOCKET sock, void* dst, UINT64 size)
+{
+  char* ptr = (char*)dst;
+  while (size > 0)
+  {
+    int chunk = (int)(size < (UINT64)PIXEL_RECEIVER_RECV_CHUNK ? size : PIXEL_RECEIVER_RECV_CHUNK);
+    int ret = recv(sock, ptr, chunk, 0);
+    if (ret <= 0)
+      return false;
+
+    ptr += ret;
+    size -= ret;
+  }
+  return true;
+}
+
+static bool SendAll(SOCKET sock, const char* ptr, size_t size)
+{
+  while (size > 0)
+  {
+    int ret = send(sock, ptr, (int)size, PIXEL_RECEIVER_SEND_FLAGS);
+    if (ret <= 0)
+      return false;
+
+    ptr += ret;
+    size -= ret;
+  }
+  return true;
+}
+
+// Receive buffer recycled between packages and connections.
+struct PooledBuffer
+{
+  char*   data;
+  size_t  capacity;
+
+  PooledBuffer()
+    : data(NULL)
+    , capacity(0)
+  {}
+
+  ~PooledBuffer()
+  {
+    free(data);
+  }
+
+  bool Reserve(size_t size)
+  {
+    if (size <= capacity)
+      return true;
+
+    char* new_data = (char*)realloc(data, size);
+    if (new_data == NULL)
+      return false;
+
+    data = new_data;
+    capacity = size;
+    return true;
+  }
+};
+
+// Byte stream of a client behind a relay. The relay's connection thread writes to it, the client's connection
+// thread reads from it as it would from a socket.
+class ReceiverPipe
+{
+public:
+  ReceiverPipe()
+    : read_offset_(0)
+    , closed_(false)
+  {}
+
+  //! Blocks while the pipe is full. Bytes written after Close are dropped.
+  void Write(const char* data, size_t size)
+  {
+    condition_.Enter();
+    while (!closed_ && (data_.size() - read_offset_ >= (size_t)PIXEL_RECEIVER_MAX_PIPE_SIZE))
+    {
+      condition_.Wait();
+    }
+
+    if (!closed_)
+    {
+      data_.insert(data_.end(), data, data + size);
+      condition_.WakeAll();
+    }
+    condition_.Leave();
+  }
+
+  //! Blocks until 'size' bytes are there. Returns false if the pipe is closed first.
+  bool Read(char* dst, UINT64 size)
+  {
+    condition_.Enter();
+    while (size > 0)
+    {
+      size_t available = data_.size() - read_offset_;
+      if (available == 0)
+      {
+        if (closed_)
+          break;
+
+        condition_.Wait();
+        continue;
+      }
+
+      size_t chunk = (UINT64)available < size ? available : (size_t)size;
+      std::memcpy(dst, &data_[read_offset_], chunk);
+      dst += chunk;
+      size -= chunk;
+      read_offset_ += chunk;
+
+      // Compact once the bytes read are the larger part of the buffer.
+      if (read_offset_ > data_.size() / 2)
+      {
+        data_.erase(data_.begin(), data_.begin() + read_offset_);
+        read_offset_ = 0;
+      }
+      condition_.WakeAll();
+    }
+    condition_.Leave();
+    return size == 0;
+  }
+
+  //! The reader gets the bytes written so far, then end of stream.
+  void Close()
+  {
+    condition_.Enter();
+    closed_ = true;
+    condition_.WakeAll();
+    condition_.Leave();
+  }
+
+private:
+  ReceiverCondition condition_;
+  std::vector<char> data_;
+  size_t read_offset_;
+  bool closed_;
+};
+
+struct PicoPixelReceiver::Impl
+{
+  //! A chunked package being received.
+  struct ChunkStream
+  {
+    PooledBuffer*         buffer;
+    UINT64                size;
+  };
+
+  struct Connection
+  {
+    int                   id;
+    SOCKET                sock;
+    ReceiverThread        thread;
+    ReceiverLock          send_lock;        //!< Held while writing to 'sock'. Closing 'sock' takes it.
+    bool                  flow_control;     //!< The client asked for flow control.
+    volatile bool         finished;
+    UINT64                package_bytes;    //!< Bytes received for the current package.
+    std::map<unsigned int, std::string> image_names; //!< Names registered with ImageNameHeader.
+    std::map<unsigned int, ChunkStream> chunk_streams;
+    const char*           replay;           //!< Set while a chunked package is handled: Recv reads from it.
+    UINT64                replay_size;
+    ReceiverPipe*         pipe;             //!< Set for a relayed client: Recv reads from it instead of 'sock'.
+    Connection*           relay;            //!< The relay's connection for a relayed client.
+    int                   relay_client;     //!< RelayClientHeader::client of a relayed client.
+    std::map<int, ReceiverPipe*> relayed_clients; //!< Clients of a relay, by RelayClientHeader::client.
+    std::vector<ReceiverPipe*> relay_pipes; //!< Every pipe of a relay. Deleted with the relay's connection.
+    volatile LONG         relayed_connections; //!< Relayed clients whose thread is running.
+    Impl*                 impl;
+  };
+
+  Impl(PicoPixelReceiver::Listener* listener)
+    : listener_(listener)
+    , listen_sock_(INVALID_SOCKET)
+    , port_(0)
+    , running_(false)
+    , next_connection_id_(1)
+    , image_acks_(false)
+    , flow_credits_(true)
+  {}
+
+  bool Recv(Connection* connection, void* dst, UINT64 size);
+  bool Send(int connection_id, const char* ptr, size_t size);
+  //! Reads the rest of a header whose PixelPrintfProtocol part has already been read.
+  template <typename Header>
+  bool RecvHeader(Connection* connection, const PixelPrintfProtocol& base, Header& header);
+  bool RecvName(Connection* connection, PooledBuffer& buffer, size_t offset);
+
+  PooledBuffer* AcquireBuffer();
+  void ReleaseBuffer(PooledBuffer* buffer);
+
+  Connection* NewConnection(SOCKET sock);
+  //! Adds a connection and starts its thread. Deletes the connection on failure.
+  bool StartConnection(Connection* connection);
+  void ServeConnection(Connection* connection);
+  bool ReceivePackage(Connection* connection, const PixelPrintfProtocol& base, PooledBuffer& buffer);
+  //! Appends a chunk to its stream. Handles the package once the last chunk is there.
+  bool ReceiveChunk(Connection* connection, const PixelPrintfProtocol& base, PooledBuffer& buffer);
+  bool ReceiveImage(Connection* connection, const PixelPrintfProtocol& base, PooledBuffer& buffer);
+  bool ReceiveImageName(Connection* connection, const PixelPrintfProtocol& base, PooledBuffer& buffer);
+  bool ReceiveMarkers(Connection* connection, const PixelPrintfProtocol& base);
+  bool ReceiveSummary(Connection* connection, const PixelPrintfProtocol& base, PooledBuffer& buffer);
+  bool ReceiveTexture(Connection* connection, const PixelPrintfProtocol& base, PooledBuffer& buffer);
+  bool ReceiveFlowControlRequest(Connection* connection, const PixelPrintfProtocol& base);
+  bool ReceiveRelayClient(Connection* connection, const PixelPrintfProtocol& base, PooledBuffer& buffer);
+  bool ReceiveRelayData(Connection* connection, const PixelPrintfProtocol& base, PooledBuffer& buffer);
+  //! Gives back the credits of an image once the listener is done with it.
+  void ImageConsumed(Connection* connection);
+  //! Joins the threads of closed connections.
+  void ReapConnections(bool all);
+
+  static void AcceptThread(void* ptr);
+  static void ConnectionThread(void* ptr);
+
+  PicoPixelReceiver::Listener* listener_;
+  SOCKET listen_sock_;
+  int port_;
+  volatile bool running_;
+  ReceiverThread accept_thread_;
+
+  ReceiverLock connections_lock_;
+  std::map<int, Connection*> connections_;
+  int next_connection_id_;
+
+  ReceiverLock buffers_lock_;
+  std::vector<PooledBuffer*> free_buffers_;
+
+  bool image_acks_;
+  bool flow_credits_;
+};
+
+bool PicoPixelReceiver::Impl::Recv(Connection* connection, void* dst, UINT64 size)
+{
+  connection->package_bytes += size;
+  if ((connection->replay == NULL) && (connection->pipe != NULL))
+    return connection->pipe->Read((char*)dst, size);
+
+  if (connection->replay == NULL)
+    return RecvAll(connection->sock, dst, size);
+
+  if (size > connection->replay_size)
+    return false;
+
+  std::memcpy(dst, connection->replay, (size_t)size);
+  connection->replay += size;
+  connection->replay_size -= size;
+  return true;
+}
+
+bool PicoPixelReceiver::Impl::Send(int connection_id, const char* ptr, size_t size)
+{
+  // The connection written to is found and its send lock taken under connections_lock_, then the write happens
+  // outside it: a client that stops reading must not stall the other connections, StartConnection or the reaping
+  // of the accept thread. The send lock keeps the socket open during the write.
+  Connection* target = NULL;
+  bool relayed = false;
+  RelayDataHeader header;
+  connections_lock_.Enter();
+  std::map<int, Connection*>::iterator it = connections_.find(connection_id);
+  if ((it != connections_.end()) && !it->second->finished && (it->second->relay == NULL))
+  {
+    target = it->second;
+  }
+  else if ((it != connections_.end()) && !it->second->finished && !it->second->relay->finished)
+  {
+    // To a relayed client, through its relay.
+    target = it->second->relay;
+    relayed = true;
+    header.client = it->second->relay_client;
+    header.size = (int)size;
+  }
+
+  if (target != NULL)
+  {
+    target->send_lock.Enter();
+  }
+  connections_lock_.Leave();
+
+  if (target == NULL)
+    return false;
+
+  bool success = relayed ?
+    SendAll(target->sock, (const char*)&header, sizeof(header)) && SendAll(target->sock, ptr, size) :
+    SendAll(target->sock, ptr, size);
+  target->send_lock.Leave();
+  return success;
+}
+
+template <typename Header>
+bool PicoPixelReceiver::Impl::RecvHeader(Connection* connection, const PixelPrintfProtocol& base, Header& header)
+{
+  std::memcpy((char*)&header, &base, sizeof(PixelPrintfProtocol));
+  return Recv(connection, (char*)&header + sizeof(PixelPrintfProtocol), sizeof(Header) - sizeof(PixelPrintfProtocol));
+}
+
+// Reads a name size and a name into 'buffer' at 'offset'. The name is null terminated in the buffer.
+bool PicoPixelReceiver::Impl::RecvName(Connection* connection, PooledBuffer& buffer, size_t offset)
+{
+  int name_size = 0;
+  if (!Recv(connection, &name_size, sizeof(int)))
+    return false;
+
+  if (name_size <= 0 || name_size > PIXEL_RECEIVER_MAX_NAME_SIZE)
+  {
+    printf("[PicoPixelReceiver::Impl::RecvName] Invalid name size %d.\n", name_size);
+    return false;
+  }
+
+  if (!buffer.Reserve(offset + name_size) || !Recv(connection, buffer.data + offset, name_size))
+    return false;
+
+  buffer.data[offset + name_size - 1] = 0;
+  return true;
+}
+
+PooledBuffer* PicoPixelReceiver::Impl::AcquireBuffer()
+{
+  PooledBuffer* buffer = NULL;
+  buffers_lock_.Enter();
+  if (!free_buffers_.empty())
+  {
+    buffer = free_buffers_.back();
+    free_buffers_.pop_back();
+  }
+  buffers_lock_.Leave();
+
+  return buffer != NULL ? buffer : new PooledBuffer();
+}
+
+void PicoPixelReceiver::Impl::ReleaseBuffer(PooledBuffer* buffer)
+{
+  buffers_lock_.Enter();
+  if ((int)free_buffers_.size() < PIXEL_RECEIVER_MAX_FREE_BUFFERS)
+  {
+    free_buffers_.push_back(buffer);
+    buffer = NULL;
+  }
+  buffers_lock_.Leave();
+
+  delete buffer;
+}
+
+void PicoPixelReceiver::Impl::ImageConsumed(Connection* connection)
+{
+  if (!flow_credits_ || !connection->flow_control)
+    return;
+
+  FlowCreditHeader credit;
+  credit.images = 1;
+  credit.bytes = (INT64)connection->package_bytes;
+  Send(connection->id, (const char*)&credit, sizeof(credit));
+}
+
+bool PicoPixelReceiver::Impl::ReceiveImage(Connection* connection, const PixelPrintfProtocol& base, PooledBuffer& buffer)
+{
+  // Version 1 headers end before the extensions.
+  PixelInfoHeader header;
+  std::memcpy((char*)&header, &base, sizeof(PixelPrintfProtocol));
+  int header_size = PixelInfoHeaderSize(base.picoversion);
+  if (!Recv(connection, (char*)&header + sizeof(PixelPrintfProtocol), header_size - sizeof(PixelPrintfProtocol)))
+    return false;
+
+  if (base.picoversion < 2)
+  {
+    header.extensions = 0;
+  }
+
+  int known_extensions = PIXEL_INFO_EXTENSION_REGION | PIXEL_INFO_EXTENSION_TIMING | PIXEL_INFO_EXTENSION_NAME_ID;
+  if ((header.extensions & ~known_extensions) != 0)
+  {
+    printf("[PicoPixelReceiver::Impl::ReceiveImage] Unknown image extensions 0x%x.\n", header.extensions);
+    return false;
+  }
+
+  PixelRegionExtension region;
+  PixelTimingExtension timing;
+  if ((header.extensions & PIXEL_INFO_EXTENSION_REGION) && !Recv(connection, &region, sizeof(region)))
+    return false;
+
+  if ((header.extensions & PIXEL_INFO_EXTENSION_TIMING) && !Recv(connection, &timing, sizeof(timing)))
+    return false;
+
+  PixelNameIdExtension name_id;
+  if ((header.extensions & PIXEL_INFO_EXTENSION_NAME_ID) && !Recv(connection, &name_id, sizeof(name_id)))
+    return false;
+
+  if (header.pitch <= 0 || header.height <= 0 || header.width <= 0)
+    return false;
+
+  // [name][data], the data starting on a 16 bytes boundary.
+  if (header.extensions & PIXEL_INFO_EXTENSION_NAME_ID)
+  {
+    int name_size = 0;
+    std::map<unsigned int, std::string>::const_iterator it = connection->image_names.find(name_id.name_id);
+    if (!Recv(connection, &name_size, sizeof(int)) || (name_size != 0) || (it == connection->image_names.end()))
+    {
+      printf("[PicoPixelReceiver::Impl::ReceiveImage] Unregistered image name %u.\n", name_id.name_id);
+      return false;
+    }
+
+    if (!buffer.Reserve(it->second.size() + 1))
+      return false;
+    std::memcpy(buffer.data, it->second.c_str(), it->second.size() + 1);
+  }
+  else if (!RecvName(connection, buffer, 0))
+  {
+    return false;
+  }
+
+  size_t data_offset = (std::strlen(buffer.data) + 1 + 15) & ~(size_t)15;
+  UINT64 data_size = (UINT64)header.pitch * PixelInfoRowCount(header.pixel_format, header.height);
+  if ((data_size > PIXEL_RECEIVER_MAX_PAYLOAD) || !buffer.Reserve(data_offset + (size_t)data_size))
+    return false;
+
+  if (!Recv(connection, buffer.data + data_offset, data_size))
+    return false;
+
+  PicoPixelReceiver::Image image;
+  image.connection = connection->id;
+  image.header = &header;
+  image.region = (header.extensions & PIXEL_INFO_EXTENSION_REGION) ? &region : NULL;
+  image.timing = (header.extensions & PIXEL_INFO_EXTENSION_TIMING) ? &timing : NULL;
+  image.name = buffer.data;
+  image.data = buffer.data + data_offset;
+  listener_->OnImage(image);
+
+  if (image_acks_ && (image.timing != NULL))
+  {
+    ImageAckHeader ack;
+    ack.sequence = timing.sequence;
+    Send(connection->id, (const char*)&ack, sizeof(ack));
+  }
+
+  ImageConsumed(connection);
+  return true;
+}
+
+bool PicoPixelReceiver::Impl::ReceiveImageName(Connection* connection, const PixelPrintfProtocol& base, PooledBuffer& buffer)
+{
+  ImageNameHeader header;
+  if (!RecvHeader(connection, base, header) || !RecvName(connection, buffer, 0))
+    return false;
+
+  if ((header.name_id == 0) || ((int)connection->image_names.size() >= PIXEL_RECEIVER_MAX_IMAGE_NAMES))
+  {
+    printf("[PicoPixelReceiver::Impl::ReceiveImageName] Invalid image name %u.\n", header.name_id);
+    return false;
+  }
+
+  connection->image_names[header.name_id] = buffer.data;
+  return true;
+}
+
+bool PicoPixelReceiver::Impl::ReceiveMarkers(Connection* connection, const PixelPrintfProtocol& base)
+{
+  MarkerDataHeader header;
+  if (!RecvHeader(connection, base, header))
+    return false;
+
+  if (header.marker_count < 0 || header.marker_count > PIXEL_RECEIVER_MAX_MARKERS)
+    return false;
+
+  std::vector<std::string> names(header.marker_count);
+  std::vector<PicoPixelReceiver::MarkerInfo> markers(header.marker_count);
+  std::vector<char> name;
+  for (int i = 0; i < header.marker_count; ++i)
+  {
+    int fields[4]; // index, use_count, hex_color, name size
+    if (!Recv(connection, fields, sizeof(fields)))
+      return false;
+
+    if (fields[3] <= 0 || fields[3] > PIXEL_RECEIVER_MAX_NAME_SIZE)
+      return false;
+
+    name.resize(fields[3]);
+    if (!Recv(connection, &name[0], fields[3]))
+      return false;
+
+    names[i].assign(&name[0], std::strlen(&name[0]) < name.size() ? std::strlen(&name[0]) : name.size());
+    markers[i].index = fields[0];
+    markers[i].use_count = fields[1];
+    markers[i].hex_color = (unsigned int)fields[2];
+  }
+
+  for (int i = 0; i < header.marker_count; ++i)
+  {
+    markers[i].name = names[i].c_str();
+  }
+
+  listener_->OnMarkers(connection->id, header.marker_count > 0 ? &markers[0] : NULL, header.marker_count);
+  return true;
+}
+
+bool PicoPixelReceiver::Impl::ReceiveSummary(Connection* connection, const PixelPrintfProtocol& base, PooledBuffer& buffer)
+{
+  ImageSummaryHeader header;
+  if (!RecvHeader(connection, base, header) || !RecvName(connection, buffer, 0))
+    return false;
+
+  PicoPixelReceiver::Summary summary;
+  summary.connection = connection->id;
+  summary.header = &header;
+  summary.name = buffer.data;
+  listener_->OnSummary(summary);
+  return true;
+}
+
+bool PicoPixelReceiver::Impl::ReceiveTexture(Connection* connection, const PixelPrintfProtocol& base, PooledBuffer& buffer)
+{
+  TextureInfoHeader header;
+  if (!RecvHeader(connection, base, header))
+    return false;
+
+  // Bounded first so the product does not overflow.
+  if ((header.mip_count <= 0) || (header.mip_count > PICO_PIXEL_TEXTURE_MAX_MIPS) ||
+      (header.array_size <= 0) || (header.array_size > PICO_PIXEL_TEXTURE_MAX_ARRAY_SIZE) ||
+      ((header.face_count != 1) && (header.face_count != 6)))
+    return false;
+
+  if (header.subresource_count != header.mip_count * header.array_size * header.face_count)
+    return false;
+
+  std::vector<TextureSubresourceEntry> subresources(header.subresource_count);
+  if (!RecvName(connection, buffer, 0) ||
+      !Recv(connection, &subresources[0], subresources.size() * sizeof(TextureSubresourceEntry)))
+    return false;
+
+  UINT64 data_size = 0;
+  for (size_t i = 0; i < subresources.size(); ++i)
+  {
+    if (subresources[i].offset != data_size)
+      return false;
+    data_size += subresources[i].size;
+  }
+
+  size_t data_offset = (std::strlen(buffer.data) + 1 + 15) & ~(size_t)15;
+  if ((data_size > PIXEL_RECEIVER_MAX_PAYLOAD) || !buffer.Reserve(data_offset + (size_t)data_size))
+    return false;
+
+  if (!Recv(connection, buffer.data + data_offset, data_size))
+    return false;
+
+  PicoPixelReceiver::Texture texture;
+  texture.connection = connection->id;
+  texture.header = &header;
+  texture.name = buffer.data;
+  texture.subresources = &subresources[0];
+  texture.data = buffer.data + data_offset;
+  listener_->OnTexture(texture);
+  ImageConsumed(connection);
+  return true;
+}
+
+bool PicoPixelReceiver::Impl::ReceiveFlowControlRequest(Connection* connection, const PixelPrintfProtocol& base)
+{
+  FlowControlRequestHeader request;
+  if (!RecvHeader(connection, base, request))
+    return false;
+
+  if (!flow_credits_ || ((request.max_images <= 0) && (request.max_bytes <= 0)))
+    return true;
+
+  connection->flow_control = true;
+
+  FlowCreditHeader credit;
+  credit.images = request.max_images > 0 ? request.max_images : 0;
+  credit.bytes = request.max_bytes > 0 ? request.max_bytes : 0;
+  Send(connection->id, (const char*)&credit, sizeof(credit));
+  return true;
+}
+
+bool PicoPixelReceiver::Impl::ReceiveRelayClient(Connection* connection, const PixelPrintfProtocol& base, PooledBuffer& buffer)
+{
+  RelayClientHeader header;
+  if ((connection->pipe != NULL) || !RecvHeader(connection, base, header) || !RecvName(connection, buffer, 0))
+    return false;
+
+  std::map<int, ReceiverPipe*>::iterator it = connection->relayed_clients.find(header.client);
+  if (it != connection->relayed_clients.end())
+  {
+    it->second->Close();
+    connection->relayed_clients.erase(it);
+  }
+
+  if (!header.connected)
+    return true;
+
+  // The client's connection thread reads its hand shake from the pipe.
+  Connection* client = NewConnection(INVALID_SOCKET);
+  client->pipe = new ReceiverPipe();
+  client->relay = connection;
+  client->relay_client = header.client;
+  connection->relay_pipes.push_back(client->pipe);
+  connection->relayed_clients[header.client] = client->pipe;
+  InterlockedIncrement(&connection->relayed_connections);
+  if (!StartConnection(client))
+  {
+    InterlockedDecrement(&connection->relayed_connections);
+    connection->relayed_clients.erase(header.client);
+  }
+  return true;
+}
+
+bool PicoPixelReceiver::Impl::ReceiveRelayData(Connection* connection, const PixelPrintfProtocol& base, PooledBuffer& buffer)
+{
+  RelayDataHeader header;
+  if ((connection->pipe != NULL) || !RecvHeader(connection, base, header) || (header.size < 0) ||
+      !buffer.Reserve(header.size) || !Recv(connection, buffer.data, header.size))
+    return false;
+
+  // Data of a client that is gone is dropped.
+  std::map<int, ReceiverPipe*>::iterator it = connection->relayed_clients.find(header.client);
+  if (it != connection->relayed_clients.end())
+  {
+    it->second->Write(buffer.data, header.size);
+  }
+  return true;
+}
+
+bool PicoPixelReceiver::Impl::ReceivePackage(Connection* connection, const PixelPrintfProtocol& base, PooledBuffer& buffer)
+{
+  switch (base.payload_type)
+  {
+  case PackageType::PACKAGE_TYPE_IMAGE:                 return ReceiveImage(connection, base, buffer);
+  case PackageType::PACKAGE_TYPE_MARKER:                return ReceiveMarkers(connection, base);
+  case PackageType::PACKAGE_TYPE_IMAGE_SUMMARY:         return ReceiveSummary(connection, base, buffer);
+  case PackageType::PACKAGE_TYPE_TEXTURE:               return ReceiveTexture(connection, base, buffer);
+  case PackageType::PACKAGE_TYPE_FLOW_CONTROL_REQUEST:  return ReceiveFlowControlRequest(connection, base);
+  case PackageType::PACKAGE_TYPE_IMAGE_NAME:            return ReceiveImageName(connection, base, buffer);
+  case PackageType::PACKAGE_TYPE_CHUNK:                 return ReceiveChunk(connection, base, buffer);
+  case PackageType::PACKAGE_TYPE_RELAY_CLIENT:          return ReceiveRelayClient(connection, base, buffer);
+  case PackageType::PACKAGE_TYPE_RELAY_DATA:            return ReceiveRelayData(connection, base, buffer);
+  default:
+    printf("[PicoPixelReceiver::Impl::ReceivePackage] Unknown package type %d.\n", base.payload_type);
+    return false;
+  }
+}
+
+bool PicoPixelReceiver::Impl::ReceiveChunk(Connection* connection, const PixelPrintfProtocol& base, PooledBuffer& buffer)
+{
+  PackageChunkHeader header;
+  if ((connection->replay != NULL) || !RecvHeader(connection, base, header) || (header.size < 0))
+    return false;
+
+  std::map<unsigned int, ChunkStream>::iterator it = connection->chunk_streams.find(header.stream_id);
+  if (it == connection->chunk_streams.end())
+  {
+    if ((int)connection->chunk_streams.size() >= PIXEL_RECEIVER_MAX_CHUNK_STREAMS)
+    {
+      printf("[PicoPixelReceiver::Impl::ReceiveChunk] Too many chunked packages in progress.\n");
+      return false;
+    }
+
+    ChunkStream stream;
+    stream.buffer = AcquireBuffer();
+    stream.size = 0;
+    it = connection->chunk_streams.insert(std::make_pair(header.stream_id, stream)).first;
+  }
+
+  ChunkStream& stream = it->second;
+  UINT64 size = stream.size + (UINT64)header.size;
+  if ((size > PIXEL_RECEIVER_MAX_PAYLOAD) || !stream.buffer->Reserve((size_t)size) ||
+      !Recv(connection, stream.buffer->data + stream.size, (UINT64)header.size))
+    return false;
+
+  stream.size = size;
+  if (!header.last)
+    return true;
+
+  // The package is read from the stream buffer as if it came from the socket. Flow credits count its bytes only.
+  PooledBuffer* package = stream.buffer;
+  connection->chunk_streams.erase(it);
+  connection->replay = package->data;
+  connection->replay_size = size;
+  connection->package_bytes = 0;
+
+  PixelPrintfProtocol package_base;
+  bool received = Recv(connection, &package_base, sizeof(package_base)) &&
+                  (package_base.picomagic == PICO_PIXEL_NET_SIGNATURE) &&
+                  ReceivePackage(connection, package_base, buffer) &&
+                  (connection->replay_size == 0);
+
+  connection->replay = NULL;
+  connection->replay_size = 0;
+  ReleaseBuffer(package);
+  return received;
+}
+
+void PicoPixelReceiver::Impl::ServeConnection(Connection* connection)
+{
+  HandShakeHeader hand_shake;
+  std::vector<char> client_id;
+  PixelPrintfProtocol base;
+
+  bool success = Recv(connection, &base, sizeof(base)) &&
+                 (base.picomagic == PICO_PIXEL_NET_SIGNATURE) &&
+                 (base.payload_type == PackageType::PACKAGE_TYPE_CLIENT_HANDSHAKE) &&
+                 RecvHeader(connection, base, hand_shake) &&
+                 (hand_shake.size > 0) && (hand_shake.size <= PIXEL_RECEIVER_MAX_NAME_SIZE);
+  if (success)
+  {
+    client_id.resize(hand_shake.size + 1, 0);
+    success = Recv(connection, &client_id[0], hand_shake.size);
+  }
+
+  if (!success)
+  {
+    printf("[PicoPixelReceiver::Impl::ServeConnection] Hand shake failed.\n");
+    return;
+  }
+
+  // The client sends version 2 packages once it knows they are read. A relay only forwards its clients once it
+  // knows relay packages are read.
+  ViewerHandShakeHeader viewer_hand_shake;
+  viewer_hand_shake.features = VIEWER_FEATURE_RELAY;
+  Send(connection->id, (const char*)&viewer_hand_shake, sizeof(viewer_hand_shake));
+
+  listener_->OnConnect(connection->id, std::string(&client_id[0]));
+
+  PooledBuffer* buffer = AcquireBuffer();
+  while (running_)
+  {
+    connection->package_bytes = 0;
+    if (!Recv(connection, &base, sizeof(base)))
+      break;
+
+    if ((base.picomagic != PICO_PIXEL_NET_SIGNATURE) || (base.isbigendian != PixelPrintfProtocol().isbigendian))
+    {
+      printf("[PicoPixelReceiver::Impl::ServeConnection] Invalid package.\n");
+      break;
+    }
+
+    if (!ReceivePackage(connection, base, *buffer))
+      break;
+  }
+  ReleaseBuffer(buffer);
+
+  for (std::map<unsigned int, ChunkStream>::iterator it = connection->chunk_streams.begin(); it != connection->chunk_streams.end(); ++it)
+  {
+    ReleaseBuffer(it->second.buffer);
+  }
+  connection->chunk_streams.clear();
+
+  // The relayed clients end with their relay.
+  for (std::map<int, ReceiverPipe*>::iterator it = connection->relayed_clients.begin(); it != connection->relayed_clients.end(); ++it)
+  {
+    it->second->Close();
+  }
+  connection->relayed_clients.clear();
+}
+
+void PicoPixelReceiver::Impl::ConnectionThread(void* ptr)
+{
+  Connection* connection = static_cast<Connection*>(ptr);
+  PicoPixelReceiver::Impl* impl = connection->impl;
+
+  impl->ServeConnection(connection);
+
+  impl->connections_lock_.Enter();
+  connection->finished = true;
+  if (connection->pipe != NULL)
+  {
+    // Unblocks the relay if it is writing to the pipe.
+    connection->pipe->Close();
+    InterlockedDecrement(&connection->relay->relayed_connections);
+  }
+  else
+  {
+    // Unblocks a Send to the connection.
+    shutdown(connection->sock, SD_BOTH);
+  }
+  impl->connections_lock_.Leave();
+
+  // Waits for a Send that found the connection before it finished to leave the socket.
+  if (connection->pipe == NULL)
+  {
+    connection->send_lock.Enter();
+    closesocket(connection->sock);
+    connection->send_lock.Leave();
+  }
+
+  impl->listener_->OnDisconnect(connection->id);
+}
+
+void PicoPixelReceiver::Impl::ReapConnections(bool all)
+{
+  std::vector<Connection*> reaped;
+  connections_lock_.Enter();
+  std::map<int, Connection*>::iterator it = connections_.begin();
+  while (it != connections_.end())
+  {
+    Connection* connection = it->second;
+    if (all && !connection->finished)
+    {
+      // Unblocks the connection thread.
+      if (connection->pipe != NULL)
+        connection->pipe->Close();
+      else
+        shutdown(connection->sock, SD_BOTH);
+    }
+
+    // A relay's connection is kept until the threads of its clients are done with it.
+    if (all || (connection->finished && (connection->relayed_connections == 0)))
+    {
+      reaped.push_back(connection);
+      connections_.erase(it++);
+    }
+    else
+    {
+      ++it;
+    }
+  }
+  connections_lock_.Leave();
+
+  std::vector<Connection*>::iterator reaped_it;
+  for (reaped_it = reaped.begin(); reaped_it != reaped.end(); ++reaped_it)
+  {
+    JoinThread((*reaped_it)->thread);
+  }
+
+  for (reaped_it = reaped.begin(); reaped_it != reaped.end(); ++reaped_it)
+  {
+    std::vector<ReceiverPipe*>::iterator pipe_it;
+    for (pipe_it = (*reaped_it)->relay_pipes.begin(); pipe_it != (*reaped_it)->relay_pipes.end(); ++pipe_it)
+    {
+      delete *pipe_it;
+    }
+    delete *reaped_it;
+  }
+}
+
+PicoPixelReceiver::Impl::Connection* PicoPixelReceiver::Impl::NewConnection(SOCKET sock)
+{
+  Connection* connection = new Connection;
+  connection->sock = sock;
+  connection->flow_control = false;
+  connection->finished = false;
+  connection->package_bytes = 0;
+  connection->replay = NULL;
+  connection->replay_size = 0;
+  connection->pipe = NULL;
+  connection->relay = NULL;
+  connection->relay_client = 0;
+  connection->relayed_connections = 0;
+  connection->impl = this;
+  return connection;
+}
+
+bool PicoPixelReceiver::Impl::StartConnection(Connection* connection)
+{
+  // The connection is in the map before its thread starts so that ReapConnections always sees it.
+  connections_lock_.Enter();
+  connection->id = next_connection_id_++;
+  connections_[connection->id] = connection;
+  bool started = StartThread(connection->thread, ConnectionThread, connection);
+  if (!started)
+  {
+    connections_.erase(connection->id);
+  }
+  connections_lock_.Leave();
+
+  if (!started)
+  {
+    printf("[PicoPixelReceiver::Impl::StartConnection] Failed to create connection thread.\n");
+    if (connection->pipe == NULL)
+    {
+      closesocket(connection->sock);
+    }
+    delete connection;
+  }
+  return started;
+}
+
+void PicoPixelReceiver::Impl::AcceptThread(void* ptr)
+{
+  PicoPixelReceiver::Impl* impl = static_cast<PicoPixelReceiver::Impl*>(ptr);
+
+  while (impl->running_)
+  {
+    SOCKET sock = accept(impl->listen_sock_, NULL, NULL);
+    if (sock == INVALID_SOCKET)
+      break;
+
+    impl->ReapConnections(false);
+
+    int no_delay = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (const char*)&no_delay, sizeof(no_delay));
+
+    impl->StartConnection(impl->NewConnection(sock));
+  }
+}
+
+PicoPixelReceiver::PicoPixelReceiver(Listener* listener)
+  : impl_(new Impl(listener))
+{
+}
+
+PicoPixelReceiver::~PicoPixelReceiver()
+{
+  Stop();
+
+  std::vector<PooledBuffer*>::iterator it;
+  for (it = impl_->free_buffers_.begin(); it != impl_->free_buffers_.end(); ++it)
+  {
+    delete *it;
+  }
+  delete impl_;
+}
+
+bool PicoPixelReceiver::Start(int port)
+{
+  if (impl_->running_)
+    return true;
+
+#if WIN32
+  WSADATA wsaData;
+  int err = WSAStartup( MAKEWORD( 2, 2 ), &wsaData );
+  if (err != 0)
+  {
+    printf("[PicoPixelReceiver::Start] WSAStartup has failed: %d\n", err);
+    return false;
+  }
+#endif
+
+  SOCKET sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if (sock == INVALID_SOCKET)
+  {
+    printf("[PicoPixelReceiver::Start] Failed to create network socket.\n");
+    return false;
+  }
+
+  int reuse = 1;
+  setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse, sizeof(reuse));
+
+  struct sockaddr_in address;
+  std::memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_ANY);
+  address.sin_port = htons((unsigned short)port);
+
+  socklen_t address_size = sizeof(address);
+  if ((bind(sock, (struct sockaddr*)&address, sizeof(address)) != 0) ||
+      (listen(sock, SOMAXCONN) != 0) ||
+      (getsockname(sock, (struct sockaddr*)&address, &address_size) != 0))
+  {
+    printf("[PicoPixelReceiver::Start] Cannot listen on port %d.\n", port);
+    closesocket(sock);
+    return false;
+  }
+
+  impl_->listen_sock_ = sock;
+  impl_->port_ = ntohs(address.sin_port);
+  impl_->running_ = true;
+  if (!StartThread(impl_->accept_thread_, Impl::AcceptThread, impl_))
+  {
+    printf("[PicoPixelReceiver::Start] Failed to create accept thread.\n");
+    impl_->running_ = false;
+    closesocket(sock);
+    impl_->listen_sock_ = INVALID_SOCKET;
+    impl_->port_ = 0;
+    return false;
+  }
+  return true;
+}
+
+void PicoPixelReceiver::Stop()
+{
+  if (!impl_->running_)
+    return;
+
+  impl_->running_ = false;
+
+  // Closing the listening socket alone does not wake up accept everywhere.
+  shutdown(impl_->listen_sock_, SD_BOTH);
+  closesocket(impl_->listen_sock_);
+  JoinThread(impl_->accept_thread_);
+  impl_->listen_sock_ = INVALID_SOCKET;
+  impl_->port_ = 0;
+
+  impl_->ReapConnections(true);
+
+#if WIN32
+  WSACleanup();
+#endif
+}
+
+int PicoPixelReceiver::Port()
+{
+  return impl_->port_;
+}
+
+void PicoPixelReceiver::EnableImageAcks()
+{
+  impl_->image_acks_ = true;
+}
+
+void PicoPixelReceiver::DisableImageAcks()
+{
+  impl_->image_acks_ = false;
+}
+
+void PicoPixelReceiver::EnableFlowCredits()
+{
+  impl_->flow_credits_ = true;
+}
+
+void PicoPixelReceiver::DisableFlowCredits()
+{
+  impl_->flow_credits_ = false;
+}
+
+bool PicoPixelReceiver::SendMarkerUseCount(int connection, int marker_index, int use_count, const std::string& marker_name)
+{
+  // The layout the client reads: no color.
+  MarkerDataHeader header;
+  header.marker_count = 1;
+  int name_size = (int)marker_name.size() + 1;
+
+  std::vector<char> package(sizeof(header) + 3 * sizeof(int) + name_size);
+  char* ptr = &package[0];
+  std::memcpy(ptr, &header, sizeof(header));            ptr += sizeof(header);
+  std::memcpy(ptr, &marker_index, sizeof(int));         ptr += sizeof(int);
+  std::memcpy(ptr, &use_count, sizeof(int));            ptr += sizeof(int);
+  std::memcpy(ptr, &name_size, sizeof(int));            ptr += sizeof(int);
+  std::memcpy(ptr, marker_name.c_str(), name_size);
+
+  return impl_->Send(connection, &package[0], package.size());
+}
+
+bool PicoPixelReceiver::SendRegionOfInterest(int connection, const std::string& image_name, int x, int y, int width, int height)
+{
+  RegionOfInterestHeader header;
+  header.x = x;
+  header.y = y;
+  header.width = width;
+  header.height = height;
+  int name_size = (int)image_name.size() + 1;
+
+  std::vector<char> package(sizeof(header) + sizeof(int) + name_size);
+  char* ptr = &package[0];
+  std::memcpy(ptr, &header, sizeof(header));            ptr += sizeof(header);
+  std::memcpy(ptr, &name_size, sizeof(int));            ptr += sizeof(int);
+  std::memcpy(ptr, image_name.c_str(), name_size);
+
+  return impl_->Send(connection, &package[0], package.size());
+}
+
+bool PicoPixelReceiver::SendFlowCredit(int connection, int images, INT64 bytes)
+{
+  FlowCreditHeader credit;
+  credit.images = images;
+  credit.bytes = bytes;
+  return impl_->Send(connection, (const char*)&credit, sizeof(credit));
+}
+
+bool PicoPixelReceiver::SendFlightRecorderDumpRequest(int connection, int frame_count)
+{
+  FlightRecorderDumpHeader dump;
+  dump.frame_count = frame_count;
+  return impl_->Send(connection, (const char*)&dump, sizeof(dump));
+}
@@ -0,0 +1,169 @@
+#ifndef PICO_PIXEL_RECEIVER_H
+#define PICO_PIXEL_RECEIVER_H
+
+#if WIN32
+# pragma comment(lib, "Ws2_32.lib")
+# include <windows.h>
+# include <winsock2.h>
+# include <Ws2tcpip.h>
+#else
+// The protocol header is written against the Windows types. Enough of them to build the receiver elsewhere.
+# include <stdint.h>
+typedef int                 BOOL;
+typedef int32_t             LONG;
+typedef uint32_t            DWORD;
+typedef int64_t             INT64;
+typedef uint64_t            UINT64;
+typedef int                 SOCKET;
+# ifndef TRUE
+#  define TRUE  1
+#  define FALSE 0
+# endif
+# define INVALID_SOCKET     (-1)
+inline LONG InterlockedIncrement(volatile LONG* value)                          { return __sync_add_and_fetch(value, 1); }
+inline LONG InterlockedDecrement(volatile LONG* value)                          { return __sync_sub_and_fetch(value, 1); }
+inline LONG InterlockedExchange(volatile LONG* target, LONG value)              { return __sync_lock_test_and_set(target, value); }
+inline LONG InterlockedCompareExchange(volatile LONG* target, LONG value, LONG comparand) { return __sync_val_compare_and_swap(target, comparand, value); }
+unsigned int GetTickCount();
+#endif
+#include <string>
+#include <vector>
+#include <map>
+#include "PicoPixelClientProtocol.h"
+
+/*!
+    Headless receiving end of the Pico Pixel protocol. It accepts PicoPixelClient connections and hands the
+    packages it receives to a Listener. Use it to capture images in automated tests, as a stand-in viewer on
+    build machines, or to consume images inside your own tools.
+
+    Each connection is served by its own thread. Package data is received straight into pooled buffers and
+    the Listener gets pointers into them: the data is only valid during the callback.
+
+    The clients behind a PicoPixelRelay are connections of their own, with their own connection number.
+*/
+class PicoPixelReceiver
+{
+public:
+  struct Image
+  {
+    int                           connection;
+    const PixelInfoHeader*        header;
+    const PixelRegionExtension*   region;     //!< NULL unless the image is a region of a larger image.
+    const PixelTimingExtension*   timing;     //!< NULL unless the client traces latencies.
+    const char*                   name;       //!< Null terminated.
+    const char*                   data;       //!< header->pitch * PixelInfoRowCount(header->pixel_format, header->height) bytes.
+  };
+
+  struct MarkerInfo
+  {
+    int                           index;
+    int                           use_count;
+    unsigned int                  hex_color;
+    const char*                   name;       //!< Null terminated.
+  };
+
+  struct Summary
+  {
+    int                           connection;
+    const ImageSummaryHeader*     header;
+    const char*                   name;
+  };
+
+  struct Texture
+  {
+    int                           connection;
+    const TextureInfoHeader*      header;
+    const char*                   name;
+    const TextureSubresourceEntry* subresources; //!< header->subresource_count entries.
+    const char*                   data;
+  };
+
+  /*!
+      Receives the packages. Callbacks are made from the connection threads, concurrently when several clients
+      are connected.
+  */
+  class Listener
+  {
+  public:
+    virtual ~Listener() {}
+    virtual void OnConnect(int connection, const std::string& client_id) {}
+    virtual void OnDisconnect(int connection) {}
+    virtual void OnImage(const Image& image) {}
+    virtual void OnMarkers(int connection, const MarkerInfo* markers, int marker_count) {}
+    virtual void OnSummary(const Summary& summary) {}
+    virtual void OnTexture(const Texture& texture) {}
+  };
+
+  PicoPixelReceiver(Listener* listener);
+  ~PicoPixelReceiver();
+
+  /*!
+      Starts listening.
+
+      @param port   Port to listen on. 0 picks a free port, see Port().
+      @return False if the port could not be bound.
+  */
+  bool Start(int port = PICO_PIXEL_SERVER_PORT);
+
+  /*!
+      Closes every connection and stops listening. Waits for the connection threads to end.
+  */
+  void Stop();
+
+  /*!
+      @return The port the receiver listens on, or 0 if not started.
+  */
+  int Port();
+
+  /*!
+      Acknowledges the images that carry a PixelTimingExtension, so that clients measure round-trip times.
+      Disabled by default.
+  */
+  void EnableImageAcks();
+  void DisableImageAcks();
+
+  /*!
+      Grants flow control credits to the clients that ask for them: the window they request when they
+      connect, then one image and its size each time OnImage or OnTexture returns. Enabled by default.
+  */
+  void EnableFlowCredits();
+  void DisableFlowCredits();
+
+  /*!
+      Sets the use count of a client's marker, as the Pico Pixel marker panel does.
+
+      @return False if the connection is closed.
+  */
+  bool SendMarkerUseCount(int connection, int marker_index, int use_count, const std::string& marker_name);
+
+  /*!
+      Asks a client to only send a region of an image. A width or height of 0 clears the region.
+
+      @return False if the connection is closed.
+  */
+  bool SendRegionOfInterest(int connection, const std::string& image_name, int x, int y, int width, int height);
+
+  /*!
+      Adds flow control credits to a client's window.
+
+      @return False if the connection is closed.
+  */
+  bool SendFlowCredit(int connection, int images, INT64 bytes);
+
+  /*!
+      Asks a client to send the images kept by its flight recorder. They arrive through OnImage.
+
+      @param frame_count  Most recent frames to send. 0 for every frame kept.
+      @return False if the connection is closed.
+  */
+  bool SendFlightRecorderDumpRequest(int connection, int frame_count);
+
+private:
+  struct Impl;
+  Impl* impl_;
+
+  PicoPixelReceiver(const PicoPixelReceiver&);
+  PicoPixelReceiver& operator=(const PicoPixelReceiver&);
+};
+
+#endif // PICO_PIXEL_RECEIVER_H
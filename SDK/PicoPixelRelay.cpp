@@ -0,0 +1,599 @@
+#include "PicoPixelRelay.h"
+#include <afunix.h>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <vector>
+
+static const int PIXEL_RELAY_BUFFER_SIZE   = 256 * 1024;          // Largest slice of a client's stream forwarded at once
+static const int PIXEL_RELAY_MAX_NAME_SIZE = 4096;
+static const int PIXEL_RELAY_MAX_DOWNLINK  = 16 * 1024 * 1024;    // Largest slice Pico Pixel may send to a client
+static const int PIXEL_RELAY_HANDSHAKE_TIMEOUT = 2000;            // Milliseconds to wait for the viewer's hand shake
+
+static bool RelayRecvAll(SOCKET sock, char* ptr, int size)
+{
+  while (size > 0)
+  {
+    int ret = recv(sock, ptr, size, 0);
+    if (ret <= 0)
+      return false;
+
+    ptr += ret;
+    size -= ret;
+  }
+  return true;
+}
+
+static bool RelaySendAll(SOCKET sock, const char* ptr, int size)
+{
+  while (size > 0)
+  {
+    int ret = send(sock, ptr, size, 0);
+    if (ret == SOCKET_ERROR)
+      return false;
+
+    ptr += ret;
+    size -= ret;
+  }
+  return true;
+}
+
+struct PicoPixelRelay::Impl
+{
+  struct Client
+  {
+    int                   id;               //!< RelayClientHeader::client.
+    SOCKET                sock;
+    CRITICAL_SECTION      send_lock;        //!< Held while Pico Pixel's data is written to sock. Closing sock takes it.
+    HANDLE                thread;
+    volatile bool         finished;
+    LONG                  uplink_generation; //!< Connection to Pico Pixel the client was announced on.
+    double                tokens;           //!< Bytes the client may send before it is throttled.
+    ULONGLONG             refill_time;
+    Impl*                 impl;
+  };
+
+  Impl(const std::string& relay_id)
+    : relay_id_(relay_id)
+    , port_(0)
+    , listen_sock_(INVALID_SOCKET)
+    , accept_thread_(NULL)
+    , running_(false)
+    , uplink_sock_(INVALID_SOCKET)
+    , uplink_thread_(NULL)
+    , uplink_generation_(0)
+    , uplink_lost_(false)
+    , next_client_id_(1)
+    , rate_limit_(0)
+  {
+    InitializeCriticalSection(&uplink_lock_);
+    InitializeCriticalSection(&clients_lock_);
+  }
+
+  ~Impl()
+  {
+    DeleteCriticalSection(&clients_lock_);
+    DeleteCriticalSection(&uplink_lock_);
+  }
+
+  //! Connects to Pico Pixel if the relay is not connected. Called with uplink_lock_ held.
+  bool ConnectUplink();
+  //! Waits for the viewer's hand shake and checks that it reads relay packages.
+  bool AcceptsRelay(SOCKET sock);
+  void CloseUplink();
+  //! Sends a package to Pico Pixel on the connection a client was announced on.
+  bool SendUplink(const Client* client, const char* head, int head_size, const char* data, int size);
+  bool AnnounceClient(Client* client, const std::string& client_id, bool connected);
+  //! Sleeps while a client is over its bandwidth budget.
+  void Throttle(Client* client, int byte_count);
+  void ServeClient(Client* client);
+  void ServeUplink(SOCKET sock);
+  //! Joins the threads of closed clients.
+  void ReapClients(bool all);
+
+  static DWORD WINAPI AcceptThread(void* ptr);
+  static DWORD WINAPI ClientThread(void* ptr);
+  static DWORD WINAPI UplinkThread(void* ptr);
+
+  std::string relay_id_;
+  std::string path_;
+  std::string host_ip_;
+  int port_;
+  SOCKET listen_sock_;
+  HANDLE accept_thread_;
+  volatile bool running_;
+
+  CRITICAL_SECTION uplink_lock_;          //!< Serializes the packages sent to Pico Pixel.
+  SOCKET uplink_sock_;
+  HANDLE uplink_thread_;
+  volatile LONG uplink_generation_;       //!< Incremented by each connection to Pico Pixel.
+  volatile bool uplink_lost_;             //!< Set by the uplink thread when Pico Pixel is gone.
+
+  CRITICAL_SECTION clients_lock_;
+  std::map<int, Client*> clients_;
+  int next_client_id_;
+  volatile LONG rate_limit_;              //!< Bytes per second and per client. 0 for no limit.
+};
+
+bool PicoPixelRelay::Impl::ConnectUplink()
+{
+  if ((uplink_sock_ != INVALID_SOCKET) && !uplink_lost_)
+    return true;
+
+  CloseUplink();
+
+  char port[32];
+  sprintf_s(port, sizeof(port), "%d", port_);
+
+  struct addrinfo hints;
+  struct addrinfo* addresses = NULL;
+  std::memset(&hints, 0, sizeof(hints));
+  hints.ai_family = PF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_protocol = IPPROTO_TCP;
+  if (getaddrinfo(host_ip_.c_str(), port, &hints, &addresses) != 0)
+  {
+    printf("[PicoPixelRelay::Impl::ConnectUplink] Cannot resolve %s.\n", host_ip_.c_str());
+    return false;
+  }
+
+  SOCKET sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  bool connected = (sock != INVALID_SOCKET) && (connect(sock, addresses->ai_addr, (int)addresses->ai_addrlen) == 0);
+  freeaddrinfo(addresses);
+
+  HandShakeHeader hand_shake;
+  hand_shake.size = (int)relay_id_.size() + 1;
+  if (!connected ||
+      !RelaySendAll(sock, (const char*)&hand_shake, sizeof(hand_shake)) ||
+      !RelaySendAll(sock, relay_id_.c_str(), hand_shake.size))
+  {
+    printf("[PicoPixelRelay::Impl::ConnectUplink] Connection to Pico Pixel failed.\n");
+    if (sock != INVALID_SOCKET)
+      closesocket(sock);
+    return false;
+  }
+
+  if (!AcceptsRelay(sock))
+  {
+    printf("[PicoPixelRelay::Impl::ConnectUplink] %s does not read relay packages. Run a PicoPixelReceiver there.\n", host_ip_.c_str());
+    closesocket(sock);
+    return false;
+  }
+
+  uplink_sock_ = sock;
+  uplink_lost_ = false;
+  InterlockedIncrement(&uplink_generation_);
+  uplink_thread_ = ::CreateThread(NULL, 0, UplinkThread, this, 0, NULL);
+  if (uplink_thread_ == NULL)
+  {
+    printf("[PicoPixelRelay::Impl::ConnectUplink] Failed to create uplink thread.\n");
+    CloseUplink();
+    return false;
+  }
+  return true;
+}
+
+bool PicoPixelRelay::Impl::AcceptsRelay(SOCKET sock)
+{
+  // A viewer that does not know relays never answers the hand shake, or answers without VIEWER_FEATURE_RELAY.
+  // It would take the relay packages for garbage, so the relay does not connect to it.
+  DWORD timeout = PIXEL_RELAY_HANDSHAKE_TIMEOUT;
+  setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));
+
+  ViewerHandShakeHeader hand_shake;
+  bool accepts = RelayRecvAll(sock, (char*)&hand_shake, sizeof(PixelPrintfProtocol)) &&
+                 (hand_shake.picomagic == PICO_PIXEL_NET_SIGNATURE) &&
+                 (hand_shake.payload_type == PackageType::PACKAGE_TYPE_VIEWER_HANDSHAKE) &&
+                 RelayRecvAll(sock, (char*)&hand_shake + sizeof(PixelPrintfProtocol), sizeof(hand_shake) - sizeof(PixelPrintfProtocol)) &&
+                 ((hand_shake.features & VIEWER_FEATURE_RELAY) != 0);
+
+  timeout = 0;
+  setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));
+  return accepts;
+}
+
+void PicoPixelRelay::Impl::CloseUplink()
+{
+  if (uplink_sock_ == INVALID_SOCKET)
+    return;
+
+  // The uplink thread never takes uplink_lock_, it can be waited for here.
+  shutdown(uplink_sock_, SD_BOTH);
+  closesocket(uplink_sock_);
+  uplink_sock_ = INVALID_SOCKET;
+  if (uplink_thread_ != NULL)
+  {
+    WaitForSingleObject(uplink_thread_, INFINITE);
+    ::CloseHandle(uplink_thread_);
+    uplink_thread_ = NULL;
+  }
+}
+
+bool PicoPixelRelay::Impl::SendUplink(const Client* client, const char* head, int head_size, const char* data, int size)
+{
+  WSABUF buffers[2];
+  buffers[0].buf = (char*)head;
+  buffers[0].len = (ULONG)head_size;
+  buffers[1].buf = (char*)data;
+  buffers[1].len = (ULONG)size;
+
+  bool success = false;
+  EnterCriticalSection(&uplink_lock_);
+  if ((uplink_sock_ != INVALID_SOCKET) && !uplink_lost_ && (client->uplink_generation == uplink_generation_))
+  {
+    DWORD sent = 0;
+    success = (WSASend(uplink_sock_, buffers, 2, &sent, 0, NULL, NULL) != SOCKET_ERROR);
+    if (success && (sent < (DWORD)(head_size + size)))
+    {
+      // A blocking WSASend sends everything, but be safe.
+      int head_left = sent < (DWORD)head_size ? head_size - (int)sent : 0;
+      int data_sent = sent > (DWORD)head_size ? (int)sent - head_size : 0;
+      success = RelaySendAll(uplink_sock_, head + head_size - head_left, head_left) &&
+                RelaySendAll(uplink_sock_, data + data_sent, size - data_sent);
+    }
+  }
+  LeaveCriticalSection(&uplink_lock_);
+  return success;
+}
+
+bool PicoPixelRelay::Impl::AnnounceClient(Client* client, const std::string& client_id, bool connected)
+{
+  RelayClientHeader header;
+  header.client = client->id;
+  header.connected = connected ? 1 : 0;
+  int id_size = (int)client_id.size() + 1;
+
+  std::vector<char> head(sizeof(header) + sizeof(int));
+  std::memcpy(&head[0], &header, sizeof(header));
+  std::memcpy(&head[sizeof(header)], &id_size, sizeof(int));
+
+  // A client that connects brings the connection to Pico Pixel up.
+  if (connected)
+  {
+    EnterCriticalSection(&uplink_lock_);
+    bool uplink = ConnectUplink();
+    client->uplink_generation = uplink_generation_;
+    LeaveCriticalSection(&uplink_lock_);
+    if (!uplink)
+      return false;
+  }
+
+  return SendUplink(client, &head[0], (int)head.size(), client_id.c_str(), id_size);
+}
+
+void PicoPixelRelay::Impl::Throttle(Client* client, int byte_count)
+{
+  LONG rate = rate_limit_;
+  if (rate <= 0)
+    return;
+
+  // Token bucket holding up to one second of data.
+  ULONGLONG now = GetTickCount64();
+  client->tokens += (double)(now - client->refill_time) * rate / 1000.0;
+  client->tokens = client->tokens > rate ? rate : client->tokens;
+  client->refill_time = now;
+
+  client->tokens -= byte_count;
+  if (client->tokens < 0.0)
+  {
+    Sleep((DWORD)(-client->tokens * 1000.0 / rate));
+  }
+}
+
+void PicoPixelRelay::Impl::ServeClient(Client* client)
+{
+  // The client id of the hand shake tags the client for Pico Pixel. The hand shake itself is forwarded too.
+  HandShakeHeader hand_shake;
+  if (!RelayRecvAll(client->sock, (char*)&hand_shake, sizeof(hand_shake)) ||
+      (hand_shake.picomagic != PICO_PIXEL_NET_SIGNATURE) ||
+      (hand_shake.payload_type != PackageType::PACKAGE_TYPE_CLIENT_HANDSHAKE) ||
+      (hand_shake.size <= 0) || (hand_shake.size > PIXEL_RELAY_MAX_NAME_SIZE))
+  {
+    printf("[PicoPixelRelay::Impl::ServeClient] Hand shake failed.\n");
+    return;
+  }
+
+  std::vector<char> buffer(PIXEL_RELAY_BUFFER_SIZE);
+  std::memcpy(&buffer[0], &hand_shake, sizeof(hand_shake));
+  if (!RelayRecvAll(client->sock, &buffer[sizeof(hand_shake)], hand_shake.size))
+    return;
+
+  std::string client_id(&buffer[sizeof(hand_shake)], strnlen(&buffer[sizeof(hand_shake)], hand_shake.size));
+  if (!AnnounceClient(client, client_id, true))
+    return;
+
+  RelayDataHeader data;
+  data.client = client->id;
+  data.size = (int)sizeof(hand_shake) + hand_shake.size;
+  bool forwarding = SendUplink(client, (const char*)&data, sizeof(data), &buffer[0], data.size);
+
+  // Slices of the client's stream are forwarded as they come, whatever the package boundaries.
+  while (forwarding && running_)
+  {
+    int size = recv(client->sock, &buffer[0], PIXEL_RELAY_BUFFER_SIZE, 0);
+    if (size <= 0)
+      break;
+
+    Throttle(client, size);
+    data.size = size;
+    forwarding = SendUplink(client, (const char*)&data, sizeof(data), &buffer[0], size);
+  }
+
+  AnnounceClient(client, client_id, false);
+}
+
+void PicoPixelRelay::Impl::ServeUplink(SOCKET sock)
+{
+  std::vector<char> buffer;
+  while (true)
+  {
+    RelayDataHeader header;
+    if (!RelayRecvAll(sock, (char*)&header, sizeof(PixelPrintfProtocol)) ||
+        (header.picomagic != PICO_PIXEL_NET_SIGNATURE))
+      break;
+
+    // Anything but client data cannot be sized, the stream is lost.
+    if (header.payload_type != PackageType::PACKAGE_TYPE_RELAY_DATA)
+    {
+      printf("[PicoPixelRelay::Impl::ServeUplink] Unexpected package type %d.\n", header.payload_type);
+      break;
+    }
+
+    if (!RelayRecvAll(sock, (char*)&header + sizeof(PixelPrintfProtocol), sizeof(header) - sizeof(PixelPrintfProtocol)) ||
+        (header.size < 0) || (header.size > PIXEL_RELAY_MAX_DOWNLINK))
+      break;
+
+    buffer.resize(header.size > 0 ? header.size : 1);
+    if (!RelayRecvAll(sock, &buffer[0], header.size))
+      break;
+
+    // Data for a client that is gone is dropped. The client's send lock keeps its socket open while the data
+    // is written, without holding clients_lock_ and so stalling every other client behind a slow one.
+    Client* client = NULL;
+    EnterCriticalSection(&clients_lock_);
+    std::map<int, Client*>::iterator it = clients_.find(header.client);
+    if ((it != clients_.end()) && !it->second->finished)
+    {
+      client = it->second;
+      EnterCriticalSection(&client->send_lock);
+    }
+    LeaveCriticalSection(&clients_lock_);
+
+    if (client != NULL)
+    {
+      RelaySendAll(client->sock, &buffer[0], header.size);
+      LeaveCriticalSection(&client->send_lock);
+    }
+  }
+}
+
+void PicoPixelRelay::Impl::ReapClients(bool all)
+{
+  std::vector<Client*> reaped;
+  EnterCriticalSection(&clients_lock_);
+  std::map<int, Client*>::iterator it = clients_.begin();
+  while (it != clients_.end())
+  {
+    Client* client = it->second;
+    if (all && !client->finished)
+    {
+      // Unblocks the client thread.
+      shutdown(client->sock, SD_BOTH);
+    }
+
+    if (all || client->finished)
+    {
+      reaped.push_back(client);
+      clients_.erase(it++);
+    }
+    else
+    {
+      ++it;
+    }
+  }
+  LeaveCriticalSection(&clients_lock_);
+
+  std::vector<Client*>::iterator reaped_it;
+  for (reaped_it = reaped.begin(); reaped_it != reaped.end(); ++reaped_it)
+  {
+    WaitForSingleObject((*reaped_it)->thread, INFINITE);
+    ::CloseHandle((*reaped_it)->thread);
+    DeleteCriticalSection(&(*reaped_it)->send_lock);
+    delete *reaped_it;
+  }
+}
+
+DWORD PicoPixelRelay::Impl::AcceptThread(void* ptr)
+{
+  PicoPixelRelay::Impl* impl = static_cast<PicoPixelRelay::Impl*>(ptr);
+
+  while (impl->running_)
+  {
+    SOCKET sock = accept(impl->listen_sock_, NULL, NULL);
+    if (sock == INVALID_SOCKET)
+      break;
+
+    impl->ReapClients(false);
+
+    Client* client = new Client;
+    client->sock = sock;
+    client->finished = false;
+    client->uplink_generation = 0;
+    client->tokens = 0.0;
+    client->refill_time = GetTickCount64();
+    client->impl = impl;
+    InitializeCriticalSection(&client->send_lock);
+
+    // The client is in the map before its thread starts so that ReapClients always sees it.
+    EnterCriticalSection(&impl->clients_lock_);
+    client->id = impl->next_client_id_++;
+    impl->clients_[client->id] = client;
+    client->thread = ::CreateThread(NULL, 0, ClientThread, client, 0, NULL);
+    if (client->thread == NULL)
+    {
+      impl->clients_.erase(client->id);
+    }
+    LeaveCriticalSection(&impl->clients_lock_);
+
+    if (client->thread == NULL)
+    {
+      printf("[PicoPixelRelay::Impl::AcceptThread] Failed to create client thread.\n");
+      closesocket(sock);
+      DeleteCriticalSection(&client->send_lock);
+      delete client;
+    }
+  }
+  return 0;
+}
+
+DWORD PicoPixelRelay::Impl::ClientThread(void* ptr)
+{
+  Client* client = static_cast<Client*>(ptr);
+  PicoPixelRelay::Impl* impl = client->impl;
+
+  impl->ServeClient(client);
+
+  EnterCriticalSection(&impl->clients_lock_);
+  client->finished = true;
+  shutdown(client->sock, SD_BOTH);
+  LeaveCriticalSection(&impl->clients_lock_);
+
+  // Waits for the uplink thread to finish writing to the socket.
+  EnterCriticalSection(&client->send_lock);
+  closesocket(client->sock);
+  LeaveCriticalSection(&client->send_lock);
+  return 0;
+}
+
+DWORD PicoPixelRelay::Impl::UplinkThread(void* ptr)
+{
+  PicoPixelRelay::Impl* impl = static_cast<PicoPixelRelay::Impl*>(ptr);
+
+  impl->ServeUplink(impl->uplink_sock_);
+
+  // The clients were announced on the lost connection. Disconnect them; they are announced again on the next
+  // connection when they reconnect.
+  impl->uplink_lost_ = true;
+  EnterCriticalSection(&impl->clients_lock_);
+  std::map<int, Client*>::iterator it;
+  for (it = impl->clients_.begin(); it != impl->clients_.end(); ++it)
+  {
+    if (!it->second->finished)
+    {
+      shutdown(it->second->sock, SD_BOTH);
+    }
+  }
+  LeaveCriticalSection(&impl->clients_lock_);
+  return 0;
+}
+
+PicoPixelRelay::PicoPixelRelay(std::string relay_id)
+  : impl_(new Impl(relay_id))
+{
+}
+
+PicoPixelRelay::~PicoPixelRelay()
+{
+  Stop();
+  delete impl_;
+}
+
+bool PicoPixelRelay::Start(const std::string& path, const std::string& host_ip, int port)
+{
+  if (impl_->running_)
+    return true;
+
+  struct sockaddr_un address;
+  std::memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(address.sun_path))
+  {
+    printf("[PicoPixelRelay::Start] Socket path too long: %s.\n", path.c_str());
+    return false;
+  }
+  std::memcpy(address.sun_path, path.c_str(), path.size());
+
+  WSADATA wsaData;
+  int err = WSAStartup( MAKEWORD( 2, 2 ), &wsaData );
+  if (err != 0)
+  {
+    printf("[PicoPixelRelay::Start] WSAStartup has failed: %d\n", err);
+    return false;
+  }
+
+  SOCKET sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sock == INVALID_SOCKET)
+  {
+    printf("[PicoPixelRelay::Start] Failed to create Unix domain socket: %d.\n", WSAGetLastError());
+    WSACleanup();
+    return false;
+  }
+
+  // The socket file of a relay that did not stop cleanly prevents the bind.
+  ::DeleteFile(path.c_str());
+  if ((bind(sock, (struct sockaddr*)&address, sizeof(address)) != 0) || (listen(sock, SOMAXCONN) != 0))
+  {
+    printf("[PicoPixelRelay::Start] Cannot listen on %s.\n", path.c_str());
+    closesocket(sock);
+    WSACleanup();
+    return false;
+  }
+
+  impl_->path_ = path;
+  impl_->host_ip_ = host_ip;
+  impl_->port_ = port;
+  impl_->listen_sock_ = sock;
+  impl_->running_ = true;
+  impl_->accept_thread_ = ::CreateThread(NULL, 0, Impl::AcceptThread, impl_, 0, NULL);
+  if (impl_->accept_thread_ == NULL)
+  {
+    printf("[PicoPixelRelay::Start] Failed to create accept thread.\n");
+    impl_->running_ = false;
+    closesocket(sock);
+    impl_->listen_sock_ = INVALID_SOCKET;
+    ::DeleteFile(path.c_str());
+    WSACleanup();
+    return false;
+  }
+  return true;
+}
+
+void PicoPixelRelay::Stop()
+{
+  if (!impl_->running_)
+    return;
+
+  impl_->running_ = false;
+  closesocket(impl_->listen_sock_);
+  WaitForSingleObject(impl_->accept_thread_, INFINITE);
+  ::CloseHandle(impl_->accept_thread_);
+  impl_->accept_thread_ = NULL;
+  impl_->listen_sock_ = INVALID_SOCKET;
+
+  impl_->ReapClients(true);
+
+  EnterCriticalSection(&impl_->uplink_lock_);
+  impl_->CloseUplink();
+  LeaveCriticalSection(&impl_->uplink_lock_);
+
+  ::DeleteFile(impl_->path_.c_str());
+  WSACleanup();
+}
+
+void PicoPixelRelay::SetClientRateLimit(unsigned int bytes_per_second)
+{
+  InterlockedExchange(&impl_->rate_limit_, (LONG)bytes_per_second);
+}
+
+int PicoPixelRelay::ClientCount()
+{
+  int count = 0;
+  EnterCriticalSection(&impl_->clients_lock_);
+  std::map<int, Impl::Client*>::const_iterator it;
+  for (it = impl_->clients_.begin(); it != impl_->clients_.end(); ++it)
+  {
+    count += it->second->finished ? 0 : 1;
+  }
+  LeaveCriticalSection(&impl_->clients_lock_);
+  return count;
+}
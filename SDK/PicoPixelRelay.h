@@ -0,0 +1,67 @@
+#ifndef PICO_PIXEL_RELAY_H
+#define PICO_PIXEL_RELAY_H
+
+# pragma comment(lib, "Ws2_32.lib")
+# include <windows.h>
+# include <winsock2.h>
+# include <Ws2tcpip.h>
+# include <string>
+# include "PicoPixelClientProtocol.h"
+
+/*!
+    Forwards the connections of the PicoPixelClient processes of a machine to a viewer over a single
+    connection. Clients reach the relay through a Unix domain socket with
+    PicoPixelClient::StartConnectionToRelay. The viewer sees each client as a connection of its own, named
+    after the client id of its hand shake, and what it sends to a client (marker updates, regions of
+    interest, credits) goes back to that client only.
+
+    The viewer must read relay packages. PicoPixelReceiver does, the Pico Pixel desktop application does not.
+    The relay checks the viewer's hand shake and does not connect to a viewer without relay support.
+
+    Each client is served by its own thread. The connection to Pico Pixel is made when the first client
+    connects and again after it is lost.
+*/
+class PicoPixelRelay
+{
+public:
+  PicoPixelRelay(std::string relay_id);
+  ~PicoPixelRelay();
+
+  /*!
+      Starts accepting clients.
+
+      @param path     Path of the Unix domain socket clients connect to. A file left by a previous relay is
+                      replaced.
+      @param host_ip  Address of Pico Pixel.
+      @param port     Port of Pico Pixel.
+      @return False if the socket could not be created.
+  */
+  bool Start(const std::string& path, const std::string& host_ip = "127.0.0.1", int port = PICO_PIXEL_SERVER_PORT);
+
+  /*!
+      Disconnects every client and Pico Pixel. Waits for the relay threads to end.
+  */
+  void Stop();
+
+  /*!
+      Bounds the bandwidth of each client. A client over its budget is not read from until it is back under
+      it, which blocks its sender thread or, with flow control, makes it hold or drop images.
+
+      @param bytes_per_second   Bandwidth of each client. 0 for no limit.
+  */
+  void SetClientRateLimit(unsigned int bytes_per_second);
+
+  /*!
+      @return Number of clients connected to the relay.
+  */
+  int ClientCount();
+
+private:
+  struct Impl;
+  Impl* impl_;
+
+  PicoPixelRelay(const PicoPixelRelay&);
+  PicoPixelRelay& operator=(const PicoPixelRelay&);
+};
+
+#endif // PICO_PIXEL_RELAY_H